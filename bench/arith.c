@@ -0,0 +1,69 @@
+// Arithmetic benchmark.
+//
+//   cc -O2 -o bench_arith bench/arith.c $(ls src/*.c | grep -v main.c) -lm -lpthread
+//   ./bench_arith [runs]
+//
+// Runs examples/primes.epsl, which is int modulo and comparisons, and a
+// loop mixing int and float arithmetic on every engine and reports the
+// best time of each.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../include/api.h"
+
+static const char *mixed =
+	"s := 0; f := 0.0;\n"
+	"for i := 0; i < 2000000; i += 1 {\n"
+	"\ts += i * 3 - i % 7;\n"
+	"\tf += i * 0.5 + f / 1024.0;\n"
+	"\tif s > i * 2 -> s -= i;\n"
+	"}\n";
+
+static const char *engines[] = {"vm", "tree", "closure"};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void print_error(EpslLocation loc, EpslErrorKind ek, char *msg) {
+	fprintf(stderr, "%s:%zu: %s\n", loc.file, loc.line_num + 1, msg);
+}
+
+static void bench(const char *name, EpslProgram *prog, int runs) {
+	if (!prog) {
+		fprintf(stderr, "%s: does not compile\n", name);
+		exit(1);
+	}
+
+	for (size_t e = 0; e < sizeof(engines) / sizeof(*engines); e++) {
+		double best = 1e9;
+		for (int run = 0; run < runs; run++) {
+			EpslCtx *ctx = epsl_new_ctx(print_error);
+			epsl_set_engine(ctx, (EpslEngine)e);
+
+			double start = now();
+			EpslResult res = epsl_run(prog, ctx);
+			double t = now() - start;
+
+			epsl_free(ctx);
+			if (res.got_err) exit(1);
+			if (t < best) best = t;
+		}
+
+		fprintf(stderr, "%-8s %-8s %8.1f ms\n", name, engines[e], best * 1e3);
+	}
+
+	epsl_program_free(prog);
+}
+
+int main(int argc, char **argv) {
+	int runs = argc > 1 ? atoi(argv[1]) : 5;
+
+	// primes prints its ratio once per run.
+	bench("primes", epsl_compile(print_error, "examples/primes.epsl"), runs);
+	bench("mixed", epsl_compile_str(print_error, (char*)mixed), runs);
+	return 0;
+}
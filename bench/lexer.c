@@ -0,0 +1,69 @@
+// Lexer throughput benchmark.
+//
+//   cc -O2 -o bench_lexer bench/lexer.c src/lexer.c src/intern.c
+//   ./bench_lexer [size in MB]
+//
+// Generates a synthetic script that looks like the examples (keywords,
+// identifiers, numbers, strings, comments) and reports tokenizing speed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/lexer.h"
+
+static const char *lines[] = {
+	"fn is_prime(n) {\n",
+	"\tif n == 1 || n == 2 => true;\n",
+	"\tfor i := 2; i < n / 2; i += 1 {\n",
+	"\t\tif n % i == 0 => false;\n",
+	"\t}\n",
+	"\treturn true;\n",
+	"}\n",
+	"// count primes below the search region and print the ratio\n",
+	"search_region := 30000; found := 0; ratio := 0.5;\n",
+	"grad := [\" \", \".\", \",\", \":\", \";\", \"i\", \"l\", \"o\", \"x\"];\n",
+	"while found < search_region { found += 1; if found > 10 -> break; else -> continue; }\n",
+	"dict := {\"zero\": 0, \"one\": none, \"two\": false};\n",
+	"for x in range(10) -> println(\"value: \", x, \" of \", search_region);\n",
+	"// ---------------------------------------------------------------------------------\n",
+	"//   configuration section: every entry below maps a key to a long template string\n",
+	"templates := {\"header\": \"<html><head><title>Generated report for the nightly build</title></head>\"};\n",
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+	size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+	StringBuilder src = {0};
+
+	for (size_t i = 0; src.count < mb << 20; i++)
+		sb_appendf(&src, "%s", lines[i % ARR_LEN(lines)]);
+
+	Interns interns = {0};
+	Sources srcs = {0};
+	size_t tokens = 0;
+	double best = 1e9;
+
+	for (int run = 0; run < 5; run++) {
+		Lexer l = lexer_from_str(&srcs, "bench", src.items);
+		l.interns = &interns;
+
+		double start = now();
+		Tokens toks = lexer_tokenize(&l);
+		double t = now() - start;
+
+		if (t < best) best = t;
+		tokens = toks.count;
+		da_free(&toks);
+	}
+
+	printf("%zu bytes, %zu tokens: %.1f MB/s, %.1f Mtok/s\n",
+		src.count, tokens, src.count / best / 1e6, tokens / best / 1e6);
+	sources_free(&srcs);
+	return 0;
+}
@@ -26,6 +26,8 @@ typedef struct {
 } EpslErrorCtx;
 
 typedef void EpslCtx;
+typedef void EpslImportCache;
+typedef void EpslProgram;
 typedef struct EpslVal EpslVal;
 
 typedef struct {
@@ -42,16 +44,26 @@ typedef struct {
 	void *arena;
 } EpslString;
 
+typedef enum {
+	EPSL_VAL_NONE,
+	EPSL_VAL_INT,
+	EPSL_VAL_FLOAT,
+	EPSL_VAL_BOOL,
+	EPSL_VAL_STR,
+	EPSL_VAL_LIST,
+	EPSL_VAL_DICT,
+} EpslValKind;
+
+// Hosts built with -DEPSL_NANBOX, like the library they link, see values
+// as 8 opaque bytes and go through the epsl_val_* functions below, which
+// work with either layout.
+#ifdef EPSL_NANBOX
+struct EpslVal {
+	uint64_t bits;
+};
+#else
 struct EpslVal  {
-	enum {
-		EPSL_VAL_NONE,
-		EPSL_VAL_INT,
-		EPSL_VAL_FLOAT,
-		EPSL_VAL_BOOL,
-		EPSL_VAL_STR,
-		EPSL_VAL_LIST,
-		EPSL_VAL_DICT,
-	} kind;
+	EpslValKind kind;
 	
 	union {
 		long long vint;
@@ -60,6 +72,7 @@ struct EpslVal  {
 		void *gc_obj;
 	} as;
 };
+#endif
 
 typedef struct {
 	EpslVal val;
@@ -74,6 +87,52 @@ EpslVal epsl_new_heap_val(EpslCtx *ctx, int kind);
 EpslCtx *epsl_from_str(EpslErrorFn errf, char *code);
 EpslCtx *epsl_from_file(EpslErrorFn errf, char *filename);
 EpslResult epsl_eval(EpslCtx *ctx);
+void epsl_free(EpslCtx *ctx);
+
+// Imported files are parsed once per context. A cache shared by several
+// contexts parses them once for all of them. Share it right after
+// creating a context and before epsl_eval; the contexts must not be
+// evaluated concurrently and the cache must outlive them.
+EpslImportCache *epsl_import_cache_new(void);
+void epsl_import_cache_free(EpslImportCache *cache);
+void epsl_share_import_cache(EpslCtx *ctx, EpslImportCache *cache);
+
+// Parses the files a script imports on up to threads threads before the
+// script itself is parsed. Errors are still reported in source order.
+void epsl_set_import_threads(EpslCtx *ctx, size_t threads);
+
+// Contexts created by epsl_from_file load foo.epslc instead of parsing
+// foo.epsl when it was built from the same sources by the same version.
+// This makes them write it after parsing.
+void epsl_cache_program(EpslCtx *ctx);
+
+// Constant expressions are folded before evaluation unless disabled.
+void epsl_set_fold(EpslCtx *ctx, bool enabled);
+
+// Scripts are compiled to bytecode and run on a virtual machine, the
+// tree walking evaluator is kept as a reference and as a fallback. The
+// closure engine compiles the tree to a chain of specialized C calls.
+typedef enum {
+	EPSL_ENGINE_VM,
+	EPSL_ENGINE_TREE,
+	EPSL_ENGINE_CLOSURE,
+} EpslEngine;
+
+void epsl_set_engine(EpslCtx *ctx, EpslEngine engine);
+
+// A compiled program is only read once compiled and can be run any
+// number of times, on one context or on several, also concurrently as
+// long as each context is used by one thread at a time. Names defined
+// by a run are dropped when it ends, names registered with
+// epsl_reg_var and epsl_reg_func are kept and can be given new values
+// between runs.
+EpslProgram *epsl_compile(EpslErrorFn errf, char *filename);
+EpslProgram *epsl_compile_str(EpslErrorFn errf, char *code);
+EpslResult epsl_run(EpslProgram *prog, EpslCtx *ctx);
+void epsl_program_free(EpslProgram *prog);
+
+// A context without a script of its own, for running compiled programs.
+EpslCtx *epsl_new_ctx(EpslErrorFn errf);
 
 void epsl_print_ast(EpslCtx *ctx);
 void epsl_print_tokens(EpslCtx *ctx);
@@ -81,10 +140,21 @@ void epsl_print_tokens(EpslCtx *ctx);
 void epsl_reg_var(EpslCtx *ctx, const char *id, EpslVal val);
 void epsl_reg_func(EpslCtx *ctx, const char *name, EpslRegFunc rf);
 
+EpslValKind epsl_val_kind(EpslVal val);
+long long epsl_val_int(EpslVal val);
+double epsl_val_float(EpslVal val);
+bool epsl_val_bool(EpslVal val);
+// Ints are made on the heap of a context when they do not fit in a
+// NaN-boxed value, epsl_eval_ctx gives the one of a context to hosts.
+EpslVal epsl_new_int(EpslEvalCtx *ctx, long long x);
+EpslVal epsl_new_float(double x);
+EpslVal epsl_new_bool(bool b);
+
 EpslString *epsl_val_get_str(EpslVal val);
 void epsl_val_set_str(EpslVal val, char *str);
 void epsl_val_list_append(EpslVal list, EpslVal v);
 
+EpslEvalCtx *epsl_eval_ctx(EpslCtx *ctx);
 void epsl_throw_error(EpslEvalCtx *ctx, EpslLocation loc, char *msg);
 
 #endif
@@ -0,0 +1,36 @@
+#ifndef CLOSURE_H
+#define CLOSURE_H
+
+#include "../include/eval.h"
+
+// The closure engine walks the AST once and turns every node into a Clo
+// whose fn was picked for the node's operator and the shape of its
+// operands (a local, a constant or anything else), so running it is a
+// chain of direct calls with no dispatch on node kinds. Control flow and
+// scoping go through ctx->state and the eval stack as in the tree
+// walker, values, the gc and builtins are shared with it.
+typedef struct Clo Clo;
+typedef Val (*CloFn)(EvalCtx *ctx, Clo *c);
+
+struct Clo {
+	CloFn fn;
+	AST *n;
+	Clo *a, *b, *c, *d;
+	Clo **items;
+	size_t count;
+	// Operands: the frame slot of a local, a constant, a name to look up.
+	size_t slot;
+	Val k;
+	char *id;
+};
+
+typedef struct {
+	Arena arena;
+	Clo *prog;
+} CloProg;
+
+void clo_compile(CloProg *cp, AST *prog);
+Val clo_run(EvalCtx *ctx, CloProg *cp);
+void clo_free(CloProg *cp);
+
+#endif
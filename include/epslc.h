@@ -0,0 +1,20 @@
+#ifndef EPSLC_H
+#define EPSLC_H
+
+#include <stdbool.h>
+#include "../include/parser.h"
+
+// Bump whenever the AST or the file layout changes, older files are
+// then rejected and rebuilt.
+#define EPSLC_VERSION 1
+
+// Compiled programs are stored next to the script: foo.epsl -> foo.epslc.
+char *epslc_path(Parser *p, char *file);
+
+// Loads a program written by epslc_write. Returns NULL, without
+// reporting anything, if the file is missing, was written by another
+// version, or any of the sources it was built from changed.
+AST *epslc_load(Parser *p, char *path);
+bool epslc_write(Parser *p, AST *prog, char *path);
+
+#endif
@@ -12,6 +12,14 @@ typedef struct {
 	char *line_char;
 } Location;
 
+// Compact position kept in tokens and AST nodes: the index of the source
+// in the Sources table and a byte offset into it. Decoded into a Location
+// by source_loc only when it is reported.
+typedef struct {
+	uint32_t src;
+	uint32_t off;
+} SrcLoc;
+
 typedef enum {
 	ERROR_COMPTIME,
 	ERROR_RUNTIME,
@@ -3,11 +3,15 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include "error.h"
 #include "../include/parser.h"
 
 typedef struct {
 	bool marked;
+	// A list range() made whose items are not there yet, see ValRange.
+	bool lazy;
 	int val_kind;
 	void *data;
 } GC_Object;
@@ -25,17 +29,104 @@ typedef struct {
 typedef struct Val Val;
 typedef DA(Val) Vals;
 
+// The data of a lazy list, the ints from start by step. Its list only has
+// the count set until eval_list_make makes the items, so the count of any
+// list can be read as it is.
+typedef struct {
+	Vals list;
+	long long start, step;
+} ValRange;
+
+typedef enum {
+	VAL_NONE,
+	VAL_INT,
+	VAL_FLOAT,
+	VAL_BOOL,
+	VAL_STR,
+	VAL_LIST,
+	VAL_DICT,
+} ValKind;
+
+typedef struct EvalCtx EvalCtx;
+typedef Val (*RegFunc)(EvalCtx *ctx, Location call_loc, Vals args);
+
+// Values are read with the V* macros and made with the val_* functions,
+// which are all the code needs to know of how they are stored.
+#ifdef EPSL_NANBOX
+// Built with -DEPSL_NANBOX a value is 8 bytes and the top 16 bits tell
+// what the rest holds. Below VAL_TAG_FLOAT the tag is the kind of a 48 bit
+// int, a bool or a GC_Object pointer, ints that need more bits are boxed
+// on the gc heap under the tag no other kind uses. Doubles are offset by
+// VAL_TAG_FLOAT << 48, which no double overflows once its NaNs are made
+// the canonical one of their sign, so that all zero bits are still none.
 struct Val {
-	enum {
-		VAL_NONE,
-		VAL_INT,
-		VAL_FLOAT,
-		VAL_BOOL,
-		VAL_STR,
-		VAL_LIST,
-		VAL_DICT,
-	} kind;
-	
+	u64 bits;
+};
+
+#define VAL_TAG_BOXED_INT ((u64)VAL_FLOAT)
+#define VAL_TAG_FLOAT     7ull
+#define VAL_PAYLOAD       ((1ull << 48) - 1)
+#define VAL_CANON_NAN     0x7FF8000000000000ull
+#define VAL_SIGN          0x8000000000000000ull
+#define VAL_INT_FITS(x)   ((x) >= -(1ll << 47) && (x) < (1ll << 47))
+
+static inline ValKind val_nb_kind(Val v) {
+	u64 tag = v.bits >> 48;
+	if (tag >= VAL_TAG_FLOAT) return VAL_FLOAT;
+	return tag == VAL_TAG_BOXED_INT ? VAL_INT : (ValKind)tag;
+}
+
+static inline GC_Object *val_nb_obj(Val v) {
+	return (GC_Object*)(uintptr_t)(v.bits & VAL_PAYLOAD);
+}
+
+static inline long long val_nb_int(Val v) {
+	if (v.bits >> 48 == VAL_TAG_BOXED_INT)
+		return *(long long*)val_nb_obj(v)->data;
+	return (long long)(v.bits << 16) >> 16;
+}
+
+static inline double val_nb_float(Val v) {
+	u64 bits = v.bits - (VAL_TAG_FLOAT << 48);
+	double d;
+	memcpy(&d, &bits, sizeof(d));
+	return d;
+}
+
+#define VKIND(v)    val_nb_kind(v)
+#define VINT(v)     val_nb_int(v)
+#define VFLOAT(v)   val_nb_float(v)
+#define VBOOL(v)    ((bool)((v).bits & 1))
+#define VOBJ(v)     val_nb_obj(v)
+#define VIS_HEAP(v) ((v).bits >> 48 >= VAL_STR && (v).bits >> 48 <= VAL_DICT)
+// Boxed ints are gc objects as well.
+#define VIS_GC(v)   (VIS_HEAP(v) || (v).bits >> 48 == VAL_TAG_BOXED_INT)
+
+Val eval_box_int(EvalCtx *ctx, long long x);
+
+static inline Val val_int(EvalCtx *ctx, long long x) {
+	if (!VAL_INT_FITS(x)) return eval_box_int(ctx, x);
+	return (Val){((u64)VAL_INT << 48) | ((u64)x & VAL_PAYLOAD)};
+}
+
+static inline Val val_float(double d) {
+	u64 bits;
+	memcpy(&bits, &d, sizeof(bits));
+	if (d != d) bits = (bits & VAL_SIGN) | VAL_CANON_NAN;
+	return (Val){bits + (VAL_TAG_FLOAT << 48)};
+}
+
+static inline Val val_bool(bool b) {
+	return (Val){((u64)VAL_BOOL << 48) | b};
+}
+
+static inline Val val_obj(int kind, GC_Object *obj) {
+	return (Val){((u64)kind << 48) | (u64)(uintptr_t)obj};
+}
+#else
+struct Val {
+	ValKind kind;
+
 	union {
 		long long vint;
 		double vfloat;
@@ -44,19 +135,65 @@ struct Val {
 	} as;
 };
 
-typedef struct EvalCtx EvalCtx;
-typedef Val (*RegFunc)(EvalCtx *ctx, Location call_loc, Vals args);
+#define VAL_INT_FITS(x) ((void)(x), true)
+
+#define VKIND(v)    ((v).kind)
+#define VINT(v)     ((v).as.vint)
+#define VFLOAT(v)   ((v).as.vfloat)
+#define VBOOL(v)    ((v).as.vbool)
+#define VOBJ(v)     ((v).as.gc_obj)
+#define VIS_HEAP(v) ((v).kind == VAL_STR || (v).kind == VAL_LIST || (v).kind == VAL_DICT)
+#define VIS_GC(v)   VIS_HEAP(v)
+
+static inline Val val_int(EvalCtx *ctx, long long x) {
+	(void)ctx;
+	return (Val){.kind = VAL_INT, .as.vint = x};
+}
+
+static inline Val val_float(double d) {
+	return (Val){.kind = VAL_FLOAT, .as.vfloat = d};
+}
+
+static inline Val val_bool(bool b) {
+	return (Val){.kind = VAL_BOOL, .as.vbool = b};
+}
+
+static inline Val val_obj(int kind, GC_Object *obj) {
+	return (Val){.kind = kind, .as.gc_obj = obj};
+}
+#endif
+
+// Ints wrap around on overflow, computed unsigned as signed overflow is
+// undefined in C.
+#define INT_WRAP(l, op, r) ((long long)((unsigned long long)(l) op (unsigned long long)(r)))
 
 #define VNONE ((Val){0})
-#define VDICT(v) ((ValDict*)v.as.gc_obj->data)
-#define VLIST(v) ((Vals*)v.as.gc_obj->data)
-#define VSTR(v) ((StringBuilder*)v.as.gc_obj->data)
+#define VDICT(v) ((ValDict*)VOBJ(v)->data)
+#define VLIST(v) ((Vals*)VOBJ(v)->data)
+#define VSTR(v) ((StringBuilder*)VOBJ(v)->data)
+
+void eval_list_make(GC_Object *obj);
+
+// The items of a list to change or to go through as a whole, lazy ones
+// are made first.
+static inline Vals *val_list(Val v) {
+	if (VOBJ(v)->lazy) eval_list_make(VOBJ(v));
+	return VLIST(v);
+}
+
+// Item i of a list, which must be there. Ranges are only lazy while their
+// ints need no boxing, so no context is needed to make them.
+static inline Val val_list_at(Val v, size_t i) {
+	GC_Object *obj = VOBJ(v);
+	if (!obj->lazy) return ((Vals*)obj->data)->items[i];
+	ValRange *r = obj->data;
+	return val_int(NULL, INT_WRAP(r->start, +, INT_WRAP(i, *, r->step)));
+}
 
 HT_DECL(ValDict, Val, Val);
 
 typedef struct {
 	enum {
-		EVAL_SYMB_TEMP,
 		EVAL_SYMB_VAR,
 		EVAL_SYMB_FUNC,
 		EVAL_SYMB_REG_FUNC,
@@ -65,14 +202,57 @@ typedef struct {
 
 	union {
 		struct { Val val;   } var;
-		struct { Val val;   } temp;
-		struct { AST *node; } func;
+		// code is the compiled body when the vm or the closure engine
+		// defined it, see vm.h and closure.h.
+		struct { AST *node; void *code; } func;
 		RegFunc reg_func;
 	} as;
 } EvalSymbol;
 
 typedef DA(EvalSymbol) EvalStack;
 
+// Builtins, names the host registered and the functions a program defines
+// at its top level, in an open addressed table keyed by interned id. They
+// are found after everything on the eval stack, which only holds locals.
+typedef struct {
+	EvalSymbol *slots;
+	size_t count;
+	size_t capacity;
+} EvalGlobals;
+
+// A top level function of the running program and what it replaced,
+// prev.id is NULL when the name was free. Undone when the run ends.
+typedef struct {
+	char *id;
+	EvalSymbol prev;
+} EvalGlobalDef;
+
+typedef DA(EvalGlobalDef) EvalGlobalDefs;
+
+// Where the callee of a call site was found, a global or an index into
+// the stack, valid while the context's epoch is the one it was found in.
+// loc is the site's location decoded for builtins, from the SrcLoc at,
+// sites are renumbered for each program.
+typedef struct {
+	size_t epoch;
+	size_t idx;
+	EvalSymbol *global;
+	SrcLoc at;
+	Location loc;
+} EvalCallCache;
+
+typedef DA(EvalCallCache) EvalCallCaches;
+
+// A call a function returns, taken with its arguments already evaluated
+// on the way back to the call running the function, which runs it next
+// in the same frame instead of nesting it. def is NULL when there is none.
+typedef struct {
+	AST *def;
+	void *code;
+	long fixed;
+	Vals args;
+} EvalTailCall;
+
 struct EvalCtx {
 	enum {
 		EVAL_CTX_NONE,
@@ -83,14 +263,62 @@ struct EvalCtx {
 
 	GarbageCollector gc;
 	EvalStack stack;
+	// Heap values not yet stored anywhere, kept alive until the body that
+	// made them ends.
+	Vals temps;
+	// Where the symbols of the running function start, resolved slots
+	// are relative to it.
+	size_t frame;
+	// Registers of the vm frames that are running.
+	Vals regs;
+	EvalGlobals globals;
+	EvalGlobalDefs global_defs;
+	// Inline caches of the running program's call sites. The epoch moves
+	// whenever a function is defined and whenever the globals change,
+	// since either may shadow or move a cached callee.
+	EvalCallCaches calls;
+	size_t epoch;
+	EvalTailCall tail;
+	Interns *interns;
+	// The table of the program the globals were last bound to.
+	Interns *bound;
+	Sources *srcs;
 	ErrorCtx err_ctx;
 };
 
 void eval_collect_garbage(EvalCtx *ctx);
 Val eval_new_heap_val(EvalCtx *ctx, int kind);
+Val eval_new_range(EvalCtx *ctx, long long start, long long step, size_t count);
 
 Val eval(EvalCtx *ctx, AST *n);
+
+// Shared with the vm, which evaluates operands itself and passes the
+// node they come from for errors.
+void eval_error(EvalCtx *ctx, SrcLoc loc, char *msg);
+EvalSymbol *eval_stack_get(EvalCtx *es, char *id);
+EvalSymbol *eval_global_get(EvalCtx *ctx, char *id);
+EvalSymbol *eval_lookup(EvalCtx *ctx, char *id);
+EvalSymbol *eval_callee(EvalCtx *ctx, AST *call);
+Location eval_call_loc(EvalCtx *ctx, AST *call);
+void eval_def_func(EvalCtx *ctx, char *id, AST *node, void *code);
+void eval_def_global(EvalCtx *ctx, char *id, AST *node, void *code);
+void eval_drop_globals(EvalCtx *ctx, size_t defs);
+void eval_bind_sites(EvalCtx *ctx, AST *prog);
+Val eval_counted_for(EvalCtx *ctx, AST *n);
+bool eval_lit_const(AST *n, Val *v);
+Val eval_binop_vals(EvalCtx *ctx, AST *n, Val lv, Val rv);
+Val eval_unop_val(EvalCtx *ctx, AST *n, Val v);
+void eval_val_mut(EvalCtx *ctx, SrcLoc op_loc, AST_Op op, Val *mut, Val to);
+void eval_index_mut(EvalCtx *ctx, AST *n, Val container, Val key, Val rhs_val);
+long eval_call_arity(EvalCtx *ctx, AST *call, AST *def, size_t argc);
+void eval_bind_params(EvalCtx *ctx, AST *def, size_t base, size_t fixed);
+Val eval_tail_call(EvalCtx *ctx, AST *call);
+void eval_tail_take(EvalCtx *ctx, AST *def, void *code, long fixed, size_t base);
+AST *eval_tail_enter(EvalCtx *ctx, size_t base);
+void eval_free(EvalCtx *ctx);
 void eval_reg_var(EvalCtx *ctx, const char *id, Val val);
+void eval_rebind_interns(EvalCtx *ctx, Interns *interns);
+void eval_bind_interns(EvalCtx *ctx, Interns *prog);
 void eval_reg_func(EvalCtx *ctx, const char *id, RegFunc rf);
 
 #endif
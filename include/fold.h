@@ -0,0 +1,14 @@
+#ifndef FOLD_H
+#define FOLD_H
+
+#include "../include/parser.h"
+
+// Replaces operators whose operands are all numeric, bool or none
+// literals with their value, computed by eval itself so the result is
+// exactly what running them would give. Also drops identities that
+// cannot change their operand, like b && true on a bool or x * 1 on a
+// float, and if/else branches and while loops whose condition is a
+// literal. Operations that would fail at run time are left alone.
+void fold(Sources *srcs, AST *prog);
+
+#endif
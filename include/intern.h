@@ -0,0 +1,21 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+#include "../3dparty/cplus.h"
+
+// Identifiers are stored once per table, so two interned names
+// from the same table are equal iff their pointers are equal.
+typedef struct {
+	char **slots;
+	size_t count;
+	size_t capacity;
+	Arena arena;
+} Interns;
+
+char *intern(Interns *in, const char *str, size_t len);
+char *intern_cstr(Interns *in, const char *str);
+char *intern_find(Interns *in, const char *str);
+void interns_free(Interns *in);
+
+#endif
@@ -2,6 +2,8 @@
 #define LEXER_H
 
 #include "error.h"
+#include "intern.h"
+#include "../3dparty/cplus.h"
 #include <stdbool.h>
 
 typedef enum {
@@ -17,22 +19,57 @@ typedef enum {
 	TOK_TILDA, TOK_ERR, TOK_ARROW, TOK_ARROW_EQ, TOK_NONE,
 } TokenKind;
 
+typedef struct {
+	char *items;
+	size_t count;
+} StrSlice;
+
+// TOK_STRING, TOK_INT and TOK_FLOAT point into the source and are not
+// NUL-terminated: len is their length and escaped tells whether a string
+// literal has backslash escapes that still need decoding.
 typedef struct {
 	TokenKind kind;
-	Location loc;
+	SrcLoc loc;
 	char *data;
+	size_t len;
+	bool escaped;
 } Token;
 
+typedef DA(Token) Tokens;
+
+// lines holds the offsets of line starts and is built on the first
+// source_loc call. Sources added by lexer_from_str are borrowed and not
+// freed by sources_free.
+typedef struct {
+	char *file;
+	char *code;
+	size_t size;
+	size_t map_size;
+	bool borrowed;
+	DA(u32) lines;
+} Source;
+
+typedef DA(Source) Sources;
+
 typedef struct {
 	char *cur_char;
-	Location cur_loc;
+	char *code;
+	u32 src;
+	SrcLoc cur_loc;
+	Interns *interns;
 } Lexer;
 
-Lexer lexer_from_str(char *file, char *code);
-Lexer lexer_from_file(char *file);
+Lexer lexer_from_str(Sources *srcs, char *file, char *code);
+Lexer lexer_from_file(Sources *srcs, char *file);
+Lexer lexer_from_source(Sources *srcs, Source src);
 Token lexer_next(Lexer *l);
-Token lexer_peek(Lexer *l);
-Token lexer_peek2(Lexer *l);
-void lexer_free(Lexer *lexer);
+Tokens lexer_tokenize(Lexer *l);
+size_t lexer_unescape(char *dst, const char *src, size_t len);
+bool source_load(Source *src, char *file);
+void source_free(Source *src);
+void sources_free(Sources *srcs);
+u64 source_hash(Source *src);
+void source_index_lines(Source *src);
+Location source_loc(Sources *srcs, SrcLoc loc);
 
 #endif
@@ -6,6 +6,10 @@
 #include "error.h"
 #include "../3dparty/cplus.h"
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 typedef enum {
 	AST_OP_EQ,
 	AST_OP_ADD,
@@ -43,17 +47,54 @@ typedef struct {
 		double vfloat;
 		long long vint;
 		bool vbool;
-		char *vstr;
+		StrSlice vstr;
 	} as;
 } AST_Literal;
 
+typedef struct AST AST;
+
+// Child lists are exact-sized and never grow after parsing.
+typedef struct {
+	AST **items;
+	size_t count;
+} ASTs;
+
+// A parsed import, keyed by canonical path and source hash. body is NULL
+// while owner, the import job parsing it, is still running.
+typedef struct {
+	char *path;
+	u64 hash;
+	AST *body;
+	void *owner;
+} Module;
+
+// Owns everything parsed ASTs point into: interned ids, sources and the
+// node arena. Each context has its own, or several can share one so
+// that common imports are parsed once per process.
+typedef struct {
+	DA(Module*) mods;
+	Interns interns;
+	Sources srcs;
+	Arena arena;
+#ifndef _WIN32
+	pthread_mutex_t *lock;
+#endif
+} ImportCache;
+
 typedef struct {
 	Lexer lexer;
+	Tokens toks;
+	size_t cur;
+	ImportCache *cache;
+	Arena *arena;
+	void *job;
+	size_t threads;
+	DA(AST*) scratch;
 	ErrorCtx err_ctx;
 } Parser;
 
-typedef struct AST AST;
-typedef DA(AST*) ASTs;
+// Identifiers (var, var_def.id, func_call.id, func_def.id, st_foreach.var_id)
+// are interned in the lexer's table and can be compared by pointer.
 struct AST {
 	enum {
 		AST_PROG,
@@ -80,7 +121,10 @@ struct AST {
 		AST_CONT,
 	} kind;
 
-	Location loc;
+	SrcLoc loc;
+	// Set by resolve on vars and calls: 1 + the frame slot of the symbol,
+	// 0 when it has to be looked up by name.
+	u32 slot;
 
 	union {
 		struct {
@@ -100,6 +144,9 @@ struct AST {
 			AST *cond;
 			AST *mut;
 			AST *body;
+			// Set by resolve when the loop counts a variable the body
+			// does not assign, see eval_counted_for.
+			bool counted;
 		} st_for;
 		struct {
 			char *var_id;
@@ -112,6 +159,8 @@ struct AST {
 		} var_def;
 		struct {
 			AST *body;
+			// Number of call sites with an inline cache.
+			u32 sites;
 		} prog;
 		struct {
 			AST *expr;
@@ -128,6 +177,13 @@ struct AST {
 		struct {
 			char *id;
 			ASTs args;
+			// Set by resolve on calls looked up by name: 1 + the index
+			// of their inline cache, 0 when they have none.
+			u32 site;
+			// Set by resolve when a function returns the call and no
+			// name of its frame is looked up by name anywhere, so the
+			// callee may run in the frame instead, see eval_tail_call.
+			bool tail;
 		} func_call;
 		struct {
 			char *id;
@@ -143,10 +199,23 @@ struct AST {
 	} as;
 };
 
-#define peek(p)  lexer_peek(&p->lexer)
-#define next(p)  lexer_next(&p->lexer)
-#define peek2(p) lexer_peek2(&p->lexer)
+static inline Token parser_peek(Parser *p, size_t off) {
+	size_t i = p->cur + off;
+	if (i >= p->toks.count) i = p->toks.count - 1;
+	return p->toks.items[i];
+}
+
+static inline Token parser_next(Parser *p) {
+	Token t = parser_peek(p, 0);
+	if (p->cur < p->toks.count - 1) p->cur++;
+	return t;
+}
+
+#define peek(p)  parser_peek(p, 0)
+#define next(p)  parser_next(p)
+#define peek2(p) parser_peek(p, 1)
 
 AST *parse(Parser *p);
+void import_cache_free(ImportCache *ic);
 
 #endif
@@ -5,6 +5,6 @@
 #include "../include/parser.h"
 
 void lexer_print(Lexer l);
-void ast_print(AST *n, int spaces);
+void ast_print(Sources *srcs, AST *n, int spaces);
 
 #endif
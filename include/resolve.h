@@ -0,0 +1,17 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include "../include/parser.h"
+
+// Binds vars and calls to the slot of a symbol defined in the same
+// function (or at the top level of the program) so eval can index the
+// frame instead of searching the stack. Everything else, builtins,
+// globals used from functions and a caller's locals, stays looked up by
+// name, which keeps the dynamic scoping of the language intact.
+// Calls looked up by name get a site for their inline cache, unless a
+// variable anywhere in the program could shadow their callee. Calls a
+// function returns are marked as tail calls when no name of its frame
+// is ever looked up by name.
+void resolve(AST *prog);
+
+#endif
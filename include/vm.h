@@ -0,0 +1,90 @@
+#ifndef VM_H
+#define VM_H
+
+#include "../include/eval.h"
+
+// Register bytecode. Expression temporaries live in the registers of
+// the running frame, named symbols stay on the eval stack so callees
+// keep seeing their caller's locals. Operands are registers, frame
+// slots (as resolved by resolve), or indexes into the chunk's constants,
+// names or the program's chunks. Jump targets are instruction indexes
+// split over b (low half) and c (high half).
+#define VM_OPS(X) \
+	X(OP_LOADK)    /* a = consts[b] */ \
+	X(OP_LOADNONE) /* a = none */ \
+	X(OP_MOVE)     /* a = b */ \
+	X(OP_EVAL)     /* a = value of the node, evaluated by the tree walker */ \
+	X(OP_GETLOCAL) /* a = slot b */ \
+	X(OP_GETNAME)  /* a = symbol names[b] */ \
+	X(OP_SETLOCAL) /* slot b x= a */ \
+	X(OP_SETNAME)  /* symbol names[b] x= a */ \
+	X(OP_SETINDEX) /* a[b] x= c, x and the location come from the node */ \
+	X(OP_DEFVAR)   /* push names[b] = a */ \
+	X(OP_DEFFUNC)  /* push fn names[b] compiled as chunks[a] */ \
+	X(OP_DEFGLOBAL) /* define top level fn names[b] as chunks[a] */ \
+	X(OP_POPTO)    /* drop the frame's symbols from slot a on */ \
+	X(OP_BINOP)    /* a = b x c */ \
+	X(OP_UNOP)     /* a = x b */ \
+	X(OP_NEWLIST)  /* a = [] */ \
+	X(OP_APPEND)   /* append b to the list a */ \
+	X(OP_NEWDICT)  /* a = {} */ \
+	X(OP_DICTSET)  /* a[b] = c on the dict a */ \
+	X(OP_JMP)      /* jump */ \
+	X(OP_JMPF)     /* jump if a is false, fail if it is not a bool */ \
+	X(OP_ITER)     /* c = b[a++] and skip the next instruction while a < len(b) */ \
+	X(OP_CALL)     /* a = slot c(a, ..., a + b - 1), in place of the frame if x */ \
+	X(OP_CALLN)    /* a = names[c](a, ..., a + b - 1), in place of the frame if x */ \
+	X(OP_RET)      /* return a */ \
+	X(OP_RETNONE)  /* return none */ \
+	X(OP_ERR)      /* fail with names[b] at the node */ \
+	/* Superinstructions, see vm_fuse. */ \
+	X(OP_BINOP_RL)    /* GETLOCAL r, BINOP a = b x r */ \
+	X(OP_BINOP_RK)    /* LOADK r, BINOP a = b x r */ \
+	X(OP_BINOP_LL)    /* GETLOCAL r, BINOP_RL with a = b = r */ \
+	X(OP_BINOP_LK)    /* GETLOCAL r, BINOP_RK with a = b = r */ \
+	X(OP_JMPF_RR)     /* BINOP, JMPF on its result */ \
+	X(OP_JMPF_RL)     /* GETLOCAL r, JMPF_RR on b x r */ \
+	X(OP_JMPF_RK)     /* LOADK r, JMPF_RR on b x r */ \
+	X(OP_JMPF_LL)     /* GETLOCAL r, JMPF_RL with a = b = r */ \
+	X(OP_JMPF_LK)     /* GETLOCAL r, JMPF_RK with a = b = r */ \
+	X(OP_SETLOCAL_K)  /* LOADK r, SETLOCAL of r */ \
+	X(OP_SETLOCAL_L)  /* GETLOCAL r, SETLOCAL of r */
+
+typedef enum {
+	#define X(op) op,
+	VM_OPS(X)
+	#undef X
+	OP_COUNT,
+} OpCode;
+
+typedef struct {
+	u8 op, x;
+	u16 a, b, c;
+} Instr;
+
+#define INSTR_TARGET(in) ((u32)(in).b | (u32)(in).c << 16)
+
+typedef struct {
+	DA(Instr) code;
+	DA(AST*) nodes; // what each instruction was compiled from
+	Vals consts;
+	DA(char*) names;
+	size_t nregs;
+} Chunk;
+
+// chunks[0] is the program, the rest are the functions it defines.
+typedef struct {
+	DA(Chunk*) chunks;
+} VmProg;
+
+// Returns false if the program exceeds the limits of the encoding, it
+// then has to be run by the tree walker.
+bool vm_compile(VmProg *vp, AST *prog);
+// Replaces the first instruction of the most frequent sequences with a
+// superinstruction that runs the whole sequence. The rest is left in
+// place for jumps into it, the superinstruction skips over it.
+void vm_fuse(Chunk *ch);
+Val vm_run(EvalCtx *ctx, VmProg *vp);
+void vm_free(VmProg *vp);
+
+#endif
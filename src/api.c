@@ -1,6 +1,11 @@
 #include "../include/parser.h"
 #include "../include/eval.h"
 #include "../include/print.h"
+#include "../include/epslc.h"
+#include "../include/resolve.h"
+#include "../include/fold.h"
+#include "../include/vm.h"
+#include "../include/closure.h"
 #include "../include/api.h"
 
 #define COPY(var_dst, src_var) \
@@ -9,47 +14,146 @@
 typedef struct {
 	Parser parser;
 	EvalCtx eval_ctx;
+	ImportCache own;
+	char *epslc;
+	bool write_epslc;
+	bool no_fold;
+	EpslEngine engine;
+	VmProg vm;
+	CloProg clo;
 } EpslCtxR;
 
 extern void reg_stdlib(EvalCtx *ctx);
 
-EpslCtx *epsl_from_str(EpslErrorFn errf, char *code) {
+EpslCtxR *ctx_alloc(EpslErrorFn errf) {
 	EpslCtxR *ctx = malloc(sizeof(EpslCtxR));
+	*ctx = (EpslCtxR){0};
+
 	ctx->parser = (Parser){
-		.lexer = lexer_from_str("script", code),
+		.cache = &ctx->own,
+		.arena = &ctx->own.arena,
 		.err_ctx.errf = (ErrorFn) errf,
 	};
 
 	ctx->eval_ctx = (EvalCtx){
 		.err_ctx.errf = (ErrorFn) errf,
+		.interns = &ctx->own.interns,
+		.srcs = &ctx->own.srcs,
 		.stack = {0},
 		.gc = {0},
 	};
 
+	return ctx;
+}
+
+EpslCtx *epsl_from_str(EpslErrorFn errf, char *code) {
+	EpslCtxR *ctx = ctx_alloc(errf);
+	ctx->parser.lexer = lexer_from_str(&ctx->own.srcs, "script", code);
+	ctx->parser.lexer.interns = &ctx->own.interns;
+
 	reg_stdlib(&ctx->eval_ctx);
 	return ctx;
 }
 
+EpslCtx *epsl_new_ctx(EpslErrorFn errf) {
+	return epsl_from_str(errf, "");
+}
+
 EpslCtx *epsl_from_file(EpslErrorFn errf, char *filename) {
-	Lexer lex = lexer_from_file(filename);
-	if (!lex.cur_char) return NULL;
+	EpslCtxR *ctx = ctx_alloc(errf);
+	ctx->parser.lexer = lexer_from_file(&ctx->own.srcs, filename);
+	if (!ctx->parser.lexer.cur_char) {
+		free(ctx);
+		return NULL;
+	}
 
-	EpslCtxR *ctx = malloc(sizeof(EpslCtxR));
-	ctx->parser = (Parser){
-		.lexer = lex,
-		.err_ctx.errf = (ErrorFn) errf,
-	};
-
-	ctx->eval_ctx = (EvalCtx){
-		.err_ctx.errf = (ErrorFn) errf,
-		.stack = {0},
-		.gc = {0},
-	};
+	ctx->parser.lexer.interns = &ctx->own.interns;
+	ctx->epslc = epslc_path(&ctx->parser, filename);
 
 	reg_stdlib(&ctx->eval_ctx);
 	return ctx;
 }
 
+// Scripts loaded from a file use their compiled program when it is still
+// valid, and write it when asked to.
+AST *ctx_parse(EpslCtxR *r) {
+	AST *prog = r->epslc ? epslc_load(&r->parser, r->epslc) : NULL;
+	if (!prog) {
+		prog = parse(&r->parser);
+		if (r->parser.err_ctx.got_err) return prog;
+		if (r->write_epslc) epslc_write(&r->parser, prog, r->epslc);
+	}
+
+	if (!r->no_fold) fold(&r->parser.cache->srcs, prog);
+	resolve(prog);
+	return prog;
+}
+
+void epsl_cache_program(EpslCtx *ctx) {
+	EpslCtxR *r = ctx;
+	r->write_epslc = r->epslc != NULL;
+}
+
+void epsl_set_fold(EpslCtx *ctx, bool enabled) {
+	EpslCtxR *r = ctx;
+	r->no_fold = !enabled;
+}
+
+void epsl_set_engine(EpslCtx *ctx, EpslEngine engine) {
+	EpslCtxR *r = ctx;
+	r->engine = engine;
+}
+
+void epsl_free(EpslCtx *ctx) {
+	EpslCtxR *r = ctx;
+	vm_free(&r->vm);
+	clo_free(&r->clo);
+	eval_free(&r->eval_ctx);
+	da_free(&r->parser.toks);
+	import_cache_free(&r->own);
+	free(r);
+}
+
+void epsl_set_import_threads(EpslCtx *ctx, size_t threads) {
+	EpslCtxR *r = ctx;
+	r->parser.threads = threads;
+}
+
+EpslImportCache *epsl_import_cache_new(void) {
+	ImportCache *ic = malloc(sizeof(ImportCache));
+	*ic = (ImportCache){0};
+	return ic;
+}
+
+void epsl_import_cache_free(EpslImportCache *cache) {
+	import_cache_free(cache);
+	free(cache);
+}
+
+// The context's sources and registered names move into the shared cache,
+// which from then on owns everything the context parses.
+void epsl_share_import_cache(EpslCtx *ctx, EpslImportCache *cache) {
+	EpslCtxR *r = ctx;
+	ImportCache *ic = cache;
+
+	size_t base = ic->srcs.count;
+	da_foreach (Source, src, &r->own.srcs)
+		da_append(&ic->srcs, *src);
+	r->own.srcs.count = 0;
+
+	r->parser.cache = ic;
+	r->parser.arena = &ic->arena;
+	r->parser.lexer.src += base;
+	r->parser.lexer.interns = &ic->interns;
+	r->eval_ctx.srcs = &ic->srcs;
+	eval_rebind_interns(&r->eval_ctx, &ic->interns);
+}
+
+EpslEvalCtx *epsl_eval_ctx(EpslCtx *ctx) {
+	EpslCtxR *r = ctx;
+	return (EpslEvalCtx*) &r->eval_ctx;
+}
+
 void epsl_throw_error(EpslEvalCtx *ctx, EpslLocation loc, char *msg) {
 	EvalCtx *r = (EvalCtx*) ctx;
 	Location rloc; COPY(&rloc, &loc);
@@ -68,14 +172,20 @@ void epsl_reg_var(EpslCtx *ctx, const char *id, EpslVal val) {
 	eval_reg_var(&r->eval_ctx, id, ev);
 }
 
-EpslResult epsl_eval(EpslCtx *ctx) {
-	EpslCtxR *r = ctx;
-	AST *ast = parse(&r->parser);
-	if (r->parser.err_ctx.got_err)
-		return (EpslResult){.got_err = true};
-
+// vp and cp are the compiled ast, ast is walked when the engine's one
+// is missing.
+EpslResult ctx_run(EpslCtxR *r, AST *ast, VmProg *vp, CloProg *cp) {
 	EpslVal erv;
-	Val rv = eval(&r->eval_ctx, ast);
+	Val rv;
+	size_t defs = r->eval_ctx.global_defs.count;
+	eval_bind_sites(&r->eval_ctx, ast);
+	if (r->engine == EPSL_ENGINE_VM && vp)
+		rv = vm_run(&r->eval_ctx, vp);
+	else if (r->engine == EPSL_ENGINE_CLOSURE && cp->prog)
+		rv = clo_run(&r->eval_ctx, cp);
+	else
+		rv = eval(&r->eval_ctx, ast);
+	eval_drop_globals(&r->eval_ctx, defs);
 	if (r->eval_ctx.err_ctx.got_err)
 		return (EpslResult){.got_err = true};
 
@@ -86,9 +196,116 @@ EpslResult epsl_eval(EpslCtx *ctx) {
 	};
 }
 
+EpslResult epsl_eval(EpslCtx *ctx) {
+	EpslCtxR *r = ctx;
+	AST *ast = ctx_parse(r);
+	if (r->parser.err_ctx.got_err)
+		return (EpslResult){.got_err = true};
+
+	bool compiled = r->engine == EPSL_ENGINE_VM && vm_compile(&r->vm, ast);
+	if (r->engine == EPSL_ENGINE_CLOSURE) clo_compile(&r->clo, ast);
+	return ctx_run(r, ast, compiled ? &r->vm : NULL, &r->clo);
+}
+
+typedef struct {
+	ImportCache cache;
+	AST *ast;
+	VmProg vm;
+	CloProg clo;
+} EpslProgramR;
+
+EpslProgram *program_compile(Parser *p, EpslProgramR *prog, char *epslc) {
+	prog->ast = epslc ? epslc_load(p, epslc) : NULL;
+	if (!prog->ast) prog->ast = parse(p);
+	da_free(&p->toks);
+	da_free(&p->scratch);
+
+	if (p->err_ctx.got_err) {
+		epsl_program_free(prog);
+		return NULL;
+	}
+
+	fold(&prog->cache.srcs, prog->ast);
+	resolve(prog->ast);
+	vm_compile(&prog->vm, prog->ast);
+	clo_compile(&prog->clo, prog->ast);
+
+	// Runs only read the program from here on, so the line tables
+	// errors need are built now instead of on the first error.
+	da_foreach (Source, src, &prog->cache.srcs)
+		source_index_lines(src);
+	return prog;
+}
+
+Parser program_parser(EpslErrorFn errf, EpslProgramR *prog) {
+	return (Parser){
+		.cache = &prog->cache,
+		.arena = &prog->cache.arena,
+		.err_ctx.errf = (ErrorFn) errf,
+	};
+}
+
+EpslProgram *epsl_compile(EpslErrorFn errf, char *filename) {
+	EpslProgramR *prog = malloc(sizeof(EpslProgramR));
+	*prog = (EpslProgramR){0};
+
+	Parser p = program_parser(errf, prog);
+	p.lexer = lexer_from_file(&prog->cache.srcs, filename);
+	if (!p.lexer.cur_char) {
+		free(prog);
+		return NULL;
+	}
+
+	p.lexer.interns = &prog->cache.interns;
+	return program_compile(&p, prog, epslc_path(&p, filename));
+}
+
+EpslProgram *epsl_compile_str(EpslErrorFn errf, char *code) {
+	EpslProgramR *prog = malloc(sizeof(EpslProgramR));
+	*prog = (EpslProgramR){0};
+
+	Parser p = program_parser(errf, prog);
+	p.lexer = lexer_from_str(&prog->cache.srcs, "script", code);
+	p.lexer.interns = &prog->cache.interns;
+	return program_compile(&p, prog, NULL);
+}
+
+EpslResult epsl_run(EpslProgram *program, EpslCtx *ctx) {
+	EpslCtxR *r = ctx;
+	EpslProgramR *prog = program;
+
+	Sources *srcs = r->eval_ctx.srcs;
+	Interns *bound = r->eval_ctx.bound;
+	r->eval_ctx.err_ctx.got_err = false;
+	r->eval_ctx.state = EVAL_CTX_NONE;
+	r->eval_ctx.srcs = &prog->cache.srcs;
+	eval_bind_interns(&r->eval_ctx, &prog->cache.interns);
+
+	size_t base = r->eval_ctx.stack.count;
+	size_t temps = r->eval_ctx.temps.count;
+	EpslResult res = ctx_run(r, prog->ast, prog->vm.chunks.count ? &prog->vm : NULL, &prog->clo);
+	r->eval_ctx.stack.count = base;
+	r->eval_ctx.temps.count = temps;
+
+	// The program may be freed before the context is used again, so the
+	// registered names go back to the context's own table.
+	eval_rebind_interns(&r->eval_ctx, r->eval_ctx.interns);
+	r->eval_ctx.bound = bound;
+	r->eval_ctx.srcs = srcs;
+	return res;
+}
+
+void epsl_program_free(EpslProgram *program) {
+	EpslProgramR *prog = program;
+	vm_free(&prog->vm);
+	clo_free(&prog->clo);
+	import_cache_free(&prog->cache);
+	free(prog);
+}
+
 void epsl_print_ast(EpslCtx *ctx) {
 	EpslCtxR *r = ctx;
-	ast_print(parse(&r->parser), 0);
+	ast_print(&r->parser.cache->srcs, ctx_parse(r), 0);
 }
 
 void epsl_print_tokens(EpslCtx *ctx) {
@@ -103,6 +320,44 @@ EpslVal epsl_new_heap_val(EpslCtx *ctx, int kind) {
 	return ev;
 }
 
+EpslValKind epsl_val_kind(EpslVal val) {
+	Val v; COPY(&v, &val);
+	return (EpslValKind)VKIND(v);
+}
+
+long long epsl_val_int(EpslVal val) {
+	Val v; COPY(&v, &val);
+	return VINT(v);
+}
+
+double epsl_val_float(EpslVal val) {
+	Val v; COPY(&v, &val);
+	return VFLOAT(v);
+}
+
+bool epsl_val_bool(EpslVal val) {
+	Val v; COPY(&v, &val);
+	return VBOOL(v);
+}
+
+EpslVal epsl_new_int(EpslEvalCtx *ctx, long long x) {
+	Val v = val_int((EvalCtx*) ctx, x);
+	EpslVal ev; COPY(&ev, &v);
+	return ev;
+}
+
+EpslVal epsl_new_float(double x) {
+	Val v = val_float(x);
+	EpslVal ev; COPY(&ev, &v);
+	return ev;
+}
+
+EpslVal epsl_new_bool(bool b) {
+	Val v = val_bool(b);
+	EpslVal ev; COPY(&ev, &v);
+	return ev;
+}
+
 EpslString *epsl_val_get_str(EpslVal val) {
 	Val v; COPY(&v, &val);
 	return (EpslString*)VSTR(v);
@@ -119,5 +374,5 @@ void epsl_val_list_append(EpslVal list, EpslVal v) {
 	Val rlist, rv;
 	COPY(&rlist, &list);
 	COPY(&rv, &v);
-	da_append(VLIST(rlist), rv);
+	da_append(val_list(rlist), rv);
 }
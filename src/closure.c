@@ -0,0 +1,711 @@
+#include <stdlib.h>
+#include "../include/closure.h"
+
+#define RUN(s) ((s)->fn(ctx, (s)))
+#define FAIL_IF_ERR() if (ctx->err_ctx.got_err) return VNONE
+
+// Operand fetches of the specialized binops, s is the operand's closure.
+#define FETCH_X(v, s) \
+	Val v = RUN(s); \
+	FAIL_IF_ERR();
+
+#define FETCH_K(v, s) \
+	Val v = (s)->k;
+
+#define FETCH_L(v, s) \
+	EvalSymbol *v##_es = &ctx->stack.items[ctx->frame + (s)->slot]; \
+	if (v##_es->kind != EVAL_SYMB_VAR) { \
+		eval_error(ctx, (s)->n->loc, "no such variable"); \
+		return VNONE; \
+	} \
+	Val v = v##_es->as.var.val;
+
+#define IS_NUM(v) (VKIND(v) == VAL_INT || VKIND(v) == VAL_FLOAT)
+#define NUM(v) (VKIND(v) == VAL_INT ? (double)VINT(v) : VFLOAT(v))
+
+// Numbers are combined the way eval_binop_vals does it, ints exactly and
+// the rest as doubles, and anything else is left to it.
+#define ARITH(OP) \
+	if (VKIND(lv) == VAL_INT && VKIND(rv) == VAL_INT) \
+		return val_int(ctx, INT_WRAP(VINT(lv), OP, VINT(rv))); \
+	if (IS_NUM(lv) && IS_NUM(rv)) \
+		return val_float(NUM(lv) OP NUM(rv)); \
+	return eval_binop_vals(ctx, c->n, lv, rv);
+
+#define DIV(OP) \
+	if (IS_NUM(lv) && IS_NUM(rv)) \
+		return val_float(NUM(lv) / NUM(rv)); \
+	return eval_binop_vals(ctx, c->n, lv, rv);
+
+#define CMP(OP) \
+	if (VKIND(lv) == VAL_INT && VKIND(rv) == VAL_INT) \
+		return val_bool(VINT(lv) OP VINT(rv)); \
+	if (IS_NUM(lv) && IS_NUM(rv)) \
+		return val_bool(NUM(lv) OP NUM(rv)); \
+	return eval_binop_vals(ctx, c->n, lv, rv);
+
+#define INDEX(OP) \
+	if (VKIND(lv) == VAL_LIST && VKIND(rv) == VAL_INT && \
+		VINT(rv) >= 0 && (size_t)VINT(rv) < VLIST(lv)->count) \
+		return val_list_at(lv, VINT(rv)); \
+	return eval_binop_vals(ctx, c->n, lv, rv);
+
+#define GENERIC(OP) \
+	return eval_binop_vals(ctx, c->n, lv, rv);
+
+#define CLO_BINOP(name, fl, fr, body, OP) \
+	Val name(EvalCtx *ctx, Clo *c) { \
+		fl(lv, c->a) \
+		fr(rv, c->b) \
+		body(OP) \
+	}
+
+// One function per operand shape: anything (x), a local (l) and a
+// constant (k).
+#define CLO_BINOP_SHAPES(name, body, OP) \
+	CLO_BINOP(name##_xx, FETCH_X, FETCH_X, body, OP) \
+	CLO_BINOP(name##_xl, FETCH_X, FETCH_L, body, OP) \
+	CLO_BINOP(name##_xk, FETCH_X, FETCH_K, body, OP) \
+	CLO_BINOP(name##_lx, FETCH_L, FETCH_X, body, OP) \
+	CLO_BINOP(name##_ll, FETCH_L, FETCH_L, body, OP) \
+	CLO_BINOP(name##_lk, FETCH_L, FETCH_K, body, OP) \
+	CLO_BINOP(name##_kx, FETCH_K, FETCH_X, body, OP) \
+	CLO_BINOP(name##_kl, FETCH_K, FETCH_L, body, OP) \
+	CLO_BINOP(name##_kk, FETCH_K, FETCH_K, body, OP)
+
+CLO_BINOP_SHAPES(clo_add,      ARITH,   +)
+CLO_BINOP_SHAPES(clo_sub,      ARITH,   -)
+CLO_BINOP_SHAPES(clo_mul,      ARITH,   *)
+CLO_BINOP_SHAPES(clo_div,      DIV,     /)
+CLO_BINOP_SHAPES(clo_less,     CMP,     <)
+CLO_BINOP_SHAPES(clo_less_eq,  CMP,     <=)
+CLO_BINOP_SHAPES(clo_great,    CMP,     >)
+CLO_BINOP_SHAPES(clo_great_eq, CMP,     >=)
+CLO_BINOP_SHAPES(clo_is_eq,    CMP,     ==)
+CLO_BINOP_SHAPES(clo_not_eq,   CMP,     !=)
+CLO_BINOP_SHAPES(clo_index,    INDEX,   [])
+CLO_BINOP_SHAPES(clo_binop,    GENERIC, ())
+
+typedef enum {
+	SHAPE_X,
+	SHAPE_L,
+	SHAPE_K,
+} CloShape;
+
+#define SHAPES(name) { \
+	{name##_xx, name##_xl, name##_xk}, \
+	{name##_lx, name##_ll, name##_lk}, \
+	{name##_kx, name##_kl, name##_kk}, \
+}
+
+// Operators without an entry use clo_binop.
+CloFn clo_binops[AST_OP_NEG + 1][3][3] = {
+	[AST_OP_ADD]      = SHAPES(clo_add),
+	[AST_OP_SUB]      = SHAPES(clo_sub),
+	[AST_OP_MUL]      = SHAPES(clo_mul),
+	[AST_OP_DIV]      = SHAPES(clo_div),
+	[AST_OP_LESS]     = SHAPES(clo_less),
+	[AST_OP_LESS_EQ]  = SHAPES(clo_less_eq),
+	[AST_OP_GREAT]    = SHAPES(clo_great),
+	[AST_OP_GREAT_EQ] = SHAPES(clo_great_eq),
+	[AST_OP_IS_EQ]    = SHAPES(clo_is_eq),
+	[AST_OP_NOT_EQ]   = SHAPES(clo_not_eq),
+	[AST_OP_ARR]      = SHAPES(clo_index),
+};
+
+CloFn clo_binop_any[3][3] = SHAPES(clo_binop);
+
+Val clo_const(EvalCtx *ctx, Clo *c) {
+	(void)ctx;
+	return c->k;
+}
+
+// String literals and whatever else is left to the tree walker.
+Val clo_eval(EvalCtx *ctx, Clo *c) {
+	return eval(ctx, c->n);
+}
+
+Val clo_local(EvalCtx *ctx, Clo *c) {
+	FETCH_L(v, c)
+	return v;
+}
+
+Val clo_name(EvalCtx *ctx, Clo *c) {
+	EvalSymbol *es = eval_lookup(ctx, c->id);
+	if (!es) {
+		eval_error(ctx, c->n->loc, "no such symbol");
+		return VNONE;
+	} else if (es->kind != EVAL_SYMB_VAR) {
+		eval_error(ctx, c->n->loc, "no such variable");
+		return VNONE;
+	}
+
+	return es->as.var.val;
+}
+
+Val clo_list(EvalCtx *ctx, Clo *c) {
+	Val list = eval_new_heap_val(ctx, VAL_LIST);
+	for (size_t i = 0; i < c->count; i++) {
+		Val v = RUN(c->items[i]);
+		FAIL_IF_ERR();
+		da_append(VLIST(list), v);
+	}
+
+	return list;
+}
+
+// items holds the keys and the values in turn.
+Val clo_dict(EvalCtx *ctx, Clo *c) {
+	Val dict = eval_new_heap_val(ctx, VAL_DICT);
+	for (size_t i = 0; i < c->count; i += 2) {
+		Val k = RUN(c->items[i]);
+		FAIL_IF_ERR();
+		Val v = RUN(c->items[i + 1]);
+		FAIL_IF_ERR();
+		ValDict_add(VDICT(dict), k, v);
+	}
+
+	return dict;
+}
+
+Val clo_unop(EvalCtx *ctx, Clo *c) {
+	Val v = RUN(c->a);
+	FAIL_IF_ERR();
+	return eval_unop_val(ctx, c->n, v);
+}
+
+Val clo_set_local(EvalCtx *ctx, Clo *c) {
+	Val rv = RUN(c->a);
+	FAIL_IF_ERR();
+	EvalSymbol *es = &ctx->stack.items[ctx->frame + c->slot];
+	if (es->kind != EVAL_SYMB_VAR) {
+		eval_error(ctx, c->n->loc, "no such variable");
+		return VNONE;
+	}
+
+	eval_val_mut(ctx, c->n->loc, c->n->as.bin_expr.op, &es->as.var.val, rv);
+	return VNONE;
+}
+
+// x += k on an int local, the rest goes through eval_val_mut.
+Val clo_add_local_k(EvalCtx *ctx, Clo *c) {
+	Val k = c->a->k;
+	EvalSymbol *es = &ctx->stack.items[ctx->frame + c->slot];
+	if (es->kind == EVAL_SYMB_VAR && VKIND(es->as.var.val) == VAL_INT && VKIND(k) == VAL_INT) {
+		es->as.var.val = val_int(ctx, INT_WRAP(VINT(es->as.var.val), +, VINT(k)));
+		return VNONE;
+	}
+
+	return clo_set_local(ctx, c);
+}
+
+Val clo_set_name(EvalCtx *ctx, Clo *c) {
+	Val rv = RUN(c->a);
+	FAIL_IF_ERR();
+	EvalSymbol *es = eval_lookup(ctx, c->id);
+	if (!es) {
+		eval_error(ctx, c->n->loc, "no such symbol");
+		return VNONE;
+	} else if (es->kind != EVAL_SYMB_VAR) {
+		eval_error(ctx, c->n->loc, "no such variable");
+		return VNONE;
+	}
+
+	eval_val_mut(ctx, c->n->loc, c->n->as.bin_expr.op, &es->as.var.val, rv);
+	return VNONE;
+}
+
+Val clo_set_index(EvalCtx *ctx, Clo *c) {
+	Val rv = RUN(c->a);
+	FAIL_IF_ERR();
+	Val container = RUN(c->b);
+	FAIL_IF_ERR();
+	Val key = RUN(c->c);
+	FAIL_IF_ERR();
+	eval_index_mut(ctx, c->n, container, key, rv);
+	return VNONE;
+}
+
+Val clo_set_invalid(EvalCtx *ctx, Clo *c) {
+	RUN(c->a);
+	FAIL_IF_ERR();
+	eval_error(ctx, c->n->loc, "EQ is used incorrectly");
+	return VNONE;
+}
+
+Val clo_body(EvalCtx *ctx, Clo *c) {
+	size_t stack_size = ctx->stack.count;
+	size_t temps_size = ctx->temps.count;
+	for (size_t i = 0; i < c->count; i++) {
+		Val res = RUN(c->items[i]);
+		FAIL_IF_ERR();
+		if (ctx->state != EVAL_CTX_NONE) {
+			ctx->stack.count = stack_size;
+			ctx->temps.count = temps_size;
+			if (ctx->state == EVAL_CTX_RET && VIS_GC(res))
+				da_append(&ctx->temps, res);
+			return res;
+		}
+	}
+
+	ctx->stack.count = stack_size;
+	ctx->temps.count = temps_size;
+	return VNONE;
+}
+
+Val clo_var_def(EvalCtx *ctx, Clo *c) {
+	Val v = RUN(c->a);
+	FAIL_IF_ERR();
+	da_append(&ctx->stack, ((EvalSymbol){
+		.kind = EVAL_SYMB_VAR,
+		.id = c->id,
+		.as.var.val = v,
+	}));
+
+	return VNONE;
+}
+
+Val clo_func_def(EvalCtx *ctx, Clo *c) {
+	eval_def_func(ctx, c->id, c->n, c->a);
+	return VNONE;
+}
+
+Val clo_global_def(EvalCtx *ctx, Clo *c) {
+	eval_def_global(ctx, c->id, c->n, c->a);
+	return VNONE;
+}
+
+Val clo_if(EvalCtx *ctx, Clo *c) {
+	Val cond = RUN(c->a);
+	FAIL_IF_ERR();
+	if (VKIND(cond) != VAL_BOOL) {
+		eval_error(ctx, c->n->loc, "boolean expected");
+		return VNONE;
+	}
+
+	if (VBOOL(cond)) return RUN(c->b);
+	if (c->c) return RUN(c->c);
+	return VNONE;
+}
+
+// Ends a loop iteration, returns true when the loop has to stop.
+#define LOOP_STATE(res) \
+	if (ctx->state == EVAL_CTX_BREAK) { \
+		ctx->state = EVAL_CTX_NONE; \
+		break; \
+	} else if (ctx->state == EVAL_CTX_CONT) { \
+		ctx->state = EVAL_CTX_NONE; \
+	} else if (ctx->state == EVAL_CTX_RET) { \
+		return res; \
+	}
+
+#define LOOP_COND(cond_clo) \
+	Val cond = RUN(cond_clo); \
+	FAIL_IF_ERR(); \
+	if (VKIND(cond) != VAL_BOOL) { \
+		eval_error(ctx, c->n->loc, "boolean expected"); \
+		return VNONE; \
+	} \
+	if (!VBOOL(cond)) break;
+
+Val clo_while(EvalCtx *ctx, Clo *c) {
+	for (;;) {
+		LOOP_COND(c->a)
+		Val res = RUN(c->b);
+		FAIL_IF_ERR();
+		LOOP_STATE(res)
+	}
+
+	return VNONE;
+}
+
+Val clo_for(EvalCtx *ctx, Clo *c) {
+	size_t count = ctx->stack.count;
+	RUN(c->a);
+	FAIL_IF_ERR();
+	bool remove_last = ctx->stack.count != count;
+
+	for (;;) {
+		LOOP_COND(c->b)
+		Val res = RUN(c->d);
+		FAIL_IF_ERR();
+		LOOP_STATE(res)
+		RUN(c->c);
+		FAIL_IF_ERR();
+	}
+
+	if (remove_last) ctx->stack.count--;
+	return VNONE;
+}
+
+Val clo_foreach(EvalCtx *ctx, Clo *c) {
+	Val coll = RUN(c->a);
+	FAIL_IF_ERR();
+	if (VKIND(coll) != VAL_LIST) {
+		eval_error(ctx, c->a->n->loc, "list expected");
+		return VNONE;
+	}
+
+	for (size_t i = 0; i < VLIST(coll)->count; i++) {
+		da_append(&ctx->stack, ((EvalSymbol){
+			.kind = EVAL_SYMB_VAR,
+			.id = c->id,
+			.as.var.val = val_list_at(coll, i),
+		}));
+
+		Val res = RUN(c->b);
+		FAIL_IF_ERR();
+		ctx->stack.count--;
+		LOOP_STATE(res)
+	}
+
+	return VNONE;
+}
+
+Val clo_invoke(EvalCtx *ctx, Clo *c, EvalSymbol *fs) {
+	if (!fs) {
+		eval_error(ctx, c->n->loc, "no such symbol");
+		return VNONE;
+	}
+
+	if (fs->kind == EVAL_SYMB_FUNC) {
+		// fs points into the stack, which the arguments may move.
+		AST *def = fs->as.func.node;
+		Clo *body = fs->as.func.code;
+		long fixed = eval_call_arity(ctx, c->n, def, c->count);
+		if (fixed < 0) return VNONE;
+
+		size_t base = ctx->stack.count;
+		for (size_t i = 0; i < c->count; i++) {
+			Val arg = RUN(c->items[i]);
+			FAIL_IF_ERR();
+			da_append(&ctx->stack, ((EvalSymbol){
+				.kind = EVAL_SYMB_VAR,
+				.as.var.val = arg,
+			}));
+		}
+
+		eval_bind_params(ctx, def, base, fixed);
+		size_t frame = ctx->frame;
+		ctx->frame = base;
+		ctx->state = EVAL_CTX_NONE;
+		Val res = body ? RUN(body) : eval(ctx, def->as.func_def.body);
+		FAIL_IF_ERR();
+
+		while (ctx->tail.def) {
+			body = ctx->tail.code;
+			def = eval_tail_enter(ctx, base);
+			res = body ? RUN(body) : eval(ctx, def->as.func_def.body);
+			FAIL_IF_ERR();
+		}
+
+		ctx->state = EVAL_CTX_NONE;
+		ctx->stack.count = base;
+		ctx->frame = frame;
+		return res;
+	} else if (fs->kind == EVAL_SYMB_REG_FUNC) {
+		// The arguments are kept in ctx->regs, where the gc sees them.
+		RegFunc rf = fs->as.reg_func;
+		size_t base = ctx->regs.count;
+		for (size_t i = 0; i < c->count; i++) {
+			Val arg = RUN(c->items[i]);
+			if (ctx->err_ctx.got_err) {
+				ctx->regs.count = base;
+				return VNONE;
+			}
+
+			da_append(&ctx->regs, arg);
+		}
+
+		Vals args = {
+			.items = ctx->regs.items + base,
+			.count = c->count,
+			.capacity = c->count,
+		};
+
+		Val res = rf(ctx, eval_call_loc(ctx, c->n), args);
+		ctx->regs.count = base;
+		return res;
+	}
+
+	eval_error(ctx, c->n->loc, "no such function");
+	return VNONE;
+}
+
+Val clo_call_local(EvalCtx *ctx, Clo *c) {
+	return clo_invoke(ctx, c, &ctx->stack.items[ctx->frame + c->slot]);
+}
+
+Val clo_call_name(EvalCtx *ctx, Clo *c) {
+	return clo_invoke(ctx, c, eval_callee(ctx, c->n));
+}
+
+Val clo_ret(EvalCtx *ctx, Clo *c) {
+	Val v = c->a ? RUN(c->a) : VNONE;
+	ctx->state = EVAL_CTX_RET;
+	return v;
+}
+
+// a is the call, see eval_tail_call.
+Val clo_ret_tail(EvalCtx *ctx, Clo *c) {
+	Clo *call = c->a;
+	EvalSymbol *fs = call->fn == clo_call_local
+		? &ctx->stack.items[ctx->frame + call->slot]
+		: eval_callee(ctx, call->n);
+	if (!fs || fs->kind != EVAL_SYMB_FUNC) {
+		Val v = clo_invoke(ctx, call, fs);
+		ctx->state = EVAL_CTX_RET;
+		return v;
+	}
+
+	AST *def = fs->as.func.node;
+	Clo *body = fs->as.func.code;
+	long fixed = eval_call_arity(ctx, call->n, def, call->count);
+	if (fixed < 0) return VNONE;
+
+	size_t base = ctx->stack.count;
+	for (size_t i = 0; i < call->count; i++) {
+		Val arg = RUN(call->items[i]);
+		FAIL_IF_ERR();
+		da_append(&ctx->stack, ((EvalSymbol){
+			.kind = EVAL_SYMB_VAR,
+			.as.var.val = arg,
+		}));
+	}
+
+	eval_tail_take(ctx, def, body, fixed, base);
+	return VNONE;
+}
+
+Val clo_break(EvalCtx *ctx, Clo *c) {
+	(void)c;
+	ctx->state = EVAL_CTX_BREAK;
+	return VNONE;
+}
+
+Val clo_cont(EvalCtx *ctx, Clo *c) {
+	(void)c;
+	ctx->state = EVAL_CTX_CONT;
+	return VNONE;
+}
+
+Clo *clo_node(CloProg *cp, AST *n);
+
+Clo *clo_new(CloProg *cp, AST *n, CloFn fn) {
+	Clo *c = arena_alloc(&cp->arena, sizeof(Clo));
+	*c = (Clo){.fn = fn, .n = n};
+	return c;
+}
+
+void clo_list_of(CloProg *cp, Clo *c, ASTs *list) {
+	c->items = arena_alloc(&cp->arena, list->count * sizeof(Clo*));
+	for (size_t i = 0; i < list->count; i++)
+		if (list->items[i]) c->items[c->count++] = clo_node(cp, list->items[i]);
+}
+
+CloShape clo_shape(AST *n) {
+	if (n->kind == AST_VAR && n->slot) return SHAPE_L;
+	Val k;
+	if (eval_lit_const(n, &k)) return SHAPE_K;
+	return SHAPE_X;
+}
+
+Clo *clo_assign(CloProg *cp, AST *n) {
+	AST *lhs = n->as.bin_expr.lhs;
+	Clo *c = clo_new(cp, n, clo_set_invalid);
+	c->a = clo_node(cp, n->as.bin_expr.rhs);
+
+	if (lhs->kind == AST_BIN_EXPR && lhs->as.bin_expr.op == AST_OP_ARR) {
+		c->fn = clo_set_index;
+		c->b = clo_node(cp, lhs->as.bin_expr.lhs);
+		c->c = clo_node(cp, lhs->as.bin_expr.rhs);
+	} else if (lhs->kind == AST_VAR && lhs->slot) {
+		c->slot = lhs->slot - 1;
+		c->fn = n->as.bin_expr.op == AST_OP_ADD_EQ && clo_shape(n->as.bin_expr.rhs) == SHAPE_K
+			? clo_add_local_k
+			: clo_set_local;
+	} else if (lhs->kind == AST_VAR) {
+		c->id = lhs->as.var;
+		c->fn = clo_set_name;
+	}
+
+	return c;
+}
+
+Clo *clo_node(CloProg *cp, AST *n) {
+	if (!n) return NULL;
+
+	switch (n->kind) {
+		case AST_BODY: {
+			Clo *c = clo_new(cp, n, clo_body);
+			clo_list_of(cp, c, &n->as.body);
+			return c;
+		}
+
+		case AST_VAL_NONE:
+			return clo_new(cp, n, clo_const);
+
+		case AST_LIT: {
+			Clo *c = clo_new(cp, n, clo_const);
+			if (!eval_lit_const(n, &c->k)) c->fn = clo_eval;
+			return c;
+		}
+
+		case AST_VAR: {
+			Clo *c = clo_new(cp, n, clo_name);
+			c->id = n->as.var;
+			if (n->slot) {
+				c->fn = clo_local;
+				c->slot = n->slot - 1;
+			}
+
+			return c;
+		}
+
+		case AST_LIST: {
+			Clo *c = clo_new(cp, n, clo_list);
+			clo_list_of(cp, c, &n->as.list);
+			return c;
+		}
+
+		case AST_DICT: {
+			Clo *c = clo_new(cp, n, clo_dict);
+			ASTs *pairs = &n->as.dict;
+			c->count = 2 * pairs->count;
+			c->items = arena_alloc(&cp->arena, c->count * sizeof(Clo*));
+			for (size_t i = 0; i < pairs->count; i++) {
+				c->items[2*i] = clo_node(cp, pairs->items[i]->as.bin_expr.lhs);
+				c->items[2*i + 1] = clo_node(cp, pairs->items[i]->as.bin_expr.rhs);
+			}
+
+			return c;
+		}
+
+		case AST_UN_EXPR: {
+			Clo *c = clo_new(cp, n, clo_unop);
+			c->a = clo_node(cp, n->as.un_expr.v);
+			return c;
+		}
+
+		case AST_BIN_EXPR: {
+			AST_Op op = n->as.bin_expr.op;
+			switch (op) {
+				case AST_OP_EQ:
+				case AST_OP_ADD_EQ:
+				case AST_OP_SUB_EQ:
+				case AST_OP_MUL_EQ:
+				case AST_OP_DIV_EQ:
+					return clo_assign(cp, n);
+				default:;
+			}
+
+			AST *lhs = n->as.bin_expr.lhs, *rhs = n->as.bin_expr.rhs;
+			CloFn (*fns)[3] = clo_binops[op][0][0] ? clo_binops[op] : clo_binop_any;
+			Clo *c = clo_new(cp, n, fns[clo_shape(lhs)][clo_shape(rhs)]);
+			c->a = clo_node(cp, lhs);
+			c->b = clo_node(cp, rhs);
+			return c;
+		}
+
+		case AST_VAR_DEF: {
+			Clo *c = clo_new(cp, n, clo_var_def);
+			c->id = n->as.var_def.id;
+			c->a = clo_node(cp, n->as.var_def.expr);
+			return c;
+		}
+
+		case AST_FUNC_DEF: {
+			Clo *c = clo_new(cp, n, clo_func_def);
+			c->id = n->as.func_def.id;
+			c->a = clo_node(cp, n->as.func_def.body);
+			return c;
+		}
+
+		case AST_FUNC_CALL: {
+			Clo *c = clo_new(cp, n, clo_call_name);
+			c->id = n->as.func_call.id;
+			if (n->slot) {
+				c->fn = clo_call_local;
+				c->slot = n->slot - 1;
+			}
+
+			clo_list_of(cp, c, &n->as.func_call.args);
+			return c;
+		}
+
+		case AST_VAR_MUT:
+			return clo_node(cp, n->as.var_mut);
+
+		case AST_ST_IF: {
+			Clo *c = clo_new(cp, n, clo_if);
+			c->a = clo_node(cp, n->as.st_if_chain.cond);
+			c->b = clo_node(cp, n->as.st_if_chain.body);
+			c->c = clo_node(cp, n->as.st_if_chain.chain);
+			return c;
+		}
+
+		case AST_ST_ELSE:
+			return clo_node(cp, n->as.st_else.body);
+
+		case AST_ST_WHILE: {
+			Clo *c = clo_new(cp, n, clo_while);
+			c->a = clo_node(cp, n->as.st_while.cond);
+			c->b = clo_node(cp, n->as.st_while.body);
+			return c;
+		}
+
+		case AST_ST_FOR: {
+			Clo *c = clo_new(cp, n, clo_for);
+			c->a = clo_node(cp, n->as.st_for.var);
+			c->b = clo_node(cp, n->as.st_for.cond);
+			c->c = clo_node(cp, n->as.st_for.mut);
+			c->d = clo_node(cp, n->as.st_for.body);
+			return c;
+		}
+
+		case AST_ST_FOREACH: {
+			Clo *c = clo_new(cp, n, clo_foreach);
+			c->id = n->as.st_foreach.var_id;
+			c->a = clo_node(cp, n->as.st_foreach.coll);
+			c->b = clo_node(cp, n->as.st_foreach.body);
+			return c;
+		}
+
+		case AST_RET: {
+			AST *expr = n->as.ret.expr;
+			bool tail = expr && expr->kind == AST_FUNC_CALL && expr->as.func_call.tail;
+			Clo *c = clo_new(cp, n, tail ? clo_ret_tail : clo_ret);
+			c->a = clo_node(cp, expr);
+			return c;
+		}
+
+		case AST_BREAK:
+			return clo_new(cp, n, clo_break);
+
+		case AST_CONT:
+			return clo_new(cp, n, clo_cont);
+
+		default:
+			return clo_new(cp, n, clo_eval);
+	}
+}
+
+void clo_compile(CloProg *cp, AST *prog) {
+	clo_free(cp);
+	cp->prog = clo_node(cp, prog->as.prog.body);
+
+	// Functions defined at the top level go to the globals, see eval.h.
+	for (size_t i = 0; i < cp->prog->count; i++)
+		if (cp->prog->items[i]->fn == clo_func_def)
+			cp->prog->items[i]->fn = clo_global_def;
+}
+
+Val clo_run(EvalCtx *ctx, CloProg *cp) {
+	ctx->frame = ctx->stack.count;
+	return RUN(cp->prog);
+}
+
+void clo_free(CloProg *cp) {
+	arena_free(&cp->arena);
+	cp->prog = NULL;
+}
@@ -0,0 +1,533 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "../include/vm.h"
+
+// Where break and continue of the innermost loop jump to, and how many
+// symbols the frame holds at those points.
+typedef struct Loop Loop;
+struct Loop {
+	size_t brk_syms, cont_syms;
+	DA(size_t) brks, conts;
+	Loop *outer;
+};
+
+// syms mirrors the symbols the frame has on the eval stack at the point
+// being compiled, the same way resolve counts them, so scopes can drop
+// theirs with a single POPTO.
+typedef struct {
+	VmProg *vp;
+	Chunk *ch;
+	size_t top;
+	size_t syms;
+	Loop *loop;
+	bool failed;
+} Compiler;
+
+void cc_stmt(Compiler *c, AST *n);
+void cc_expr(Compiler *c, AST *n, size_t dst);
+
+u16 cc_u16(Compiler *c, size_t v) {
+	if (v > UINT16_MAX) c->failed = true;
+	return v;
+}
+
+size_t cc_emit(Compiler *c, AST *n, OpCode op, u8 x, size_t a, size_t b, size_t cc) {
+	da_append(&c->ch->code, ((Instr){
+		.op = op,
+		.x = x,
+		.a = cc_u16(c, a),
+		.b = cc_u16(c, b),
+		.c = cc_u16(c, cc),
+	}));
+
+	da_append(&c->ch->nodes, n);
+	return c->ch->code.count - 1;
+}
+
+void cc_patch(Compiler *c, size_t at, size_t target) {
+	if (target > UINT32_MAX) c->failed = true;
+	c->ch->code.items[at].b = target & 0xffff;
+	c->ch->code.items[at].c = target >> 16;
+}
+
+size_t cc_jump(Compiler *c, AST *n, OpCode op, size_t a, size_t target) {
+	size_t at = cc_emit(c, n, op, 0, a, 0, 0);
+	cc_patch(c, at, target);
+	return at;
+}
+
+size_t cc_here(Compiler *c) {
+	return c->ch->code.count;
+}
+
+size_t cc_reg(Compiler *c) {
+	size_t r = c->top++;
+	if (c->top > c->ch->nregs) c->ch->nregs = c->top;
+	return r;
+}
+
+size_t cc_const(Compiler *c, Val v) {
+	da_append(&c->ch->consts, v);
+	return c->ch->consts.count - 1;
+}
+
+size_t cc_name(Compiler *c, char *id) {
+	for (size_t i = 0; i < c->ch->names.count; i++)
+		if (c->ch->names.items[i] == id) return i;
+
+	da_append(&c->ch->names, id);
+	return c->ch->names.count - 1;
+}
+
+void cc_pop_to(Compiler *c, AST *n, size_t syms) {
+	if (c->syms != syms) cc_emit(c, n, OP_POPTO, 0, syms, 0, 0);
+}
+
+Chunk *cc_chunk(Compiler *c) {
+	Chunk *ch = malloc(sizeof(*ch));
+	*ch = (Chunk){0};
+	da_append(&c->vp->chunks, ch);
+	return ch;
+}
+
+void cc_body(Compiler *c, AST *n) {
+	size_t syms = c->syms;
+	da_foreach (AST*, st, &n->as.body) {
+		if (*st) cc_stmt(c, *st);
+	}
+
+	cc_pop_to(c, n, syms);
+	c->syms = syms;
+}
+
+// Arguments go to consecutive registers, the result replaces the first.
+void cc_call(Compiler *c, AST *n, size_t dst) {
+	ASTs *args = &n->as.func_call.args;
+	size_t top = c->top;
+	size_t base = dst + 1 == top ? dst : top;
+
+	c->top = base;
+	if (base + 1 > c->ch->nregs) c->ch->nregs = base + 1;
+	da_foreach (AST*, it, args)
+		cc_expr(c, *it, cc_reg(c));
+
+	if (n->slot) cc_emit(c, n, OP_CALL, 0, base, args->count, n->slot - 1);
+	else cc_emit(c, n, OP_CALLN, 0, base, args->count, cc_name(c, n->as.func_call.id));
+
+	c->top = top;
+	if (base != dst) cc_emit(c, n, OP_MOVE, 0, dst, base, 0);
+}
+
+// Assignments evaluate the rhs first, then the container and the key
+// of an indexed lhs.
+void cc_assign(Compiler *c, AST *n) {
+	AST *lhs = n->as.bin_expr.lhs;
+	AST_Op op = n->as.bin_expr.op;
+	size_t top = c->top;
+	size_t rhs = cc_reg(c);
+	cc_expr(c, n->as.bin_expr.rhs, rhs);
+
+	if (lhs->kind == AST_BIN_EXPR && lhs->as.bin_expr.op == AST_OP_ARR) {
+		size_t container = cc_reg(c);
+		cc_expr(c, lhs->as.bin_expr.lhs, container);
+		size_t key = cc_reg(c);
+		cc_expr(c, lhs->as.bin_expr.rhs, key);
+		cc_emit(c, n, OP_SETINDEX, op, container, key, rhs);
+	} else if (lhs->kind == AST_VAR) {
+		if (lhs->slot) cc_emit(c, n, OP_SETLOCAL, op, rhs, lhs->slot - 1, 0);
+		else cc_emit(c, n, OP_SETNAME, op, rhs, cc_name(c, lhs->as.var), 0);
+	} else cc_emit(c, n, OP_ERR, 0, 0, cc_name(c, "EQ is used incorrectly"), 0);
+
+	c->top = top;
+}
+
+bool cc_is_assign(AST *n) {
+	if (n->kind != AST_BIN_EXPR) return false;
+	switch (n->as.bin_expr.op) {
+		case AST_OP_EQ:
+		case AST_OP_ADD_EQ:
+		case AST_OP_SUB_EQ:
+		case AST_OP_MUL_EQ:
+		case AST_OP_DIV_EQ:
+			return true;
+		default:
+			return false;
+	}
+}
+
+void cc_expr(Compiler *c, AST *n, size_t dst) {
+	switch (n->kind) {
+		case AST_VAL_NONE:
+			cc_emit(c, n, OP_LOADNONE, 0, dst, 0, 0);
+			break;
+
+		case AST_LIT: {
+			// Strings are mutable, every evaluation makes a new one, and
+			// boxed ints live on the heap of the context running them.
+			Val v;
+			if (!eval_lit_const(n, &v)) {
+				cc_emit(c, n, OP_EVAL, 0, dst, 0, 0);
+				return;
+			}
+
+			cc_emit(c, n, OP_LOADK, 0, dst, cc_const(c, v), 0);
+		} break;
+
+		case AST_VAR:
+			if (n->slot) cc_emit(c, n, OP_GETLOCAL, 0, dst, n->slot - 1, 0);
+			else cc_emit(c, n, OP_GETNAME, 0, dst, cc_name(c, n->as.var), 0);
+			break;
+
+		case AST_LIST: {
+			size_t top = c->top;
+			size_t r = cc_reg(c);
+			cc_emit(c, n, OP_NEWLIST, 0, dst, 0, 0);
+			da_foreach (AST*, it, &n->as.list) {
+				cc_expr(c, *it, r);
+				cc_emit(c, *it, OP_APPEND, 0, dst, r, 0);
+			}
+
+			c->top = top;
+		} break;
+
+		case AST_DICT: {
+			size_t top = c->top;
+			cc_emit(c, n, OP_NEWDICT, 0, dst, 0, 0);
+			da_foreach (AST*, it, &n->as.dict) {
+				size_t k = cc_reg(c);
+				cc_expr(c, (*it)->as.bin_expr.lhs, k);
+				size_t v = cc_reg(c);
+				cc_expr(c, (*it)->as.bin_expr.rhs, v);
+				cc_emit(c, *it, OP_DICTSET, 0, dst, k, v);
+				c->top = top;
+			}
+		} break;
+
+		case AST_UN_EXPR:
+			cc_expr(c, n->as.un_expr.v, dst);
+			cc_emit(c, n, OP_UNOP, n->as.un_expr.op, dst, dst, 0);
+			break;
+
+		case AST_BIN_EXPR: {
+			if (cc_is_assign(n)) {
+				cc_assign(c, n);
+				cc_emit(c, n, OP_LOADNONE, 0, dst, 0, 0);
+				break;
+			}
+
+			size_t top = c->top;
+			cc_expr(c, n->as.bin_expr.lhs, dst);
+			size_t r = cc_reg(c);
+			cc_expr(c, n->as.bin_expr.rhs, r);
+			cc_emit(c, n, OP_BINOP, n->as.bin_expr.op, dst, dst, r);
+			c->top = top;
+		} break;
+
+		case AST_FUNC_CALL:
+			cc_call(c, n, dst);
+			break;
+
+		default:
+			cc_emit(c, n, OP_EVAL, 0, dst, 0, 0);
+	}
+}
+
+// Returns the jump taken when cond is false, to be patched.
+size_t cc_cond_jump(Compiler *c, AST *n, AST *cond) {
+	size_t top = c->top;
+	size_t r = cc_reg(c);
+	cc_expr(c, cond, r);
+	c->top = top;
+	return cc_jump(c, n, OP_JMPF, r, 0);
+}
+
+void cc_if(Compiler *c, AST *n) {
+	DA(size_t) ends = {0};
+	for (; n && n->kind == AST_ST_IF; n = n->as.st_if_chain.chain) {
+		size_t next = cc_cond_jump(c, n, n->as.st_if_chain.cond);
+		cc_stmt(c, n->as.st_if_chain.body);
+		if (n->as.st_if_chain.chain)
+			da_append(&ends, cc_jump(c, n, OP_JMP, 0, 0));
+
+		cc_patch(c, next, cc_here(c));
+	}
+
+	if (n) cc_stmt(c, n->as.st_else.body);
+	da_foreach (size_t, it, &ends)
+		cc_patch(c, *it, cc_here(c));
+
+	da_free(&ends);
+}
+
+void cc_loop_end(Compiler *c, Loop *l, size_t cont, size_t brk) {
+	da_foreach (size_t, it, &l->conts)
+		cc_patch(c, *it, cont);
+	da_foreach (size_t, it, &l->brks)
+		cc_patch(c, *it, brk);
+
+	da_free(&l->conts);
+	da_free(&l->brks);
+	c->loop = l->outer;
+}
+
+void cc_while(Compiler *c, AST *n) {
+	Loop l = {.brk_syms = c->syms, .cont_syms = c->syms, .outer = c->loop};
+	size_t start = cc_here(c);
+	da_append(&l.brks, cc_cond_jump(c, n, n->as.st_while.cond));
+
+	c->loop = &l;
+	cc_stmt(c, n->as.st_while.body);
+	cc_jump(c, n, OP_JMP, 0, start);
+	cc_loop_end(c, &l, start, cc_here(c));
+}
+
+void cc_for(Compiler *c, AST *n) {
+	size_t syms = c->syms;
+	cc_stmt(c, n->as.st_for.var);
+
+	Loop l = {.brk_syms = c->syms, .cont_syms = c->syms, .outer = c->loop};
+	size_t start = cc_here(c);
+	da_append(&l.brks, cc_cond_jump(c, n, n->as.st_for.cond));
+
+	c->loop = &l;
+	cc_stmt(c, n->as.st_for.body);
+	size_t cont = cc_here(c);
+	cc_stmt(c, n->as.st_for.mut);
+	cc_jump(c, n, OP_JMP, 0, start);
+	cc_loop_end(c, &l, cont, cc_here(c));
+
+	cc_pop_to(c, n, syms);
+	c->syms = syms;
+}
+
+// The loop variable is pushed for every item and dropped before the
+// next one, the list and the index stay in registers.
+void cc_foreach(Compiler *c, AST *n) {
+	size_t top = c->top;
+	size_t coll = cc_reg(c);
+	cc_expr(c, n->as.st_foreach.coll, coll);
+	size_t idx = cc_reg(c), item = cc_reg(c);
+	cc_emit(c, n, OP_LOADK, 0, idx, cc_const(c, val_int(NULL, 0)), 0);
+
+	Loop l = {.brk_syms = c->syms, .cont_syms = c->syms + 1, .outer = c->loop};
+	size_t start = cc_emit(c, n, OP_ITER, 0, idx, coll, item);
+	da_append(&l.brks, cc_jump(c, n, OP_JMP, 0, 0));
+	cc_emit(c, n, OP_DEFVAR, 0, item, cc_name(c, n->as.st_foreach.var_id), 0);
+	c->syms++;
+
+	c->loop = &l;
+	cc_stmt(c, n->as.st_foreach.body);
+	size_t cont = cc_here(c);
+	c->syms--;
+	cc_emit(c, n, OP_POPTO, 0, c->syms, 0, 0);
+	cc_jump(c, n, OP_JMP, 0, start);
+	cc_loop_end(c, &l, cont, cc_here(c));
+	c->top = top;
+}
+
+// Outside of a loop break and continue end the function like a bare
+// return, as they do in the tree walker.
+void cc_loop_jump(Compiler *c, AST *n) {
+	Loop *l = c->loop;
+	if (!l) {
+		cc_emit(c, n, OP_RETNONE, 0, 0, 0, 0);
+		return;
+	}
+
+	bool brk = n->kind == AST_BREAK;
+	cc_pop_to(c, n, brk ? l->brk_syms : l->cont_syms);
+	size_t at = cc_jump(c, n, OP_JMP, 0, 0);
+	if (brk) da_append(&l->brks, at);
+	else da_append(&l->conts, at);
+}
+
+size_t cc_func(Compiler *c, AST *n) {
+	Compiler fc = {.vp = c->vp, .ch = cc_chunk(c)};
+	size_t idx = c->vp->chunks.count - 1;
+
+	da_foreach (AST*, arg, &n->as.func_def.args) {
+		fc.syms++;
+		if ((*arg)->kind == AST_VAR_ANY) break;
+	}
+
+	cc_stmt(&fc, n->as.func_def.body);
+	cc_emit(&fc, n, OP_RETNONE, 0, 0, 0, 0);
+	if (fc.failed) c->failed = true;
+	return idx;
+}
+
+void cc_stmt(Compiler *c, AST *n) {
+	switch (n->kind) {
+		case AST_BODY:
+			cc_body(c, n);
+			break;
+
+		case AST_VAR_DEF: {
+			size_t top = c->top;
+			size_t r = cc_reg(c);
+			cc_expr(c, n->as.var_def.expr, r);
+			cc_emit(c, n, OP_DEFVAR, 0, r, cc_name(c, n->as.var_def.id), 0);
+			c->top = top;
+			c->syms++;
+		} break;
+
+		case AST_FUNC_DEF: {
+			size_t idx = cc_func(c, n);
+			cc_emit(c, n, OP_DEFFUNC, 0, idx, cc_name(c, n->as.func_def.id), 0);
+			c->syms++;
+		} break;
+
+		case AST_VAR_MUT:
+			if (cc_is_assign(n->as.var_mut)) {
+				cc_assign(c, n->as.var_mut);
+				break;
+			}
+
+			cc_stmt(c, n->as.var_mut);
+			break;
+
+		case AST_ST_IF:
+			cc_if(c, n);
+			break;
+
+		case AST_ST_ELSE:
+			cc_stmt(c, n->as.st_else.body);
+			break;
+
+		case AST_ST_WHILE:
+			cc_while(c, n);
+			break;
+
+		case AST_ST_FOR:
+			cc_for(c, n);
+			break;
+
+		case AST_ST_FOREACH:
+			cc_foreach(c, n);
+			break;
+
+		case AST_RET: {
+			if (!n->as.ret.expr) {
+				cc_emit(c, n, OP_RETNONE, 0, 0, 0, 0);
+				break;
+			}
+
+			size_t top = c->top;
+			size_t r = cc_reg(c);
+			AST *expr = n->as.ret.expr;
+			cc_expr(c, expr, r);
+			// The call is the last instruction, its result already in r.
+			if (expr->kind == AST_FUNC_CALL && expr->as.func_call.tail)
+				da_last(&c->ch->code).x = 1;
+			cc_emit(c, n, OP_RET, 0, r, 0, 0);
+			c->top = top;
+		} break;
+
+		case AST_BREAK:
+		case AST_CONT:
+			cc_loop_jump(c, n);
+			break;
+
+		default: {
+			size_t top = c->top;
+			cc_expr(c, n, cc_reg(c));
+			c->top = top;
+		}
+	}
+}
+
+bool vm_compile(VmProg *vp, AST *prog) {
+	vm_free(vp);
+	Compiler c = {.vp = vp};
+	c.ch = cc_chunk(&c);
+
+	// Functions defined at the top level go to the globals, see eval.h.
+	AST *body = prog->as.prog.body;
+	da_foreach (AST*, st, &body->as.body) {
+		if (!*st) continue;
+		if ((*st)->kind != AST_FUNC_DEF) {
+			cc_stmt(&c, *st);
+			continue;
+		}
+
+		size_t idx = cc_func(&c, *st);
+		cc_emit(&c, *st, OP_DEFGLOBAL, 0, idx, cc_name(&c, (*st)->as.func_def.id), 0);
+	}
+
+	cc_pop_to(&c, body, 0);
+	cc_emit(&c, prog, OP_RETNONE, 0, 0, 0, 0);
+
+	if (c.failed) {
+		vm_free(vp);
+		return false;
+	}
+
+	da_foreach (Chunk*, it, &vp->chunks)
+		vm_fuse(*it);
+	return true;
+}
+
+// n is a binop, or one already fused with the JMPF after it, that reads
+// r as its rhs only.
+bool fuse_reads_rhs(Instr *n, u16 r) {
+	return (n->op == OP_BINOP || n->op == OP_JMPF_RR) && n->c == r && n->b != r;
+}
+
+// The sequences are the most frequent opcode pairs of the examples, as
+// counted by a VM_STATS build. Fusing from the end lets a sequence take
+// in the superinstruction its tail was already turned into. The
+// registers the skipped instructions write are temporaries that only the
+// last instruction reads, which is all the compiler emits them for.
+void vm_fuse(Chunk *ch) {
+	Instr *code = ch->code.items;
+	for (size_t i = ch->code.count; i-- > 1;) {
+		Instr *p = &code[i - 1], *n = &code[i];
+		switch (p->op) {
+			case OP_BINOP:
+				if (n->op == OP_JMPF && n->a == p->a) p->op = OP_JMPF_RR;
+				break;
+
+			case OP_LOADK:
+				if (n->op == OP_SETLOCAL && n->a == p->a)
+					p->op = OP_SETLOCAL_K;
+				else if (fuse_reads_rhs(n, p->a))
+					p->op = n->op == OP_BINOP ? OP_BINOP_RK : OP_JMPF_RK;
+				break;
+
+			case OP_GETLOCAL: {
+				if (n->op == OP_SETLOCAL && n->a == p->a) {
+					p->op = OP_SETLOCAL_L;
+					break;
+				} else if (fuse_reads_rhs(n, p->a)) {
+					p->op = n->op == OP_BINOP ? OP_BINOP_RL : OP_JMPF_RL;
+					break;
+				}
+
+				// The binop follows the fused rhs load.
+				bool lhs = i + 1 < ch->code.count &&
+					code[i + 1].a == p->a && code[i + 1].b == p->a;
+				switch (n->op) {
+					case OP_BINOP_RL: if (lhs) p->op = OP_BINOP_LL; break;
+					case OP_BINOP_RK: if (lhs) p->op = OP_BINOP_LK; break;
+					case OP_JMPF_RL:  if (lhs) p->op = OP_JMPF_LL;  break;
+					case OP_JMPF_RK:  if (lhs) p->op = OP_JMPF_LK;  break;
+					default:;
+				}
+			} break;
+
+			default:;
+		}
+	}
+}
+
+void vm_free(VmProg *vp) {
+	da_foreach (Chunk*, it, &vp->chunks) {
+		da_free(&(*it)->code);
+		da_free(&(*it)->nodes);
+		da_free(&(*it)->consts);
+		da_free(&(*it)->names);
+		free(*it);
+	}
+
+	da_free(&vp->chunks);
+}
@@ -0,0 +1,535 @@
+#define _DEFAULT_SOURCE
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/epslc.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#ifdef _WIN32
+#define canonical_path(file, buf) _fullpath(buf, file, PATH_MAX)
+#else
+#define canonical_path(file, buf) realpath(file, buf)
+#endif
+
+// File layout, all integers in host byte order:
+//   EpslcHeader
+//   EpslcSource[src_count]   sources the program was parsed from
+//   EpslcNode[node_count]    nodes, children referenced by index,
+//                            64-bit literals stored across c and d
+//   u32[list_count]          child lists, runs of node indices
+//   char[str_size]           NUL-terminated ids, file names and literals
+// Locations are kept as the node's source index and byte offset, the
+// sources are reloaded to decode them.
+
+#define EPSLC_MAGIC  "EPSC"
+#define EPSLC_ENDIAN 0x01020304
+#define EPSLC_NONE   0xFFFFFFFF
+
+typedef struct {
+	char magic[4];
+	u32 version;
+	u32 endian;
+	u32 src_count;
+	u32 node_count;
+	u32 list_count;
+	u32 str_size;
+	u32 root;
+} EpslcHeader;
+
+typedef struct {
+	u32 file;
+	u32 path;
+	u64 hash;
+} EpslcSource;
+
+typedef struct {
+	u32 kind;
+	u32 src;
+	u32 off;
+	u32 a, b, c, d;
+} EpslcNode;
+
+HT(NodeIdx, AST*, u32);
+HT(StrIdx, char*, u32);
+
+u64 NodeIdx_hashf(AST *key) {
+	return (u64)(uintptr_t)key >> 4;
+}
+
+int NodeIdx_compare(AST *a, AST *b) {
+	return a != b;
+}
+
+u64 StrIdx_hashf(char *key) {
+	return (u64)(uintptr_t)key >> 3;
+}
+
+int StrIdx_compare(char *a, char *b) {
+	return a != b;
+}
+
+char *epslc_path(Parser *p, char *file) {
+	size_t len = strlen(file);
+	bool ext = len >= 5 && strcmp(file + len - 5, ".epsl") == 0;
+	char *path = arena_alloc(p->arena, len + 7);
+	sprintf(path, ext ? "%sc" : "%s.epslc", file);
+	return path;
+}
+
+typedef struct {
+	Parser *p;
+	NodeIdx nodes_idx;
+	StrIdx ids_idx;
+	DA(EpslcNode) nodes;
+	DA(u32) lists;
+	StringBuilder strs;
+	DA(EpslcSource) srcs;
+	DA(u32) src_map;
+	bool failed;
+} Writer;
+
+static u32 w_str(Writer *w, const char *s, size_t len) {
+	u32 off = w->strs.count;
+	da_append_many(&w->strs, s, len);
+	da_append(&w->strs, '\0');
+	return off;
+}
+
+// Ids are interned, so equal ids share one string.
+static u32 w_id(Writer *w, char *id) {
+	u32 *off = StrIdx_get(&w->ids_idx, id);
+	if (off) return *off;
+
+	u32 res = w_str(w, id, strlen(id));
+	StrIdx_add(&w->ids_idx, id, res);
+	return res;
+}
+
+static u32 w_src(Writer *w, u32 src) {
+	while (w->src_map.count <= src)
+		da_append(&w->src_map, EPSLC_NONE);
+	if (w->src_map.items[src] != EPSLC_NONE)
+		return w->src_map.items[src];
+
+	Source *s = &w->p->cache->srcs.items[src];
+	char path[PATH_MAX];
+	if (s->borrowed || !canonical_path(s->file, path)) {
+		w->failed = true;
+		return 0;
+	}
+
+	u32 res = w->srcs.count;
+	u32 file = w_str(w, s->file, strlen(s->file));
+	da_append(&w->srcs, ((EpslcSource){
+		.file = file,
+		.path = w_str(w, path, strlen(path)),
+		.hash = source_hash(s),
+	}));
+
+	w->src_map.items[src] = res;
+	return res;
+}
+
+static u32 w_node(Writer *w, AST *n);
+
+static u32 w_list(Writer *w, ASTs list) {
+	u32 *idx = malloc((list.count + 1) * sizeof(u32));
+	for (size_t i = 0; i < list.count; i++)
+		idx[i] = w_node(w, list.items[i]);
+
+	u32 off = w->lists.count;
+	da_append_many(&w->lists, idx, list.count);
+	free(idx);
+	return off;
+}
+
+// Shared nodes, such as the statements of a file imported twice, are
+// written once.
+static u32 w_node(Writer *w, AST *n) {
+	if (!n) return EPSLC_NONE;
+
+	u32 *seen = NodeIdx_get(&w->nodes_idx, n);
+	if (seen) return *seen;
+
+	u32 i = w->nodes.count;
+	da_append(&w->nodes, (EpslcNode){0});
+	NodeIdx_add(&w->nodes_idx, n, i);
+
+	EpslcNode en = {
+		.kind = n->kind,
+		.src = w_src(w, n->loc.src),
+		.off = n->loc.off,
+	};
+
+	switch (n->kind) {
+		case AST_PROG:
+			en.a = w_node(w, n->as.prog.body);
+			break;
+
+		case AST_VAR:
+		case AST_VAR_ANY:
+			en.a = w_id(w, n->as.var);
+			break;
+
+		case AST_VAR_DEF:
+			en.a = w_id(w, n->as.var_def.id);
+			en.b = w_node(w, n->as.var_def.expr);
+			break;
+
+		case AST_VAR_MUT:
+			en.a = w_node(w, n->as.var_mut);
+			break;
+
+		case AST_LIST:
+		case AST_DICT:
+		case AST_BODY:
+			en.a = w_list(w, n->as.body);
+			en.b = n->as.body.count;
+			break;
+
+		case AST_FUNC_DEF:
+			en.a = w_id(w, n->as.func_def.id);
+			en.b = w_list(w, n->as.func_def.args);
+			en.c = n->as.func_def.args.count;
+			en.d = w_node(w, n->as.func_def.body);
+			break;
+
+		case AST_FUNC_CALL:
+			en.a = w_id(w, n->as.func_call.id);
+			en.b = w_list(w, n->as.func_call.args);
+			en.c = n->as.func_call.args.count;
+			break;
+
+		case AST_ST_WHILE:
+			en.a = w_node(w, n->as.st_while.cond);
+			en.b = w_node(w, n->as.st_while.body);
+			break;
+
+		case AST_ST_FOR:
+			en.a = w_node(w, n->as.st_for.var);
+			en.b = w_node(w, n->as.st_for.cond);
+			en.c = w_node(w, n->as.st_for.mut);
+			en.d = w_node(w, n->as.st_for.body);
+			break;
+
+		case AST_ST_FOREACH:
+			en.a = w_id(w, n->as.st_foreach.var_id);
+			en.b = w_node(w, n->as.st_foreach.coll);
+			en.d = w_node(w, n->as.st_foreach.body);
+			break;
+
+		case AST_ST_IF:
+			en.a = w_node(w, n->as.st_if_chain.cond);
+			en.b = w_node(w, n->as.st_if_chain.body);
+			en.c = w_node(w, n->as.st_if_chain.chain);
+			break;
+
+		case AST_ST_ELSE:
+			en.a = w_node(w, n->as.st_else.body);
+			break;
+
+		case AST_BIN_EXPR:
+			en.a = n->as.bin_expr.op;
+			en.b = w_node(w, n->as.bin_expr.lhs);
+			en.c = w_node(w, n->as.bin_expr.rhs);
+			break;
+
+		case AST_UN_EXPR:
+			en.a = n->as.un_expr.op;
+			en.b = w_node(w, n->as.un_expr.v);
+			break;
+
+		case AST_LIT: {
+			AST_Literal lit = n->as.lit;
+			en.a = lit.kind;
+			switch (lit.kind) {
+				case LITERAL_INT:   memcpy(&en.c, &lit.as.vint, 8);   break;
+				case LITERAL_FLOAT: memcpy(&en.c, &lit.as.vfloat, 8); break;
+				case LITERAL_BOOL:  en.b = lit.as.vbool;              break;
+				case LITERAL_STR:
+					en.b = w_str(w, lit.as.vstr.items, lit.as.vstr.count);
+					en.c = lit.as.vstr.count;
+					break;
+			}
+		} break;
+
+		case AST_RET:
+			en.a = w_node(w, n->as.ret.expr);
+			break;
+
+		case AST_VAL_NONE:
+		case AST_BREAK:
+		case AST_CONT:
+			break;
+	}
+
+	w->nodes.items[i] = en;
+	return i;
+}
+
+bool epslc_write(Parser *p, AST *prog, char *path) {
+	Writer w = { .p = p };
+	u32 root = w_node(&w, prog);
+	bool ok = !w.failed;
+
+	EpslcHeader hdr = {
+		.magic = EPSLC_MAGIC,
+		.version = EPSLC_VERSION,
+		.endian = EPSLC_ENDIAN,
+		.src_count = w.srcs.count,
+		.node_count = w.nodes.count,
+		.list_count = w.lists.count,
+		.str_size = w.strs.count,
+		.root = root,
+	};
+
+	// Written under a temporary name and renamed, so a concurrent run
+	// never sees a partial file.
+	char *tmp = malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+
+	FILE *f = ok ? fopen(tmp, "wb") : NULL;
+	if (f) {
+		ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+			fwrite(w.srcs.items, sizeof(EpslcSource), w.srcs.count, f) == w.srcs.count &&
+			fwrite(w.nodes.items, sizeof(EpslcNode), w.nodes.count, f) == w.nodes.count &&
+			fwrite(w.lists.items, sizeof(u32), w.lists.count, f) == w.lists.count &&
+			fwrite(w.strs.items, 1, w.strs.count, f) == w.strs.count;
+		ok = fclose(f) == 0 && ok;
+		ok = ok && rename(tmp, path) == 0;
+		if (!ok) remove(tmp);
+	} else ok = false;
+
+	free(tmp);
+	NodeIdx_free(&w.nodes_idx);
+	StrIdx_free(&w.ids_idx);
+	da_free(&w.nodes);
+	da_free(&w.lists);
+	sb_free(&w.strs);
+	da_free(&w.srcs);
+	da_free(&w.src_map);
+	return ok;
+}
+
+// Checks the sources against the ones the program was built from and
+// maps them to indices in the cache's table. The script itself is
+// already loaded by the context, every other source is loaded here.
+static bool load_sources(Parser *p, EpslcSource *es, u32 count, char *strs, u32 *map) {
+	Sources *srcs = &p->cache->srcs;
+	Source *main_src = &srcs->items[p->lexer.src];
+	char main_path[PATH_MAX];
+	if (!canonical_path(main_src->file, main_path))
+		return false;
+
+	Sources loaded = {0};
+	bool ok = true;
+
+	for (u32 i = 0; ok && i < count; i++) {
+		char *file = strs + es[i].file;
+		char *path = strs + es[i].path;
+
+		if (strcmp(path, main_path) == 0) {
+			ok = source_hash(main_src) == es[i].hash;
+			map[i] = p->lexer.src;
+			continue;
+		}
+
+		char cur[PATH_MAX];
+		Source src;
+		ok = canonical_path(file, cur) && strcmp(cur, path) == 0 &&
+			source_load(&src, arena_strdup(p->arena, file));
+		if (!ok) break;
+
+		da_append(&loaded, src);
+		ok = source_hash(&src) == es[i].hash;
+		map[i] = srcs->count + loaded.count - 1;
+	}
+
+	if (ok) {
+		da_foreach (Source, src, &loaded)
+			da_append(srcs, *src);
+		da_free(&loaded);
+	} else sources_free(&loaded);
+
+	return ok;
+}
+
+AST *epslc_load(Parser *p, char *path) {
+	Source f;
+	if (!source_load(&f, path))
+		return NULL;
+
+	AST *prog = NULL;
+	u32 *map = NULL;
+	EpslcHeader hdr;
+
+	if (f.size < sizeof(hdr)) goto exit;
+	memcpy(&hdr, f.code, sizeof(hdr));
+	if (memcmp(hdr.magic, EPSLC_MAGIC, 4) != 0 ||
+		hdr.version != EPSLC_VERSION ||
+		hdr.endian != EPSLC_ENDIAN) goto exit;
+
+	size_t size = sizeof(hdr) +
+		(size_t)hdr.src_count * sizeof(EpslcSource) +
+		(size_t)hdr.node_count * sizeof(EpslcNode) +
+		(size_t)hdr.list_count * sizeof(u32) +
+		hdr.str_size;
+	if (size != f.size || hdr.root >= hdr.node_count) goto exit;
+
+	EpslcSource *es = (EpslcSource*)(f.code + sizeof(hdr));
+	EpslcNode *en = (EpslcNode*)(es + hdr.src_count);
+	u32 *lists = (u32*)(en + hdr.node_count);
+	char *strs = (char*)(lists + hdr.list_count);
+	if (!hdr.str_size || strs[hdr.str_size - 1] != '\0') goto exit;
+
+	for (u32 i = 0; i < hdr.src_count; i++)
+		if (es[i].file >= hdr.str_size || es[i].path >= hdr.str_size) goto exit;
+
+	map = malloc((hdr.src_count + 1) * sizeof(u32));
+	if (!load_sources(p, es, hdr.src_count, strs, map)) goto exit;
+
+	AST *nodes = arena_alloc(p->arena, hdr.node_count * sizeof(AST));
+	AST **items = arena_alloc(p->arena, (hdr.list_count + 1) * sizeof(AST*));
+	char *pool = arena_memdup(p->arena, strs, hdr.str_size);
+	Interns *in = p->lexer.interns;
+
+	for (u32 i = 0; i < hdr.list_count; i++) {
+		if (lists[i] >= hdr.node_count) goto exit;
+		items[i] = &nodes[lists[i]];
+	}
+
+	#define NODE(i) ((i) == EPSLC_NONE ? NULL : \
+		(i) < hdr.node_count ? &nodes[i] : (ok = false, NULL))
+	#define ID(i)   ((i) < hdr.str_size ? intern_cstr(in, pool + (i)) : (ok = false, NULL))
+	#define LIST(off, cnt) ((u64)(off) + (cnt) <= hdr.list_count ? \
+		(ASTs){ items + (off), (cnt) } : (ok = false, (ASTs){0}))
+
+	bool ok = true;
+	for (u32 i = 0; ok && i < hdr.node_count; i++) {
+		EpslcNode e = en[i];
+		AST *n = &nodes[i];
+		if (e.src >= hdr.src_count || e.kind > AST_CONT) goto exit;
+
+		*n = (AST){
+			.kind = e.kind,
+			.loc = { map[e.src], e.off },
+		};
+
+		switch (n->kind) {
+			case AST_PROG:
+				n->as.prog.body = NODE(e.a);
+				break;
+
+			case AST_VAR:
+			case AST_VAR_ANY:
+				n->as.var = ID(e.a);
+				break;
+
+			case AST_VAR_DEF:
+				n->as.var_def.id = ID(e.a);
+				n->as.var_def.expr = NODE(e.b);
+				break;
+
+			case AST_VAR_MUT:
+				n->as.var_mut = NODE(e.a);
+				break;
+
+			case AST_LIST:
+			case AST_DICT:
+			case AST_BODY:
+				n->as.body = LIST(e.a, e.b);
+				break;
+
+			case AST_FUNC_DEF:
+				n->as.func_def.id = ID(e.a);
+				n->as.func_def.args = LIST(e.b, e.c);
+				n->as.func_def.body = NODE(e.d);
+				break;
+
+			case AST_FUNC_CALL:
+				n->as.func_call.id = ID(e.a);
+				n->as.func_call.args = LIST(e.b, e.c);
+				break;
+
+			case AST_ST_WHILE:
+				n->as.st_while.cond = NODE(e.a);
+				n->as.st_while.body = NODE(e.b);
+				break;
+
+			case AST_ST_FOR:
+				n->as.st_for.var = NODE(e.a);
+				n->as.st_for.cond = NODE(e.b);
+				n->as.st_for.mut = NODE(e.c);
+				n->as.st_for.body = NODE(e.d);
+				break;
+
+			case AST_ST_FOREACH:
+				n->as.st_foreach.var_id = ID(e.a);
+				n->as.st_foreach.coll = NODE(e.b);
+				n->as.st_foreach.body = NODE(e.d);
+				break;
+
+			case AST_ST_IF:
+				n->as.st_if_chain.cond = NODE(e.a);
+				n->as.st_if_chain.body = NODE(e.b);
+				n->as.st_if_chain.chain = NODE(e.c);
+				break;
+
+			case AST_ST_ELSE:
+				n->as.st_else.body = NODE(e.a);
+				break;
+
+			case AST_BIN_EXPR:
+				n->as.bin_expr.op = e.a;
+				n->as.bin_expr.lhs = NODE(e.b);
+				n->as.bin_expr.rhs = NODE(e.c);
+				break;
+
+			case AST_UN_EXPR:
+				n->as.un_expr.op = e.a;
+				n->as.un_expr.v = NODE(e.b);
+				break;
+
+			case AST_LIT: {
+				AST_Literal *lit = &n->as.lit;
+				lit->kind = e.a;
+				switch (lit->kind) {
+					case LITERAL_INT:   memcpy(&lit->as.vint, &e.c, 8);   break;
+					case LITERAL_FLOAT: memcpy(&lit->as.vfloat, &e.c, 8); break;
+					case LITERAL_BOOL:  lit->as.vbool = e.b != 0;         break;
+					case LITERAL_STR:
+						if ((u64)e.b + e.c >= hdr.str_size) ok = false;
+						else lit->as.vstr = (StrSlice){ pool + e.b, e.c };
+						break;
+					default: ok = false;
+				}
+			} break;
+
+			case AST_RET:
+				n->as.ret.expr = NODE(e.a);
+				break;
+
+			case AST_VAL_NONE:
+			case AST_BREAK:
+			case AST_CONT:
+				break;
+		}
+	}
+
+	#undef NODE
+	#undef ID
+	#undef LIST
+
+	if (ok && nodes[hdr.root].kind == AST_PROG)
+		prog = &nodes[hdr.root];
+
+exit:
+	free(map);
+	source_free(&f);
+	return prog;
+}
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include "../include/eval.h"
 
@@ -7,11 +8,6 @@ HT_IMPL(ValDict, Val, Val);
 
 #define INVALID_COMB "invalid combination of operand and operators"
 
-#define is_heap_val(vk) ( \
-	(vk).kind == VAL_DICT || \
-	(vk).kind == VAL_STR || \
-	(vk).kind == VAL_LIST)
-
 GC_Object *eval_gc_alloc(EvalCtx *ctx, int val_kind);
 
 void eval_stack_add(EvalCtx *ctx, EvalSymbol es) {
@@ -19,48 +15,263 @@ void eval_stack_add(EvalCtx *ctx, EvalSymbol es) {
 }
 
 Val eval_new_heap_val(EvalCtx *ctx, int kind) {
-	Val hv = {
-		.kind = kind,
-		.as.gc_obj = eval_gc_alloc(ctx, kind),
-	};
+	Val hv = val_obj(kind, eval_gc_alloc(ctx, kind));
+	da_append(&ctx->temps, hv);
+	return hv;
+}
 
-	eval_stack_add(ctx, (EvalSymbol){
-		.kind = EVAL_SYMB_TEMP,
-		.as.temp.val = hv,
-	});
+// A lazy list of count ints from start by step. The caller makes sure
+// they all fit unboxed.
+Val eval_new_range(EvalCtx *ctx, long long start, long long step, size_t count) {
+	Val list = eval_new_heap_val(ctx, VAL_LIST);
+	GC_Object *obj = VOBJ(list);
+	ValRange *r = realloc(obj->data, sizeof(*r));
+	r->list.count = count;
+	r->start = start;
+	r->step = step;
+	obj->data = r;
+	obj->lazy = true;
+	return list;
+}
 
-	return hv;
+// Lazy lists are made in the arena they were created for and stay in
+// their data, so values pointing to them see the items.
+void eval_list_make(GC_Object *obj) {
+	ValRange *r = obj->data;
+	size_t count = r->list.count;
+	r->list.count = 0;
+	da_reserve(&r->list, count);
+	for (size_t i = 0; i < count; i++)
+		r->list.items[i] = val_int(NULL, INT_WRAP(r->start, +, INT_WRAP(i, *, r->step)));
+
+	r->list.count = count;
+	obj->lazy = false;
 }
 
-void eval_error(EvalCtx *ctx, Location loc, char *msg) {
+// The value of a literal that needs no context to make, strings are made
+// anew on every evaluation and ints may have to be boxed.
+bool eval_lit_const(AST *n, Val *v) {
+	if (n->kind != AST_LIT) return false;
+
+	switch (n->as.lit.kind) {
+		case LITERAL_INT:
+			if (!VAL_INT_FITS(n->as.lit.as.vint)) return false;
+			*v = val_int(NULL, n->as.lit.as.vint);
+			return true;
+
+		case LITERAL_FLOAT:
+			*v = val_float(n->as.lit.as.vfloat);
+			return true;
+
+		case LITERAL_BOOL:
+			*v = val_bool(n->as.lit.as.vbool);
+			return true;
+
+		default: return false;
+	}
+}
+
+void eval_error(EvalCtx *ctx, SrcLoc loc, char *msg) {
 	ctx->err_ctx.got_err = true;
-	ctx->err_ctx.errf(loc, ERROR_RUNTIME, msg);
+	ctx->err_ctx.errf(source_loc(ctx->srcs, loc), ERROR_RUNTIME, msg);
 }
 
 EvalSymbol *eval_stack_get(EvalCtx *es, char *id) {
 	for (int i = es->stack.count - 1; i >= 0; i--) {
-		if (da_get(&es->stack, i).kind != EVAL_SYMB_TEMP) {
-			if (strcmp(da_get(&es->stack, i).id, id) == 0) {
-				return &da_get(&es->stack, i);
-			}
+		if (da_get(&es->stack, i).id == id) {
+			return &da_get(&es->stack, i);
 		}
 	}
 
 	return NULL;
 }
 
+#define GLOBALS_INIT_CAP 64
+
+// Ids are interned, so the table hashes and compares their pointers.
+size_t eval_global_hash(EvalGlobals *g, char *id) {
+	return (hash_num((uintptr_t)id) >> 32) & (g->capacity - 1);
+}
+
+// The slot holding id, or the free one it would take.
+EvalSymbol *eval_global_slot(EvalGlobals *g, char *id) {
+	size_t i = eval_global_hash(g, id);
+	while (g->slots[i].id && g->slots[i].id != id)
+		i = (i + 1) & (g->capacity - 1);
+	return &g->slots[i];
+}
+
+EvalSymbol *eval_global_get(EvalCtx *ctx, char *id) {
+	if (!ctx->globals.count) return NULL;
+	EvalSymbol *es = eval_global_slot(&ctx->globals, id);
+	return es->id ? es : NULL;
+}
+
+// Reinserts every global, into a bigger table or after their ids changed.
+void eval_globals_rehash(EvalCtx *ctx, size_t capacity) {
+	EvalGlobals old = ctx->globals;
+	ctx->globals = (EvalGlobals){
+		.slots = calloc(capacity, sizeof(EvalSymbol)),
+		.capacity = capacity,
+	};
+
+	for (size_t i = 0; i < old.capacity; i++) {
+		if (!old.slots[i].id) continue;
+		*eval_global_slot(&ctx->globals, old.slots[i].id) = old.slots[i];
+		ctx->globals.count++;
+	}
+
+	free(old.slots);
+	ctx->epoch++;
+}
+
+void eval_global_set(EvalCtx *ctx, EvalSymbol es) {
+	EvalGlobals *g = &ctx->globals;
+	if ((g->count + 1) * 2 > g->capacity)
+		eval_globals_rehash(ctx, g->capacity ? g->capacity * 2 : GLOBALS_INIT_CAP);
+
+	EvalSymbol *slot = eval_global_slot(g, es.id);
+	if (!slot->id) g->count++;
+	*slot = es;
+	ctx->epoch++;
+}
+
+// Shifts back the entries after the removed one that may take its slot,
+// so no probe sequence is broken.
+void eval_global_del(EvalCtx *ctx, char *id) {
+	EvalGlobals *g = &ctx->globals;
+	if (!g->count) return;
+
+	size_t mask = g->capacity - 1;
+	size_t i = eval_global_slot(g, id) - g->slots;
+	if (!g->slots[i].id) return;
+
+	for (size_t j = (i + 1) & mask; g->slots[j].id; j = (j + 1) & mask) {
+		size_t home = eval_global_hash(g, g->slots[j].id);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			g->slots[i] = g->slots[j];
+			i = j;
+		}
+	}
+
+	g->slots[i] = (EvalSymbol){0};
+	g->count--;
+	ctx->epoch++;
+}
+
+// Locals shadow the globals, as the dynamic scoping of the language has
+// them found first.
+EvalSymbol *eval_lookup(EvalCtx *ctx, char *id) {
+	EvalSymbol *es = eval_stack_get(ctx, id);
+	return es ? es : eval_global_get(ctx, id);
+}
+
+// n is a var or a call, see resolve.
+EvalSymbol *eval_symbol(EvalCtx *ctx, AST *n, char *id) {
+	if (n->slot) return &da_get(&ctx->stack, ctx->frame + n->slot - 1);
+	return eval_lookup(ctx, id);
+}
+
+// Calls with a site skip the lookup while their cache holds: nothing that
+// could shadow the callee was defined since, and the callee is still on
+// the stack or in the globals. Names that variables take never get a
+// site, see resolve.
+EvalSymbol *eval_callee(EvalCtx *ctx, AST *call) {
+	char *id = call->as.func_call.id;
+	if (call->slot) return &da_get(&ctx->stack, ctx->frame + call->slot - 1);
+	if (!call->as.func_call.site) return eval_lookup(ctx, id);
+
+	EvalCallCache *cc = &da_get(&ctx->calls, call->as.func_call.site - 1);
+	if (cc->epoch == ctx->epoch) {
+		if (cc->global) return cc->global;
+		if (cc->idx < ctx->stack.count && da_get(&ctx->stack, cc->idx).id == id)
+			return &da_get(&ctx->stack, cc->idx);
+	}
+
+	EvalSymbol *es = eval_stack_get(ctx, id);
+	EvalSymbol *global = es ? NULL : eval_global_get(ctx, id);
+	if (es || global) {
+		cc->epoch = ctx->epoch;
+		cc->idx = es ? es - ctx->stack.items : 0;
+		cc->global = global;
+	}
+
+	return es ? es : global;
+}
+
+// The location a builtin is called with. Calls with a site decode it on
+// their first call of one and keep it, the rest on every call.
+Location eval_call_loc(EvalCtx *ctx, AST *call) {
+	if (!call->as.func_call.site) return source_loc(ctx->srcs, call->loc);
+
+	EvalCallCache *cc = &da_get(&ctx->calls, call->as.func_call.site - 1);
+	if (!cc->loc.line_char || cc->at.src != call->loc.src || cc->at.off != call->loc.off) {
+		cc->at = call->loc;
+		cc->loc = source_loc(ctx->srcs, call->loc);
+	}
+
+	return cc->loc;
+}
+
+void eval_def_func(EvalCtx *ctx, char *id, AST *node, void *code) {
+	ctx->epoch++;
+	eval_stack_add(ctx, (EvalSymbol){
+		.kind = EVAL_SYMB_FUNC,
+		.id = id,
+		.as.func.node = node,
+		.as.func.code = code,
+	});
+}
+
+void eval_def_global(EvalCtx *ctx, char *id, AST *node, void *code) {
+	EvalSymbol *prev = eval_global_get(ctx, id);
+	da_append(&ctx->global_defs, ((EvalGlobalDef){
+		.id = id,
+		.prev = prev ? *prev : (EvalSymbol){0},
+	}));
+
+	eval_global_set(ctx, (EvalSymbol){
+		.kind = EVAL_SYMB_FUNC,
+		.id = id,
+		.as.func.node = node,
+		.as.func.code = code,
+	});
+}
+
+// Undoes the top level functions defined since there were defs of them.
+void eval_drop_globals(EvalCtx *ctx, size_t defs) {
+	while (ctx->global_defs.count > defs) {
+		EvalGlobalDef *d = &ctx->global_defs.items[--ctx->global_defs.count];
+		if (d->prev.id) eval_global_set(ctx, d->prev);
+		else eval_global_del(ctx, d->id);
+	}
+}
+
+// Sites are numbered per program, so the caches of the last one run are
+// dropped.
+void eval_bind_sites(EvalCtx *ctx, AST *prog) {
+	ctx->epoch++;
+	while (ctx->calls.count < prog->as.prog.sites)
+		da_append(&ctx->calls, (EvalCallCache){0});
+}
+
 u64 ValDict_hashf(Val key) {
-	switch (key.kind) {
+	switch (VKIND(key)) {
 		case VAL_NONE:  return 0;
-		case VAL_INT:   return hash_num(key.as.vint);
-		case VAL_FLOAT: return hash_num(key.as.vint);
-		case VAL_BOOL:  return hash_num(key.as.vbool);
+		case VAL_INT:   return hash_num(VINT(key));
+		case VAL_FLOAT: {
+			double f = VFLOAT(key);
+			u64 bits;
+			memcpy(&bits, &f, sizeof(bits));
+			return hash_num(bits);
+		}
+		case VAL_BOOL:  return hash_num(VBOOL(key));
 		case VAL_STR:   return hash_str(VSTR(key)->items);
 
 		case VAL_LIST: {
 			u64 hash = 0;
-			da_foreach (Val, v, VLIST(key)) {
-				hash_combine(hash, ValDict_hashf(*v));
+			for (size_t i = 0; i < VLIST(key)->count; i++) {
+				hash_combine(hash, ValDict_hashf(val_list_at(key, i)));
 			}
 
 			return hash;
@@ -79,13 +290,13 @@ u64 ValDict_hashf(Val key) {
 }
 
 int ValDict_compare(Val a, Val b) {
-	if (a.kind != b.kind) return 1;
+	if (VKIND(a) != VKIND(b)) return 1;
 
-	switch (a.kind) {
+	switch (VKIND(a)) {
 		case VAL_NONE:  return 0;
-		case VAL_INT:   return a.as.vint != b.as.vint;
-		case VAL_FLOAT: return a.as.vfloat != b.as.vfloat;
-		case VAL_BOOL:  return a.as.vbool != b.as.vbool;
+		case VAL_INT:   return VINT(a) != VINT(b);
+		case VAL_FLOAT: return VFLOAT(a) != VFLOAT(b);
+		case VAL_BOOL:  return VBOOL(a) != VBOOL(b);
 		case VAL_STR:   return strcmp(VSTR(a)->items, VSTR(b)->items);
 
 		case VAL_LIST: {
@@ -93,7 +304,7 @@ int ValDict_compare(Val a, Val b) {
 				return 1;
 
 			for (size_t i = 0; i < VLIST(a)->count; i++) {
-				if (ValDict_compare(VLIST(a)->items[i], VLIST(b)->items[i]) != 0)
+				if (ValDict_compare(val_list_at(a, i), val_list_at(b, i)) != 0)
 					return 1;
 			}
 
@@ -116,9 +327,9 @@ int ValDict_compare(Val a, Val b) {
 }
 
 #define vget(v) ( \
-	(v).kind == VAL_INT   ? (v).as.vint   : \
-	(v).kind == VAL_FLOAT ? (v).as.vfloat : \
-	(v).kind == VAL_BOOL  ? (v).as.vbool  : 0)
+	VKIND(v) == VAL_INT   ? VINT(v)   : \
+	VKIND(v) == VAL_FLOAT ? VFLOAT(v) : \
+	VKIND(v) == VAL_BOOL  ? VBOOL(v)  : 0)
 
 #define binop(ctx, op_loc, op, l, r) ( \
 	op == AST_OP_ADD      ? (l) +  (r) : \
@@ -140,42 +351,52 @@ int ValDict_compare(Val a, Val b) {
 	op == AST_OP_NEG  ? -(v) : \
 	(eval_error(ctx, op_loc, "invalid operator"), 0))
 
-void eval_val_mut(EvalCtx *ctx, Location op_loc, AST_Op op, Val *mut, Val to) {
-	if ((is_heap_val(*mut) || is_heap_val(to)) && op != AST_OP_EQ) {
+void eval_val_mut(EvalCtx *ctx, SrcLoc op_loc, AST_Op op, Val *mut, Val to) {
+	if ((VIS_HEAP(*mut) || VIS_HEAP(to)) && op != AST_OP_EQ) {
 		eval_error(ctx, op_loc, INVALID_COMB);
 		return;
 	}
 
+	if (VKIND(*mut) == VAL_INT && VKIND(to) == VAL_INT) {
+		long long l = VINT(*mut), r = VINT(to);
+		switch (op) {
+			case AST_OP_ADD_EQ: *mut = val_int(ctx, INT_WRAP(l, +, r)); return;
+			case AST_OP_SUB_EQ: *mut = val_int(ctx, INT_WRAP(l, -, r)); return;
+			case AST_OP_MUL_EQ: *mut = val_int(ctx, INT_WRAP(l, *, r)); return;
+			default: break;
+		}
+	}
+
 	switch (op) {
 		case AST_OP_ADD_EQ:
-			switch (mut->kind) {
-				case VAL_FLOAT: mut->as.vfloat += vget(to); break;
-				case VAL_INT:   mut->as.vint   += vget(to); break;
-				case VAL_BOOL:  mut->as.vbool  += vget(to); break;
+			switch (VKIND(*mut)) {
+				case VAL_FLOAT: *mut = val_float(VFLOAT(*mut) + vget(to));  break;
+				case VAL_INT:   *mut = val_int(ctx, VINT(*mut) + vget(to)); break;
+				case VAL_BOOL:  *mut = val_bool(VBOOL(*mut) + vget(to));   break;
 				default: assert(0);
 			} break;
 
 		case AST_OP_SUB_EQ:
-			switch (mut->kind) {
-				case VAL_FLOAT: mut->as.vfloat -= vget(to); break;
-				case VAL_INT:   mut->as.vint   -= vget(to); break;
-				case VAL_BOOL:  mut->as.vbool  -= vget(to); break;
+			switch (VKIND(*mut)) {
+				case VAL_FLOAT: *mut = val_float(VFLOAT(*mut) - vget(to));  break;
+				case VAL_INT:   *mut = val_int(ctx, VINT(*mut) - vget(to)); break;
+				case VAL_BOOL:  *mut = val_bool(VBOOL(*mut) - vget(to));   break;
 				default: assert(0);
 			} break;
 
 		case AST_OP_MUL_EQ:
-			switch (mut->kind) {
-				case VAL_FLOAT: mut->as.vfloat *= vget(to); break;
-				case VAL_INT:   mut->as.vint   *= vget(to); break;
-				case VAL_BOOL:  mut->as.vbool  *= vget(to); break;
+			switch (VKIND(*mut)) {
+				case VAL_FLOAT: *mut = val_float(VFLOAT(*mut) * vget(to));  break;
+				case VAL_INT:   *mut = val_int(ctx, VINT(*mut) * vget(to)); break;
+				case VAL_BOOL:  *mut = val_bool(VBOOL(*mut) * vget(to));   break;
 				default: assert(0);
 			} break;
 
 		case AST_OP_DIV_EQ:
-			switch (mut->kind) {
-				case VAL_FLOAT: mut->as.vfloat /= vget(to); break;
-				case VAL_INT:   mut->as.vint   /= vget(to); break;
-				case VAL_BOOL:  mut->as.vbool  /= vget(to); break;
+			switch (VKIND(*mut)) {
+				case VAL_FLOAT: *mut = val_float(VFLOAT(*mut) / vget(to));  break;
+				case VAL_INT:   *mut = val_int(ctx, VINT(*mut) / vget(to)); break;
+				case VAL_BOOL:  *mut = val_bool(VBOOL(*mut) / vget(to));   break;
 				default: assert(0);
 			} break;
 
@@ -184,7 +405,7 @@ void eval_val_mut(EvalCtx *ctx, Location op_loc, AST_Op op, Val *mut, Val to) {
 }
 
 int val_kind_to_prec(Val v) {
-	switch (v.kind) {
+	switch (VKIND(v)) {
 		case VAL_BOOL:  return 1;
 		case VAL_INT:   return 2;
 		case VAL_FLOAT: return 3;
@@ -201,13 +422,21 @@ int prec_to_val_kind(int pr) {
 	}
 }
 
-Val eval_binop(EvalCtx *ctx, AST *n) {
+// x % 0 traps and so does LLONG_MIN % -1, which is 0 like any x % -1.
+Val eval_mod_ints(EvalCtx *ctx, AST *n, long long l, long long r) {
+	if (r == 0) {
+		eval_error(ctx, n->loc, "modulo by zero");
+		return VNONE;
+	}
+
+	return val_int(ctx, r == -1 ? 0 : l % r);
+}
+
+// Everything the kernels below leave out: strings, lists, dicts, none,
+// bools and the operators numbers do not have.
+Val eval_binop_any(EvalCtx *ctx, AST *n, Val lv, Val rv) {
 	AST_Op op = n->as.bin_expr.op;
-	Val lv = eval(ctx, n->as.bin_expr.lhs);
-	if (ctx->err_ctx.got_err) return VNONE;
-	Val rv = eval(ctx, n->as.bin_expr.rhs);
-	if (ctx->err_ctx.got_err) return VNONE;
-	int lk = lv.kind, rk = rv.kind;
+	int lk = VKIND(lv), rk = VKIND(rv);
 
 	if (op == AST_OP_MOD) {
 		if (lk != VAL_INT || rk != VAL_INT) {
@@ -215,20 +444,11 @@ Val eval_binop(EvalCtx *ctx, AST *n) {
 			return VNONE;
 		}
 
-		return (Val){
-			.kind = VAL_INT,
-			.as.vint = lv.as.vint % rv.as.vint,
-		};
+		return eval_mod_ints(ctx, n, VINT(lv), VINT(rv));
 	} else if (lk == VAL_STR && rk == VAL_STR && op == AST_OP_NOT_EQ) {
-		return (Val){
-			.kind = VAL_BOOL,
-			.as.vbool = strcmp(VSTR(lv)->items, VSTR(rv)->items) != 0,
-		};
+		return val_bool(strcmp(VSTR(lv)->items, VSTR(rv)->items) != 0);
 	} else if (lk == VAL_STR && rk == VAL_STR && op == AST_OP_IS_EQ) {
-		return (Val){
-			.kind = VAL_BOOL,
-			.as.vbool = strcmp(VSTR(lv)->items, VSTR(rv)->items) == 0,
-		};
+		return val_bool(strcmp(VSTR(lv)->items, VSTR(rv)->items) == 0);
 	} else if (op == AST_OP_IS_EQ || op == AST_OP_NOT_EQ ||
 		op == AST_OP_AND || op == AST_OP_OR ||
 		op == AST_OP_GREAT || op == AST_OP_GREAT_EQ ||
@@ -243,10 +463,7 @@ Val eval_binop(EvalCtx *ctx, AST *n) {
 			res = true;
 		} else res = binop(ctx, n->loc, op, vget(lv), vget(rv));
 
-		return (Val){
-			.kind = VAL_BOOL,
-			.as.vbool = res,
-		};
+		return val_bool(res);
 	} else if (lk == VAL_NONE || rk == VAL_NONE) {
 		eval_error(ctx, n->loc, INVALID_COMB);
 	} else if (lk == VAL_STR && rk == VAL_STR && op == AST_OP_ADD) {
@@ -255,28 +472,27 @@ Val eval_binop(EvalCtx *ctx, AST *n) {
 		sb_appendf(sb, "%s%s", VSTR(lv)->items, VSTR(rv)->items);
 		return str;
 	} else if (lk == VAL_LIST && rk == VAL_LIST && op == AST_OP_ADD) {
+		Vals *l = val_list(lv), *r = val_list(rv);
 		Val list = eval_new_heap_val(ctx, VAL_LIST);
-		da_append_many(VLIST(list), VLIST(lv)->items, VLIST(lv)->count);
-		da_append_many(VLIST(list), VLIST(rv)->items, VLIST(rv)->count);
+		da_append_many(VLIST(list), l->items, l->count);
+		da_append_many(VLIST(list), r->items, r->count);
 		return list;
 	} else if (lk == VAL_INT && rk == VAL_INT && op == AST_OP_DIV) {
-		return (Val){
-			.kind = VAL_FLOAT,
-			.as.vfloat = binop(ctx, n->loc, op, vget(lv), vget(rv))
-		};
+		return val_float(binop(ctx, n->loc, op, vget(lv), vget(rv)));
 	} else if (lk == VAL_DICT && op == AST_OP_ARR) {
 		Val *val = ValDict_get(VDICT(lv), rv);
 		if (!val) return VNONE;
 		return *val;
 	} else if (lk == VAL_LIST && rk == VAL_INT && op == AST_OP_ARR) {
-		if (rv.as.vint < 0 || rv.as.vint >= VLIST(lv)->count) {
+		long long i = VINT(rv);
+		if (i < 0 || i >= VLIST(lv)->count) {
 			char err[512];
-			sprintf(err, "index %lli is not in the range 0..%zu", rv.as.vint, VLIST(lv)->count);
+			sprintf(err, "index %lli is not in the range 0..%zu", i, VLIST(lv)->count);
 			eval_error(ctx, n->loc, err);
 			return VNONE;
 		}
 
-		return da_get(VLIST(lv), rv.as.vint);
+		return val_list_at(lv, i);
 	} else {
 		if (lk != VAL_INT && lk != VAL_FLOAT && lk != VAL_BOOL) {
 			eval_error(ctx, n->as.bin_expr.lhs->loc, INVALID_COMB);
@@ -292,54 +508,337 @@ Val eval_binop(EvalCtx *ctx, AST *n) {
 		if (rp > lp) retp = rp;
 
 		switch (prec_to_val_kind(retp)) {
-			case VAL_FLOAT: return (Val){
-				.kind = VAL_FLOAT,
-				.as.vfloat = binop(ctx, n->loc, op, vget(lv), vget(rv))
-			};
-
-			case VAL_INT: return (Val){
-				.kind = VAL_INT,
-				.as.vint = binop(ctx, n->loc, op, vget(lv), vget(rv))
-			};
-
-			case VAL_BOOL: return (Val){
-				.kind = VAL_BOOL,
-				.as.vbool = binop(ctx, n->loc, op, vget(lv), vget(rv))
-			};
+			case VAL_FLOAT: return val_float(binop(ctx, n->loc, op, vget(lv), vget(rv)));
+			case VAL_INT:   return val_int(ctx, binop(ctx, n->loc, op, vget(lv), vget(rv)));
+			case VAL_BOOL:  return val_bool(binop(ctx, n->loc, op, vget(lv), vget(rv)));
 		}
 	}
 
 	return VNONE;
 }
 
-Val eval_unop(EvalCtx *ctx, AST *n) {
-	AST_Op op = n->as.bin_expr.op;
-	Val v = eval(ctx, n->as.un_expr.v);
+Val eval_binop_ints(EvalCtx *ctx, AST *n, Val lv, Val rv) {
+	long long l = VINT(lv), r = VINT(rv);
+	switch (n->as.bin_expr.op) {
+		case AST_OP_ADD:      return val_int(ctx, INT_WRAP(l, +, r));
+		case AST_OP_SUB:      return val_int(ctx, INT_WRAP(l, -, r));
+		case AST_OP_MUL:      return val_int(ctx, INT_WRAP(l, *, r));
+		case AST_OP_DIV:      return val_float((double)l / (double)r);
+		case AST_OP_MOD:      return eval_mod_ints(ctx, n, l, r);
+		case AST_OP_IS_EQ:    return val_bool(l == r);
+		case AST_OP_NOT_EQ:   return val_bool(l != r);
+		case AST_OP_GREAT:    return val_bool(l >  r);
+		case AST_OP_GREAT_EQ: return val_bool(l >= r);
+		case AST_OP_LESS:     return val_bool(l <  r);
+		case AST_OP_LESS_EQ:  return val_bool(l <= r);
+		case AST_OP_AND:      return val_bool(l && r);
+		case AST_OP_OR:       return val_bool(l || r);
+		default:              return eval_binop_any(ctx, n, lv, rv);
+	}
+}
+
+// Floats with each other and with ints, which are converted first.
+Val eval_binop_floats(EvalCtx *ctx, AST *n, Val lv, Val rv, double l, double r) {
+	switch (n->as.bin_expr.op) {
+		case AST_OP_ADD:      return val_float(l + r);
+		case AST_OP_SUB:      return val_float(l - r);
+		case AST_OP_MUL:      return val_float(l * r);
+		case AST_OP_DIV:      return val_float(l / r);
+		case AST_OP_IS_EQ:    return val_bool(l == r);
+		case AST_OP_NOT_EQ:   return val_bool(l != r);
+		case AST_OP_GREAT:    return val_bool(l >  r);
+		case AST_OP_GREAT_EQ: return val_bool(l >= r);
+		case AST_OP_LESS:     return val_bool(l <  r);
+		case AST_OP_LESS_EQ:  return val_bool(l <= r);
+		case AST_OP_AND:      return val_bool(l && r);
+		case AST_OP_OR:       return val_bool(l || r);
+		default:              return eval_binop_any(ctx, n, lv, rv);
+	}
+}
+
+#define KIND_PAIR(l, r) ((l) * (VAL_DICT + 1) + (r))
+
+// Numbers go to a kernel for the kinds of both operands, ints are exact.
+Val eval_binop_vals(EvalCtx *ctx, AST *n, Val lv, Val rv) {
+	switch (KIND_PAIR(VKIND(lv), VKIND(rv))) {
+		case KIND_PAIR(VAL_INT, VAL_INT):
+			return eval_binop_ints(ctx, n, lv, rv);
+		case KIND_PAIR(VAL_FLOAT, VAL_FLOAT):
+			return eval_binop_floats(ctx, n, lv, rv, VFLOAT(lv), VFLOAT(rv));
+		case KIND_PAIR(VAL_INT, VAL_FLOAT):
+			return eval_binop_floats(ctx, n, lv, rv, VINT(lv), VFLOAT(rv));
+		case KIND_PAIR(VAL_FLOAT, VAL_INT):
+			return eval_binop_floats(ctx, n, lv, rv, VFLOAT(lv), VINT(rv));
+		default:
+			return eval_binop_any(ctx, n, lv, rv);
+	}
+}
+
+Val eval_binop(EvalCtx *ctx, AST *n) {
+	Val lv = eval(ctx, n->as.bin_expr.lhs);
+	if (ctx->err_ctx.got_err) return VNONE;
+	Val rv = eval(ctx, n->as.bin_expr.rhs);
 	if (ctx->err_ctx.got_err) return VNONE;
+	return eval_binop_vals(ctx, n, lv, rv);
+}
 
-	if (v.kind != VAL_INT && v.kind != VAL_FLOAT && v.kind != VAL_BOOL) {
+Val eval_unop_val(EvalCtx *ctx, AST *n, Val v) {
+	AST_Op op = n->as.bin_expr.op;
+	int k = VKIND(v);
+	if (k != VAL_INT && k != VAL_FLOAT && k != VAL_BOOL) {
 		eval_error(ctx, n->as.bin_expr.lhs->loc, INVALID_COMB);
 		return VNONE;
 	}
 
-	switch (v.kind) {
-		case VAL_FLOAT: return (Val){
-			.kind = VAL_FLOAT,
-			.as.vfloat = unop(ctx, n->loc, op, vget(v)),
-		};
+	switch (k) {
+		case VAL_FLOAT: return val_float(unop(ctx, n->loc, op, vget(v)));
+		case VAL_INT:   return val_int(ctx, unop(ctx, n->loc, op, vget(v)));
+		case VAL_BOOL:  return val_bool(unop(ctx, n->loc, op, vget(v)));
 
-		case VAL_INT: return (Val){
-			.kind = VAL_INT,
-			.as.vint = unop(ctx, n->loc, op, vget(v)),
-		};
+		default: assert(0);
+	}
+}
 
-		case VAL_BOOL: return (Val){
-			.kind = VAL_BOOL,
-			.as.vbool = unop(ctx, n->loc, op, vget(v)),
-		};
+Val eval_unop(EvalCtx *ctx, AST *n) {
+	Val v = eval(ctx, n->as.un_expr.v);
+	if (ctx->err_ctx.got_err) return VNONE;
+	return eval_unop_val(ctx, n, v);
+}
 
-		default: assert(0);
+// n is the assignment, its lhs the indexing.
+void eval_index_mut(EvalCtx *ctx, AST *n, Val container, Val key, Val rhs_val) {
+	if (VKIND(container) == VAL_LIST) {
+		long long i = VINT(key);
+		if (i < 0 || i >= VLIST(container)->count) {
+			char err[512];
+			sprintf(err,
+				"index %lli is not in the range 0..%zu",
+				i, VLIST(container)->count);
+			eval_error(ctx, n->as.bin_expr.lhs->loc, err);
+			return;
+		}
+
+		Val *list_val = &da_get(val_list(container), i);
+		eval_val_mut(ctx, n->loc, n->as.bin_expr.op, list_val, rhs_val);
+	} else if (VKIND(container) == VAL_DICT) {
+		Val *dict_val = ValDict_get(VDICT(container), key);
+		if (!dict_val) ValDict_add(VDICT(container), key, rhs_val);
+		else eval_val_mut(ctx, n->loc, n->as.bin_expr.op, dict_val, rhs_val);
+	}
+}
+
+// Checks a call passes the amount of arguments def takes and returns
+// how many bind to parameters before _VA_ARGS_, or -1 on error.
+long eval_call_arity(EvalCtx *ctx, AST *call, AST *def, size_t argc) {
+	ASTs *params = &def->as.func_def.args;
+	size_t fixed = 0;
+	while (fixed < params->count && da_get(params, fixed)->kind != AST_VAR_ANY)
+		fixed++;
+
+	bool va = fixed < params->count;
+	if (va ? argc <= fixed : argc != fixed) {
+		eval_error(ctx, call->loc, "invalid amount of arguments");
+		return -1;
+	}
+
+	return fixed;
+}
+
+// The arguments of a call are pushed without a name while the rest are
+// evaluated, so they are only visible to the callee. This names them
+// after the parameters of def, collecting the variadic ones in a list.
+void eval_bind_params(EvalCtx *ctx, AST *def, size_t base, size_t fixed) {
+	ASTs *params = &def->as.func_def.args;
+	if (fixed < params->count) {
+		Val va_args = eval_new_heap_val(ctx, VAL_LIST);
+		for (size_t i = base + fixed; i < ctx->stack.count; i++)
+			da_append(VLIST(va_args), da_get(&ctx->stack, i).as.var.val);
+
+		ctx->stack.count = base + fixed;
+		eval_stack_add(ctx, (EvalSymbol){
+			.kind = EVAL_SYMB_VAR,
+			.as.var.val = va_args,
+		});
+	}
+
+	for (size_t i = base; i < ctx->stack.count; i++)
+		da_get(&ctx->stack, i).id = da_get(params, i - base)->as.var;
+}
+
+// Takes the arguments pushed from base on as the pending tail call and
+// returns like a return statement, the gc finds them in ctx->tail.
+void eval_tail_take(EvalCtx *ctx, AST *def, void *code, long fixed, size_t base) {
+	ctx->tail.args.count = 0;
+	for (size_t i = base; i < ctx->stack.count; i++)
+		da_append(&ctx->tail.args, ctx->stack.items[i].as.var.val);
+
+	ctx->tail.def = def;
+	ctx->tail.code = code;
+	ctx->tail.fixed = fixed;
+	ctx->stack.count = base;
+	ctx->state = EVAL_CTX_RET;
+}
+
+// Replaces the frame at base, the one of the call that took the pending
+// tail call, with the callee's and returns the callee.
+AST *eval_tail_enter(EvalCtx *ctx, size_t base) {
+	AST *def = ctx->tail.def;
+	ctx->tail.def = NULL;
+	ctx->stack.count = base;
+	da_foreach (Val, arg, &ctx->tail.args) {
+		eval_stack_add(ctx, (EvalSymbol){
+			.kind = EVAL_SYMB_VAR,
+			.as.var.val = *arg,
+		});
 	}
+
+	ctx->tail.args.count = 0;
+	eval_bind_params(ctx, def, base, ctx->tail.fixed);
+	ctx->state = EVAL_CTX_NONE;
+	return def;
+}
+
+// return f(...) where resolve set call.tail. Functions of the script are
+// taken as the pending tail call, anything else is called right away.
+Val eval_tail_call(EvalCtx *ctx, AST *call) {
+	EvalSymbol *func = eval_callee(ctx, call);
+	if (!func || func->kind != EVAL_SYMB_FUNC) {
+		Val res = eval(ctx, call);
+		ctx->state = EVAL_CTX_RET;
+		return res;
+	}
+
+	AST *def = func->as.func.node;
+	void *code = func->as.func.code;
+	ASTs *args = &call->as.func_call.args;
+	long fixed = eval_call_arity(ctx, call, def, args->count);
+	if (fixed < 0) return VNONE;
+
+	size_t base = ctx->stack.count;
+	da_foreach (AST*, it, args) {
+		Val arg = eval(ctx, *it);
+		if (ctx->err_ctx.got_err) return VNONE;
+		eval_stack_add(ctx, (EvalSymbol){
+			.kind = EVAL_SYMB_VAR,
+			.as.var.val = arg,
+		});
+	}
+
+	eval_tail_take(ctx, def, code, fixed, base);
+	return VNONE;
+}
+
+#define IS_NUM(v) (VKIND(v) == VAL_INT || VKIND(v) == VAL_FLOAT)
+
+// A for loop resolve found counting i from its var to its bound. The
+// comparison and the step are done in C on the value in i's slot, ints
+// exactly, instead of evaluating the cond and the mut nodes. i is read
+// back from the slot on every iteration since a callee may still assign
+// it through the dynamic scope. The bound and the step are evaluated
+// when the generic loop would, unless they are constants.
+Val eval_counted_for(EvalCtx *ctx, AST *n) {
+	AST *var = n->as.st_for.var, *cond = n->as.st_for.cond;
+	AST *mut = n->as.st_for.mut->as.var_mut;
+	AST *bound = cond->as.bin_expr.rhs, *step = mut->as.bin_expr.rhs;
+	AST_Op cmp = cond->as.bin_expr.op;
+	bool add = mut->as.bin_expr.op == AST_OP_ADD_EQ;
+
+	size_t base = ctx->stack.count;
+	size_t slot = var->kind == AST_VAR_DEF
+		? base
+		: ctx->frame + var->as.var_mut->as.bin_expr.lhs->slot - 1;
+	eval(ctx, var);
+	if (ctx->err_ctx.got_err) return VNONE;
+
+	Val bk, sk;
+	bool bound_k = eval_lit_const(bound, &bk);
+	bool step_k = eval_lit_const(step, &sk);
+
+	for (;;) {
+		Val iv = ctx->stack.items[slot].as.var.val;
+		Val bv = bound_k ? bk : eval(ctx, bound);
+		if (ctx->err_ctx.got_err) return VNONE;
+
+		bool go;
+		if (VKIND(iv) == VAL_INT && VKIND(bv) == VAL_INT) {
+			long long i = VINT(iv), b = VINT(bv);
+			go = cmp == AST_OP_LESS  ? i <  b :
+				cmp == AST_OP_LESS_EQ ? i <= b :
+				cmp == AST_OP_GREAT   ? i >  b : i >= b;
+		} else if (IS_NUM(iv) && IS_NUM(bv)) {
+			double i = vget(iv), b = vget(bv);
+			go = cmp == AST_OP_LESS  ? i <  b :
+				cmp == AST_OP_LESS_EQ ? i <= b :
+				cmp == AST_OP_GREAT   ? i >  b : i >= b;
+		} else {
+			Val c = eval_binop_vals(ctx, cond, iv, bv);
+			if (ctx->err_ctx.got_err) return VNONE;
+			if (VKIND(c) != VAL_BOOL) {
+				eval_error(ctx, n->loc, "boolean expected");
+				return VNONE;
+			}
+
+			go = VBOOL(c);
+		}
+
+		if (!go) break;
+
+		Val res = eval(ctx, n->as.st_for.body);
+		if (ctx->err_ctx.got_err) return VNONE;
+		if (ctx->state == EVAL_CTX_BREAK) {
+			ctx->state = EVAL_CTX_NONE; break;
+		} else if (ctx->state == EVAL_CTX_CONT) {
+			ctx->state = EVAL_CTX_NONE;
+		} else if (ctx->state == EVAL_CTX_RET) {
+			return res;
+		}
+
+		Val sv = step_k ? sk : eval(ctx, step);
+		if (ctx->err_ctx.got_err) return VNONE;
+
+		Val *ip = &ctx->stack.items[slot].as.var.val;
+		if (VKIND(*ip) == VAL_INT && VKIND(sv) == VAL_INT) {
+			long long i = VINT(*ip), s = VINT(sv);
+			*ip = val_int(ctx, add ? INT_WRAP(i, +, s) : INT_WRAP(i, -, s));
+		} else if (VKIND(*ip) == VAL_FLOAT && IS_NUM(sv)) {
+			*ip = val_float(add ? VFLOAT(*ip) + vget(sv) : VFLOAT(*ip) - vget(sv));
+		} else {
+			eval_val_mut(ctx, mut->loc, mut->as.bin_expr.op, ip, sv);
+			if (ctx->err_ctx.got_err) return VNONE;
+		}
+	}
+
+	ctx->stack.count = base;
+	return VNONE;
+}
+
+// Functions defined at the top level of the program go to the globals.
+Val eval_body(EvalCtx *ctx, AST *n, bool top) {
+	size_t stack_size = ctx->stack.count;
+	size_t temps_size = ctx->temps.count;
+	da_foreach (AST*, st, &n->as.body) {
+		if (st == NULL) continue;
+		if (top && (*st)->kind == AST_FUNC_DEF) {
+			eval_def_global(ctx, (*st)->as.func_def.id, *st, NULL);
+			continue;
+		}
+
+		Val res = eval(ctx, *st);
+		if (ctx->err_ctx.got_err) return VNONE;
+		if (ctx->state == EVAL_CTX_RET ||
+			ctx->state == EVAL_CTX_CONT ||
+			ctx->state == EVAL_CTX_BREAK) {
+			ctx->stack.count = stack_size;
+			ctx->temps.count = temps_size;
+			if (ctx->state == EVAL_CTX_RET && VIS_GC(res))
+				da_append(&ctx->temps, res);
+			return res;
+		}
+	}
+
+	ctx->stack.count = stack_size;
+	ctx->temps.count = temps_size;
+	return VNONE;
 }
 
 Val eval(EvalCtx *ctx, AST *n) {
@@ -348,30 +847,11 @@ Val eval(EvalCtx *ctx, AST *n) {
 
 	switch (n->kind) {
 		case AST_PROG:
-			return eval(ctx, n->as.prog.body);
-
-		case AST_BODY: {
-			size_t stack_size = ctx->stack.count;
-			da_foreach (AST*, st, &n->as.body) {
-				if (st == NULL) continue;
-				Val res = eval(ctx, *st);
-				if (ctx->err_ctx.got_err) return VNONE;
-				if (ctx->state == EVAL_CTX_RET ||
-					ctx->state == EVAL_CTX_CONT ||
-					ctx->state == EVAL_CTX_BREAK) {
-					ctx->stack.count = stack_size;
-					if (ctx->state == EVAL_CTX_RET) {
-						eval_stack_add(ctx, (EvalSymbol){
-							.kind = EVAL_SYMB_TEMP,
-							.as.temp.val = res,
-						});
-					}
-					return res;
-				}
-			}
+			ctx->frame = ctx->stack.count;
+			return eval_body(ctx, n->as.prog.body, true);
 
-			ctx->stack.count = stack_size;
-		} break;
+		case AST_BODY:
+			return eval_body(ctx, n, false);
 
 		case AST_VAR_DEF: {
 			eval_stack_add(ctx, (EvalSymbol){
@@ -390,26 +870,22 @@ Val eval(EvalCtx *ctx, AST *n) {
 		case AST_LIT: {
 			switch (n->as.lit.kind) {
 				case LITERAL_INT:
-					return (Val){
-						.kind = VAL_INT,
-						.as.vint = n->as.lit.as.vint,
-					};
+					return val_int(ctx, n->as.lit.as.vint);
 
 				case LITERAL_FLOAT:
-					return (Val){
-						.kind = VAL_FLOAT,
-						.as.vfloat = n->as.lit.as.vfloat,
-					};
+					return val_float(n->as.lit.as.vfloat);
 
 				case LITERAL_BOOL:
-					return (Val){
-						.kind = VAL_BOOL,
-						.as.vbool = n->as.lit.as.vbool,
-					};
+					return val_bool(n->as.lit.as.vbool);
 
 				case LITERAL_STR: {
+					StrSlice lit = n->as.lit.as.vstr;
 					Val str = eval_new_heap_val(ctx, VAL_STR);
-					sb_appendf(VSTR(str), "%s", n->as.lit.as.vstr);
+					StringBuilder *sb = VSTR(str);
+					da_reserve(sb, lit.count + 1);
+					memcpy(sb->items, lit.items, lit.count);
+					sb->items[lit.count] = '\0';
+					sb->count = lit.count;
 					return str;
 				} break;
 
@@ -442,7 +918,7 @@ Val eval(EvalCtx *ctx, AST *n) {
 		} break;
 
 		case AST_VAR: {
-			EvalSymbol *es = eval_stack_get(ctx, n->as.var);
+			EvalSymbol *es = eval_symbol(ctx, n, n->as.var);
 			if (!es) {
 				eval_error(ctx, n->loc, "no such symbol");
 				return VNONE;
@@ -472,28 +948,9 @@ Val eval(EvalCtx *ctx, AST *n) {
 						Val container = eval(ctx, lhs->as.bin_expr.lhs);
 						Val key = eval(ctx, lhs->as.bin_expr.rhs);
 						if (ctx->err_ctx.got_err) return VNONE;
-
-						if (container.kind == VAL_LIST) {
-							if (key.as.vint < 0 || key.as.vint > VLIST(container)->count) {
-								char err[512];
-								sprintf(err,
-									"index %lli is not in the range 0..%zu",
-									key.as.vint, VLIST(container)->count);
-								eval_error(ctx, n->as.bin_expr.lhs->loc, err);
-								return VNONE;
-							}
-
-							Val *list_val = &da_get(VLIST(container), key.as.vint);
-							eval_val_mut(ctx, n->loc, n->as.bin_expr.op, list_val, rhs_val);
-							if (ctx->err_ctx.got_err) return VNONE;
-						} else if (container.kind == VAL_DICT) {
-							Val *dict_val = ValDict_get(VDICT(container), key);
-							if (!dict_val) ValDict_add(VDICT(container), key, rhs_val);
-							else eval_val_mut(ctx, n->loc, n->as.bin_expr.op, dict_val, rhs_val);
-						}
+						eval_index_mut(ctx, n, container, key, rhs_val);
 					} else if (lhs->kind == AST_VAR) {
-						char *var_id = n->as.bin_expr.lhs->as.var;
-						EvalSymbol *es = eval_stack_get(ctx, var_id);
+						EvalSymbol *es = eval_symbol(ctx, lhs, lhs->as.var);
 						if (!es) {
 							eval_error(ctx, n->loc, "no such symbol");
 							return VNONE;
@@ -514,13 +971,9 @@ Val eval(EvalCtx *ctx, AST *n) {
 			}
 		} break;
 
-		case AST_FUNC_DEF: {
-			eval_stack_add(ctx, (EvalSymbol){
-				.kind = EVAL_SYMB_FUNC,
-				.id = n->as.func_def.id,
-				.as.func.node = n,
-			});
-		} break;
+		case AST_FUNC_DEF:
+			eval_def_func(ctx, n->as.func_def.id, n, NULL);
+			break;
 
 		case AST_ST_ELSE:
 			return eval(ctx, n->as.st_else.body);
@@ -528,18 +981,21 @@ Val eval(EvalCtx *ctx, AST *n) {
 		case AST_ST_IF: {
 			Val cond = eval(ctx, n->as.st_if_chain.cond);
 			if (ctx->err_ctx.got_err) return VNONE;
-			if (cond.kind != VAL_BOOL) {
+			if (VKIND(cond) != VAL_BOOL) {
 				eval_error(ctx, n->loc, "boolean expected");
 				return VNONE;
 			}
 
-			if (cond.as.vbool)
+			if (VBOOL(cond))
 				return eval(ctx, n->as.st_if_chain.body);
 			else if (n->as.st_if_chain.chain)
 				return eval(ctx, n->as.st_if_chain.chain);
 		} break;
 
 		case AST_ST_FOR: {
+			if (n->as.st_for.counted)
+				return eval_counted_for(ctx, n);
+
 			size_t stack_count_before = ctx->stack.count;
 			Val var = eval(ctx, n->as.st_for.var);
 			if (ctx->err_ctx.got_err) return VNONE;
@@ -548,12 +1004,12 @@ Val eval(EvalCtx *ctx, AST *n) {
 			for (;;) {
 				Val cond = eval(ctx, n->as.st_for.cond);
 				if (ctx->err_ctx.got_err) return VNONE;
-				if (cond.kind != VAL_BOOL) {
+				if (VKIND(cond) != VAL_BOOL) {
 					eval_error(ctx, n->loc, "boolean expected");
 					return VNONE;
 				}
 				
-				if (!cond.as.vbool) break;
+				if (!VBOOL(cond)) break;
 
 				Val res = eval(ctx, n->as.st_for.body);
 				if (ctx->err_ctx.got_err) return VNONE;
@@ -577,16 +1033,20 @@ Val eval(EvalCtx *ctx, AST *n) {
 			char *var_id = n->as.st_foreach.var_id;
 			Val coll = eval(ctx, n->as.st_foreach.coll);
 			if (ctx->err_ctx.got_err) return VNONE;
+			if (VKIND(coll) != VAL_LIST) {
+				eval_error(ctx, n->as.st_foreach.coll->loc, "list expected");
+				return VNONE;
+			}
 
 			for (size_t i = 0; i < VLIST(coll)->count; i++) {
-				Val x = VLIST(coll)->items[i];
+				Val x = val_list_at(coll, i);
 				eval_stack_add(ctx, (EvalSymbol){
 					.kind = EVAL_SYMB_VAR,
 					.id = var_id,
 					.as.var.val = x,
 				});
 
-				Val res = eval(ctx, n->as.st_for.body);
+				Val res = eval(ctx, n->as.st_foreach.body);
 				if (ctx->err_ctx.got_err) return VNONE;
 				ctx->stack.count--;
 				if (ctx->state == EVAL_CTX_BREAK) {
@@ -600,21 +1060,15 @@ Val eval(EvalCtx *ctx, AST *n) {
 		} break;
 
 		case AST_ST_WHILE: {
-			Val cond = eval(ctx, n->as.st_while.cond);
-			if (ctx->err_ctx.got_err) return VNONE;
-			if (cond.kind != VAL_BOOL) {
-				eval_error(ctx, n->loc, "boolean expected");
-				return VNONE;
-			}
-
 			while (true) {
 				Val cond = eval(ctx, n->as.st_while.cond);
-				if (cond.kind != VAL_BOOL) {
+				if (ctx->err_ctx.got_err) return VNONE;
+				if (VKIND(cond) != VAL_BOOL) {
 					eval_error(ctx, n->loc, "boolean expected");
 					return VNONE;
 				}
 
-				if (!cond.as.vbool) break;
+				if (!VBOOL(cond)) break;
 
 				Val res = eval(ctx, n->as.st_while.body);
 				if (ctx->err_ctx.got_err) return VNONE;
@@ -630,92 +1084,72 @@ Val eval(EvalCtx *ctx, AST *n) {
 
 		case AST_FUNC_CALL: {
 			Val res;
-			EvalSymbol *func = eval_stack_get(ctx, n->as.func_call.id);
+			EvalSymbol *func = eval_callee(ctx, n);
 			if (!func) {
 				eval_error(ctx, n->loc, "no such symbol");
 				return VNONE;
 			}
 
 			if (func->kind == EVAL_SYMB_FUNC) {
+				// func points into the stack, which the arguments may move.
 				AST *func_def = func->as.func.node;
-				bool found_any = false;
-				Val va_args = {0};
-				size_t args_cnt = 0;
-
-				for (size_t i = 0; i < n->as.func_call.args.count; i++) {
-					AST *func_call_arg = da_get(&n->as.func_call.args, i);
-
-				found_any:
-					if (found_any) {
-						if (va_args.kind == VAL_NONE)
-							va_args = eval_new_heap_val(ctx, VAL_LIST);
-						Val va_arg = eval(ctx, func_call_arg);
-						da_append(VLIST(va_args), va_arg);
-						if (ctx->err_ctx.got_err) return VNONE;
-						continue;
-					}
-
-					if (i >= func_def->as.func_def.args.count) {
-						eval_error(ctx, n->loc, "invalid amount of arguments");
-						return VNONE;
-					}
+				ASTs *args = &n->as.func_call.args;
+				long fixed = eval_call_arity(ctx, n, func_def, args->count);
+				if (fixed < 0) return VNONE;
 
-					AST *func_def_arg = da_get(&func_def->as.func_def.args, i);
-					if (func_def_arg->kind == AST_VAR_ANY) {
-						found_any = true;
-						goto found_any;
-					}
-
-					args_cnt++;
-					eval_stack_add(ctx, (EvalSymbol){
-						.kind = EVAL_SYMB_VAR,
-						.id = func_def_arg->as.var,
-						.as.var.val = eval(ctx, func_call_arg),
-					});
-
-					if (ctx->err_ctx.got_err)
-						return VNONE;
-				}
-
-				if (found_any) {
+				size_t base = ctx->stack.count;
+				da_foreach (AST*, it, args) {
+					Val arg = eval(ctx, *it);
+					if (ctx->err_ctx.got_err) return VNONE;
 					eval_stack_add(ctx, (EvalSymbol){
 						.kind = EVAL_SYMB_VAR,
-						.id = "_VA_ARGS_",
-						.as.var.val = va_args,
+						.as.var.val = arg,
 					});
 				}
 
-				if (!found_any && args_cnt < func_def->as.func_def.args.count) {
-					eval_error(ctx, n->loc, "invalid amount of arguments");
-					return VNONE;
-				}
-
+				eval_bind_params(ctx, func_def, base, fixed);
+				size_t frame = ctx->frame;
+				ctx->frame = base;
 				ctx->state = EVAL_CTX_NONE;
-				res = eval(ctx, func->as.func.node->as.func_def.body);
+				res = eval(ctx, func_def->as.func_def.body);
 				if (ctx->err_ctx.got_err) return VNONE;
 
+				while (ctx->tail.def) {
+					func_def = eval_tail_enter(ctx, base);
+					res = eval(ctx, func_def->as.func_def.body);
+					if (ctx->err_ctx.got_err) return VNONE;
+				}
+
 				ctx->state = EVAL_CTX_NONE;
-				if (found_any) ctx->stack.count--;
-				ctx->stack.count -= args_cnt;
+				ctx->stack.count = base;
+				ctx->frame = frame;
 			} else if (func->kind == EVAL_SYMB_REG_FUNC) {
+				RegFunc reg_func = func->as.reg_func;
 				Vals args = {0};
 				da_foreach (AST*, it, &n->as.func_call.args) {
 					Val res = eval(ctx, *it);
 					da_append(&args, res);
-					if (ctx->err_ctx.got_err) return VNONE;
+					if (ctx->err_ctx.got_err) {
+						da_free(&args);
+						return VNONE;
+					}
 				}
 
 				ErrorCtx ec = {.errf = ctx->err_ctx.errf};
-				res = func->as.reg_func(ctx, n->loc, args);
+				res = reg_func(ctx, eval_call_loc(ctx, n), args);
 				if (ec.got_err) ctx->err_ctx.got_err = true;
+				da_free(&args);
 			} else eval_error(ctx, n->loc, "no such function");
 
 			return res;
 		} break;
 
 		case AST_RET: {
-			if (n->as.ret.expr) {
-				Val v = eval(ctx, n->as.ret.expr);
+			AST *expr = n->as.ret.expr;
+			if (expr && expr->kind == AST_FUNC_CALL && expr->as.func_call.tail) {
+				return eval_tail_call(ctx, expr);
+			} else if (expr) {
+				Val v = eval(ctx, expr);
 				ctx->state = EVAL_CTX_RET;
 				return v;
 			} else ctx->state = EVAL_CTX_RET;
@@ -785,6 +1219,21 @@ GC_Object *eval_gc_alloc(EvalCtx *ctx, int val_kind) {
 	return gco;
 }
 
+#ifdef EPSL_NANBOX
+// Boxing never collects, values may be being written through a pointer
+// into a list or a dict that a collection would move.
+Val eval_box_int(EvalCtx *ctx, long long x) {
+	GC_Object *gco = malloc(sizeof(*gco));
+	*gco = (GC_Object){.val_kind = VAL_INT, .data = malloc(sizeof(x))};
+	*(long long*)gco->data = x;
+	da_append(&ctx->gc.objs, gco);
+
+	Val v = {(VAL_TAG_BOXED_INT << 48) | (u64)(uintptr_t)gco};
+	da_append(&ctx->temps, v);
+	return v;
+}
+#endif
+
 void gc_obj_mark(GC_Object *obj) {
 	if (obj->marked) return;
 	obj->marked = true;
@@ -793,18 +1242,19 @@ void gc_obj_mark(GC_Object *obj) {
 		case VAL_DICT: {
 			ValDict *dict = obj->data;
 			ht_foreach_node (ValDict, dict, it) {
-				if (is_heap_val(it->key))
-					gc_obj_mark(it->key.as.gc_obj);
-				if (is_heap_val(it->val))
-					gc_obj_mark(it->val.as.gc_obj);
+				if (VIS_GC(it->key))
+					gc_obj_mark(VOBJ(it->key));
+				if (VIS_GC(it->val))
+					gc_obj_mark(VOBJ(it->val));
 			}
 		} break;
 
 		case VAL_LIST: {
+			if (obj->lazy) break;
 			Vals *list = obj->data;
 			da_foreach (Val, it, list) {
-				if (is_heap_val(*it))
-					gc_obj_mark(it->as.gc_obj);
+				if (VIS_GC(*it))
+					gc_obj_mark(VOBJ(*it));
 			}
 		} break;
 
@@ -820,14 +1270,39 @@ void eval_collect_garbage(EvalCtx *ctx) {
 
 	da_foreach (EvalSymbol, es, &ctx->stack) {
 		if (es->kind == EVAL_SYMB_VAR) {
-			if (is_heap_val(es->as.var.val)) {
-				gc_obj_mark(es->as.var.val.as.gc_obj);
+			if (VIS_GC(es->as.var.val)) {
+				gc_obj_mark(VOBJ(es->as.var.val));
 			}
-		} else if (es->kind == EVAL_SYMB_TEMP) {
-			gc_obj_mark(es->as.temp.val.as.gc_obj);
 		}
 	}
 
+	for (size_t i = 0; i < ctx->globals.capacity; i++) {
+		EvalSymbol *es = &ctx->globals.slots[i];
+		if (es->id && es->kind == EVAL_SYMB_VAR && VIS_GC(es->as.var.val))
+			gc_obj_mark(VOBJ(es->as.var.val));
+	}
+
+	// Registered values a top level function replaced come back.
+	da_foreach (EvalGlobalDef, d, &ctx->global_defs) {
+		if (d->prev.id && d->prev.kind == EVAL_SYMB_VAR && VIS_GC(d->prev.as.var.val))
+			gc_obj_mark(VOBJ(d->prev.as.var.val));
+	}
+
+	da_foreach (Val, v, &ctx->temps) {
+		if (VIS_GC(*v))
+			gc_obj_mark(VOBJ(*v));
+	}
+
+	da_foreach (Val, v, &ctx->regs) {
+		if (VIS_GC(*v))
+			gc_obj_mark(VOBJ(*v));
+	}
+
+	da_foreach (Val, v, &ctx->tail.args) {
+		if (VIS_GC(*v))
+			gc_obj_mark(VOBJ(*v));
+	}
+
 	// sweep phase
 	for (size_t i = 0; i < ctx->gc.objs.count; i++) {
 		GC_Object *obj = da_get(&ctx->gc.objs, i);
@@ -844,6 +1319,7 @@ void eval_collect_garbage(EvalCtx *ctx) {
 				} break;
 
 				case VAL_LIST: {
+					if (obj->lazy) break;
 					Vals *list = obj->data;
 					Vals new = {0};
 					da_set_arena(&new, &ctx->gc.to);
@@ -859,6 +1335,7 @@ void eval_collect_garbage(EvalCtx *ctx) {
 					*str = new;
 				} break;
 
+				case VAL_INT: break;
 				default: assert(0);
 			}
 		}
@@ -880,18 +1357,72 @@ void eval_collect_garbage(EvalCtx *ctx) {
 	ctx->gc.to = temp;
 }
 
+void eval_free(EvalCtx *ctx) {
+	da_foreach (GC_Object*, obj, &ctx->gc.objs) {
+		free((*obj)->data);
+		free(*obj);
+	}
+
+	da_free(&ctx->gc.objs);
+	arena_free(&ctx->gc.from);
+	arena_free(&ctx->gc.to);
+	da_free(&ctx->stack);
+	da_free(&ctx->temps);
+	da_free(&ctx->regs);
+	da_free(&ctx->tail.args);
+	da_free(&ctx->calls);
+	da_free(&ctx->global_defs);
+	free(ctx->globals.slots);
+}
+
+// Re-interns registered names into another table, used when the context
+// switches to a shared import cache.
+void eval_rebind_interns(EvalCtx *ctx, Interns *interns) {
+	for (size_t i = 0; i < ctx->globals.capacity; i++) {
+		EvalSymbol *s = &ctx->globals.slots[i];
+		if (s->id) s->id = intern_cstr(interns, s->id);
+	}
+
+	ctx->interns = interns;
+	ctx->bound = NULL;
+	eval_globals_rehash(ctx, ctx->globals.capacity);
+}
+
+// Binds registered names to the ids of a program parsed with another
+// table. Names the program never mentions keep an id from the context's
+// own table, so the program's table is only read.
+void eval_bind_interns(EvalCtx *ctx, Interns *prog) {
+	for (size_t i = 0; i < ctx->globals.capacity; i++) {
+		EvalSymbol *s = &ctx->globals.slots[i];
+		if (!s->id) continue;
+		char *id = intern_find(prog, s->id);
+		s->id = id ? id : intern_cstr(ctx->interns, s->id);
+	}
+
+	ctx->bound = prog;
+	eval_globals_rehash(ctx, ctx->globals.capacity);
+}
+
+// A registered name takes the id its bound program knows it by.
+char *eval_global_id(EvalCtx *ctx, const char *id) {
+	char *bound = ctx->bound ? intern_find(ctx->bound, id) : NULL;
+	return bound ? bound : intern_cstr(ctx->interns, id);
+}
+
+// Registering a name again replaces it, so a reused context can be given
+// new inputs between runs.
 void eval_reg_var(EvalCtx *ctx, const char *id, Val val) {
-	da_insert(&ctx->stack, 0, ((EvalSymbol){
+	eval_global_set(ctx, (EvalSymbol){
 		.kind = EVAL_SYMB_VAR,
-		.id = (char*) id,
+		.id = eval_global_id(ctx, id),
 		.as.var.val = val,
-	}));
+	});
 }
 
 void eval_reg_func(EvalCtx *ctx, const char *id, RegFunc rf) {
-	da_insert(&ctx->stack, 0, ((EvalSymbol){
+	eval_global_set(ctx, (EvalSymbol){
 		.kind = EVAL_SYMB_REG_FUNC,
-		.id = (char*) id,
+		.id = eval_global_id(ctx, id),
 		.as.reg_func = rf,
-	}));
+	});
 }
@@ -0,0 +1,311 @@
+#include "../include/fold.h"
+#include "../include/eval.h"
+
+void fold_error(Location loc, ErrorKind ek, char *msg) {
+	(void)loc; (void)ek; (void)msg;
+}
+
+bool fold_is_const(AST *n) {
+	return n->kind == AST_VAL_NONE ||
+		(n->kind == AST_LIT && n->as.lit.kind != LITERAL_STR);
+}
+
+bool fold_is_num(AST *n, double num) {
+	if (n->kind != AST_LIT) return false;
+	if (n->as.lit.kind == LITERAL_INT)   return n->as.lit.as.vint == num;
+	if (n->as.lit.kind == LITERAL_FLOAT) return n->as.lit.as.vfloat == num;
+	return false;
+}
+
+bool fold_is_int(AST *n, long long num) {
+	return n->kind == AST_LIT &&
+		n->as.lit.kind == LITERAL_INT &&
+		n->as.lit.as.vint == num;
+}
+
+bool fold_is_bool(AST *n, bool b) {
+	return n->kind == AST_LIT &&
+		n->as.lit.kind == LITERAL_BOOL &&
+		n->as.lit.as.vbool == b;
+}
+
+// The kind of every value n evaluates to, -1 if it is not known.
+int fold_kind(AST *n) {
+	switch (n->kind) {
+		case AST_VAL_NONE: return VAL_NONE;
+
+		case AST_LIT:
+			switch (n->as.lit.kind) {
+				case LITERAL_INT:   return VAL_INT;
+				case LITERAL_FLOAT: return VAL_FLOAT;
+				case LITERAL_BOOL:  return VAL_BOOL;
+				default:            return -1;
+			}
+
+		case AST_UN_EXPR: {
+			int k = fold_kind(n->as.un_expr.v);
+			return k == VAL_INT || k == VAL_FLOAT || k == VAL_BOOL ? k : -1;
+		}
+
+		case AST_BIN_EXPR: {
+			switch (n->as.bin_expr.op) {
+				case AST_OP_IS_EQ:
+				case AST_OP_NOT_EQ:
+				case AST_OP_GREAT:
+				case AST_OP_GREAT_EQ:
+				case AST_OP_LESS:
+				case AST_OP_LESS_EQ:
+				case AST_OP_AND:
+				case AST_OP_OR:
+					return VAL_BOOL;
+
+				case AST_OP_MOD:
+					return VAL_INT;
+
+				case AST_OP_ADD:
+				case AST_OP_SUB:
+				case AST_OP_MUL:
+				case AST_OP_DIV: {
+					int lk = fold_kind(n->as.bin_expr.lhs);
+					int rk = fold_kind(n->as.bin_expr.rhs);
+					if (lk != VAL_INT && lk != VAL_FLOAT && lk != VAL_BOOL) return -1;
+					if (rk != VAL_INT && rk != VAL_FLOAT && rk != VAL_BOOL) return -1;
+					if (n->as.bin_expr.op == AST_OP_DIV && lk == VAL_INT && rk == VAL_INT)
+						return VAL_FLOAT;
+					if (lk == VAL_FLOAT || rk == VAL_FLOAT) return VAL_FLOAT;
+					if (lk == VAL_INT || rk == VAL_INT) return VAL_INT;
+					return VAL_BOOL;
+				}
+
+				default: return -1;
+			}
+		}
+
+		default: return -1;
+	}
+}
+
+void fold_to_lit(AST *n, Val v) {
+	AST lit = {.kind = AST_LIT, .loc = n->loc};
+	switch (VKIND(v)) {
+		case VAL_NONE:
+			lit.kind = AST_VAL_NONE;
+			break;
+
+		case VAL_INT:
+			lit.as.lit.kind = LITERAL_INT;
+			lit.as.lit.as.vint = VINT(v);
+			break;
+
+		case VAL_FLOAT:
+			lit.as.lit.kind = LITERAL_FLOAT;
+			lit.as.lit.as.vfloat = VFLOAT(v);
+			break;
+
+		case VAL_BOOL:
+			lit.as.lit.kind = LITERAL_BOOL;
+			lit.as.lit.as.vbool = VBOOL(v);
+			break;
+
+		default: return;
+	}
+
+	*n = lit;
+}
+
+void fold_eval(EvalCtx *ctx, AST *n) {
+	ctx->err_ctx.got_err = false;
+	Val v = eval(ctx, n);
+	if (!ctx->err_ctx.got_err) fold_to_lit(n, v);
+}
+
+// x op c or c op x that gives back x for every x of the kind it has.
+AST *fold_identity(AST *n) {
+	AST_Op op = n->as.bin_expr.op;
+	AST *l = n->as.bin_expr.lhs, *r = n->as.bin_expr.rhs;
+
+	for (int side = 0; side < 2; side++) {
+		AST *x = side ? r : l, *c = side ? l : r;
+		if (!fold_is_const(c)) continue;
+
+		switch (fold_kind(x)) {
+			case VAL_BOOL:
+				if ((op == AST_OP_AND || op == AST_OP_IS_EQ) && fold_is_bool(c, true))
+					return x;
+				if ((op == AST_OP_OR || op == AST_OP_NOT_EQ) && fold_is_bool(c, false))
+					return x;
+				break;
+
+			// Int arithmetic is exact, a float constant makes a float.
+			case VAL_INT:
+				if (op == AST_OP_MUL && fold_is_int(c, 1))
+					return x;
+				if (op == AST_OP_ADD && fold_is_int(c, 0))
+					return x;
+				if (!side && op == AST_OP_SUB && fold_is_int(c, 0))
+					return x;
+				break;
+
+			case VAL_FLOAT:
+				if (op == AST_OP_MUL && fold_is_num(c, 1))
+					return x;
+				if (!side && op == AST_OP_DIV && fold_is_num(c, 1))
+					return x;
+				if (!side && op == AST_OP_SUB && fold_is_num(c, 0))
+					return x;
+				break;
+		}
+	}
+
+	return NULL;
+}
+
+void fold_node(EvalCtx *ctx, AST *n);
+
+void fold_list(EvalCtx *ctx, ASTs *list) {
+	da_foreach (AST*, it, list)
+		fold_node(ctx, *it);
+}
+
+void fold_node(EvalCtx *ctx, AST *n) {
+	if (!n) return;
+
+	switch (n->kind) {
+		case AST_PROG:
+			fold_node(ctx, n->as.prog.body);
+			break;
+
+		case AST_BODY:
+			fold_list(ctx, &n->as.body);
+			break;
+
+		case AST_VAR_DEF:
+			fold_node(ctx, n->as.var_def.expr);
+			break;
+
+		case AST_VAR_MUT:
+			fold_node(ctx, n->as.var_mut);
+			break;
+
+		case AST_RET:
+			fold_node(ctx, n->as.ret.expr);
+			break;
+
+		case AST_LIST:
+			fold_list(ctx, &n->as.list);
+			break;
+
+		case AST_DICT:
+			fold_list(ctx, &n->as.dict);
+			break;
+
+		case AST_FUNC_DEF:
+			fold_node(ctx, n->as.func_def.body);
+			break;
+
+		case AST_FUNC_CALL:
+			fold_list(ctx, &n->as.func_call.args);
+			break;
+
+		case AST_UN_EXPR: {
+			AST *v = n->as.un_expr.v;
+			fold_node(ctx, v);
+			if (fold_is_const(v)) {
+				fold_eval(ctx, n);
+			} else if (v->kind == AST_UN_EXPR && v->as.un_expr.op == n->as.un_expr.op) {
+				AST *x = v->as.un_expr.v;
+				int k = fold_kind(x);
+				if ((n->as.un_expr.op == AST_OP_NOT && k == VAL_BOOL) ||
+					(n->as.un_expr.op == AST_OP_NEG && k == VAL_FLOAT))
+					*n = *x;
+			}
+		} break;
+
+		case AST_BIN_EXPR: {
+			AST *l = n->as.bin_expr.lhs, *r = n->as.bin_expr.rhs;
+			fold_node(ctx, l);
+			fold_node(ctx, r);
+
+			switch (n->as.bin_expr.op) {
+				case AST_OP_EQ:
+				case AST_OP_ADD_EQ:
+				case AST_OP_SUB_EQ:
+				case AST_OP_MUL_EQ:
+				case AST_OP_DIV_EQ:
+				case AST_OP_ARR:
+				case AST_OP_PAIR:
+					return;
+
+				case AST_OP_MOD:
+					// Would trap instead of failing.
+					if (fold_is_num(r, 0) || fold_is_num(r, -1)) return;
+					break;
+
+				default:;
+			}
+
+			if (fold_is_const(l) && fold_is_const(r)) {
+				fold_eval(ctx, n);
+			} else {
+				AST *x = fold_identity(n);
+				if (x) *n = *x;
+			}
+		} break;
+
+		case AST_ST_IF: {
+			AST *cond = n->as.st_if_chain.cond;
+			fold_node(ctx, cond);
+			fold_node(ctx, n->as.st_if_chain.body);
+			fold_node(ctx, n->as.st_if_chain.chain);
+
+			if (fold_is_bool(cond, true)) {
+				*n = *n->as.st_if_chain.body;
+			} else if (fold_is_bool(cond, false)) {
+				AST *chain = n->as.st_if_chain.chain;
+				if (!chain)
+					*n = (AST){.kind = AST_BODY, .loc = n->loc};
+				else if (chain->kind == AST_ST_ELSE)
+					*n = *chain->as.st_else.body;
+				else
+					*n = *chain;
+			}
+		} break;
+
+		case AST_ST_ELSE:
+			fold_node(ctx, n->as.st_else.body);
+			break;
+
+		case AST_ST_WHILE:
+			fold_node(ctx, n->as.st_while.cond);
+			fold_node(ctx, n->as.st_while.body);
+			if (fold_is_bool(n->as.st_while.cond, false))
+				*n = (AST){.kind = AST_BODY, .loc = n->loc};
+			break;
+
+		case AST_ST_FOR:
+			fold_node(ctx, n->as.st_for.var);
+			fold_node(ctx, n->as.st_for.cond);
+			fold_node(ctx, n->as.st_for.mut);
+			fold_node(ctx, n->as.st_for.body);
+			break;
+
+		case AST_ST_FOREACH:
+			fold_node(ctx, n->as.st_foreach.coll);
+			fold_node(ctx, n->as.st_foreach.body);
+			break;
+
+		default:;
+	}
+}
+
+void fold(Sources *srcs, AST *prog) {
+	EvalCtx ctx = {
+		.srcs = srcs,
+		.err_ctx.errf = fold_error,
+	};
+
+	// Folded ints are copied into the tree, nothing it keeps points into
+	// the heap of ctx, where big ints are boxed.
+	fold_node(&ctx, prog);
+	eval_free(&ctx);
+}
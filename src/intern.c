@@ -0,0 +1,77 @@
+#include <string.h>
+#include "../include/intern.h"
+
+#define INTERNS_INIT_CAP 256
+
+static u64 intern_hash(const char *str, size_t len) {
+	u64 h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (u8)str[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static void interns_grow(Interns *in) {
+	size_t new_cap = in->capacity ? in->capacity * 2 : INTERNS_INIT_CAP;
+	char **slots = calloc(new_cap, sizeof(char*));
+
+	for (size_t i = 0; i < in->capacity; i++) {
+		char *s = in->slots[i];
+		if (!s) continue;
+
+		size_t j = intern_hash(s, strlen(s)) & (new_cap - 1);
+		while (slots[j]) j = (j + 1) & (new_cap - 1);
+		slots[j] = s;
+	}
+
+	free(in->slots);
+	in->slots = slots;
+	in->capacity = new_cap;
+}
+
+char *intern(Interns *in, const char *str, size_t len) {
+	if ((in->count + 1) * 2 > in->capacity)
+		interns_grow(in);
+
+	size_t i = intern_hash(str, len) & (in->capacity - 1);
+	while (in->slots[i]) {
+		char *s = in->slots[i];
+		if (strncmp(s, str, len) == 0 && s[len] == '\0')
+			return s;
+		i = (i + 1) & (in->capacity - 1);
+	}
+
+	char *s = arena_alloc(&in->arena, len + 1);
+	memcpy(s, str, len);
+	s[len] = '\0';
+
+	in->slots[i] = s;
+	in->count++;
+	return s;
+}
+
+// Returns the interned copy of str, or NULL if the table has none.
+char *intern_find(Interns *in, const char *str) {
+	if (!in->capacity) return NULL;
+
+	size_t len = strlen(str);
+	size_t i = intern_hash(str, len) & (in->capacity - 1);
+	while (in->slots[i]) {
+		char *s = in->slots[i];
+		if (strcmp(s, str) == 0) return s;
+		i = (i + 1) & (in->capacity - 1);
+	}
+
+	return NULL;
+}
+
+char *intern_cstr(Interns *in, const char *str) {
+	return intern(in, str, strlen(str));
+}
+
+void interns_free(Interns *in) {
+	free(in->slots);
+	arena_free(&in->arena);
+	*in = (Interns){0};
+}
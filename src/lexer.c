@@ -1,122 +1,333 @@
+#define _DEFAULT_SOURCE
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <stdint.h>
 #include "../include/lexer.h"
 #include "../3dparty/cplus.h"
 
-char *read_file(const char *filename) {
-	FILE *file = fopen(filename, "rb");
-	if (!file) return NULL;
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define HAS_MMAP
+#endif
+
+#ifdef HAS_MMAP
+// Maps the file read-only on top of a zeroed anonymous reservation that
+// is at least one byte longer than the file, so the code is always
+// NUL-terminated without being copied.
+bool source_load(Source *src, char *file) {
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return false;
+	}
 
-	fseek(file, 0, SEEK_END);
-	long filesize = ftell(file);
-	rewind(file);
+	size_t size = st.st_size;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t map_size = (size + page) & ~(page - 1);
 
-	char *buffer = malloc(filesize + 1);
-	size_t read_size = fread(buffer, 1, filesize, file);
-	if (read_size != filesize) {
-		free(buffer);
-		fclose(file);
-		return NULL;
+	char *code = mmap(NULL, map_size, PROT_READ,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		close(fd);
+		return false;
 	}
 
-	buffer[filesize] = '\0';
-	fclose(file);
+	if (size > 0 && mmap(code, size, PROT_READ,
+		MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(code, map_size);
+		close(fd);
+		return false;
+	}
 
-	return buffer;
-}
+	close(fd);
+	*src = (Source){
+		.file = file,
+		.code = code,
+		.size = size,
+		.map_size = map_size,
+	};
 
-char *get_word(Lexer *lexer) {
-	while (*lexer->cur_char == ' ')
-		lexer->cur_char++;
-
-	char *start = lexer->cur_char;
-	while (isalpha(*lexer->cur_char) ||
-		isdigit(*lexer->cur_char) ||
-		*lexer->cur_char == '_')
-		lexer->cur_char++;
-	lexer->cur_char--;
-
-	size_t l = lexer->cur_char - start + 1;
-	char *word = malloc(sizeof(char) * (l+1));
-	memcpy(word, start, l);
-	word[l] = '\0';
-	return word;
+	return true;
 }
+#else
+bool source_load(Source *src, char *file) {
+	FILE *f = fopen(file, "rb");
+	if (!f) return false;
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+
+	char *code = malloc(size + 1);
+	if (fread(code, 1, size, f) != size) {
+		free(code);
+		fclose(f);
+		return false;
+	}
 
-Token token(Lexer *lexer, TokenKind kind, char *data) {
-	return (Token) {
-		.kind = kind,
-		.data = data,
-		.loc = lexer->cur_loc,
+	code[size] = '\0';
+	fclose(f);
+
+	*src = (Source){
+		.file = file,
+		.code = code,
+		.size = size,
 	};
+
+	return true;
+}
+#endif
+
+void source_free(Source *src) {
+	da_free(&src->lines);
+	if (src->borrowed) return;
+#ifdef HAS_MMAP
+	if (src->map_size) {
+		munmap(src->code, src->map_size);
+		return;
+	}
+#endif
+	free(src->code);
 }
 
-bool is_tok(Lexer *lexer, const char *tok) {
-	char *str = lexer->cur_char;
+void sources_free(Sources *srcs) {
+	da_foreach (Source, src, srcs)
+		source_free(src);
+	da_free(srcs);
+}
 
-	for (size_t i = 0; i < strlen(tok); i++) {
-		if (tok[i] != str[i]) return false;
+// FNV-1a over the source text.
+u64 source_hash(Source *src) {
+	u64 h = 14695981039346656037ULL;
+	for (size_t i = 0; i < src->size; i++) {
+		h ^= (unsigned char)src->code[i];
+		h *= 1099511628211ULL;
 	}
 
-	if (isalpha(str[strlen(tok)]) || str[strlen(tok)] == '_')
-		return false;
+	return h;
+}
 
-	return true;
+void source_index_lines(Source *src) {
+	if (src->lines.count) return;
+
+	da_append(&src->lines, 0);
+	for (size_t i = 0; i < src->size; i++) {
+		char c = src->code[i];
+		if (c == '\n' || (c == '\r' && src->code[i + 1] != '\n'))
+			da_append(&src->lines, i + 1);
+	}
 }
 
-Lexer lexer_from_str(char *file, char *code) {
-	return (Lexer) {
-		.cur_loc.file = file,
-		.cur_loc.line_num = 0,
-		.cur_loc.line_start = code,
-		.cur_loc.line_char = code,
-		.cur_char = code,
+Location source_loc(Sources *srcs, SrcLoc loc) {
+	Source *src = &srcs->items[loc.src];
+	source_index_lines(src);
+
+	size_t lo = 0, hi = src->lines.count;
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if (src->lines.items[mid] <= loc.off) lo = mid;
+		else hi = mid;
+	}
+
+	return (Location){
+		.file = src->file,
+		.line_num = lo,
+		.line_start = src->code + src->lines.items[lo],
+		.line_char = src->code + loc.off,
 	};
 }
 
-Lexer lexer_from_file(char *file) {
-	char *code = read_file(file);
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VEC_SIZE 32
+typedef __m256i Vec;
+#define vec_load(p)   _mm256_load_si256((const Vec*)(p))
+#define vec_eq(v, c)  ((u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))))
+#define VEC_ALL 0xFFFFFFFFu
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VEC_SIZE 16
+typedef __m128i Vec;
+#define vec_load(p)   _mm_load_si128((const Vec*)(p))
+#define vec_eq(v, c)  ((u32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c))))
+#define VEC_ALL 0xFFFFu
+#endif
+
+#ifdef VEC_SIZE
+// Scanners load aligned blocks, which never cross a page boundary, so
+// reading past the NUL sentinel is safe even though it is out of bounds.
+#if defined(__SANITIZE_ADDRESS__)
+#define NO_ASAN __attribute__((no_sanitize_address))
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define NO_ASAN __attribute__((no_sanitize_address))
+#endif
+#endif
+
+#ifndef NO_ASAN
+#define NO_ASAN
+#endif
+
+// Most runs are a byte or two long, so the first few bytes are checked
+// with scalar code before switching to vector loads.
+#define SCAN(p, v, mask_expr) \
+	do { \
+		size_t _off = (uintptr_t)(p) & (VEC_SIZE - 1); \
+		char *_b = (p) - _off; \
+		Vec v = vec_load(_b); \
+		u32 _m = ((mask_expr) & VEC_ALL) >> _off; \
+		if (_m) return (p) + __builtin_ctz(_m); \
+		for (_b += VEC_SIZE;; _b += VEC_SIZE) { \
+			v = vec_load(_b); \
+			_m = (mask_expr) & VEC_ALL; \
+			if (_m) return _b + __builtin_ctz(_m); \
+		} \
+	} while (0)
+
+// first character that is not a space or a tab
+NO_ASAN static char *scan_blanks(char *p) {
+	for (int i = 0; i < 4; i++, p++)
+		if (*p != ' ' && *p != '\t') return p;
+	SCAN(p, v, ~(vec_eq(v, ' ') | vec_eq(v, '\t')));
+}
+
+// end of a line comment
+NO_ASAN static char *scan_line_end(char *p) {
+	SCAN(p, v, vec_eq(v, '\n') | vec_eq(v, '\0'));
+}
+
+// next character of a string literal that is not copied verbatim
+NO_ASAN static char *scan_string(char *p) {
+	for (int i = 0; i < 4; i++, p++)
+		if (*p == '"' || *p == '\\' || *p == '\n' || *p == '\0') return p;
+	SCAN(p, v, vec_eq(v, '"') | vec_eq(v, '\\') | vec_eq(v, '\n') | vec_eq(v, '\0'));
+}
+#else
+static char *scan_blanks(char *p) {
+	while (*p == ' ' || *p == '\t') p++;
+	return p;
+}
+
+static char *scan_line_end(char *p) {
+	while (*p != '\n' && *p != '\0') p++;
+	return p;
+}
+
+static char *scan_string(char *p) {
+	while (*p != '"' && *p != '\\' && *p != '\n' && *p != '\0') p++;
+	return p;
+}
+#endif
+
+Token token(Lexer *lexer, TokenKind kind, char *data) {
+	return (Token) {
+		.kind = kind,
+		.data = data,
+		.loc = lexer->cur_loc,
+	};
+}
+
+Lexer lexer_from_source(Sources *srcs, Source src) {
+	da_append(srcs, src);
 	return (Lexer) {
-		.cur_loc.file = file,
-		.cur_loc.line_num = 0,
-		.cur_loc.line_start = code,
-		.cur_loc.line_char = code,
-		.cur_char = code,
+		.cur_char = src.code,
+		.code = src.code,
+		.src = srcs->count - 1,
 	};
 }
 
-struct {
+Lexer lexer_from_str(Sources *srcs, char *file, char *code) {
+	return lexer_from_source(srcs, (Source){
+		.file = file,
+		.code = code,
+		.size = strlen(code),
+		.borrowed = true,
+	});
+}
+
+Lexer lexer_from_file(Sources *srcs, char *file) {
+	Source src;
+	if (!source_load(&src, file))
+		return (Lexer){0};
+
+	return lexer_from_source(srcs, src);
+}
+
+typedef struct {
 	const char *id;
+	size_t len;
 	TokenKind kind;
-} keywordPairs[] = {
-	{ "for",      TOK_FOR_SYM   },
-	{ "while",    TOK_WHILE_SYM },
-	{ "if",       TOK_IF_SYM    },
-	{ "else",     TOK_ELSE_SYM  },
-	{ "extern",   TOK_EXTERN    },
-	{ "true",     TOK_TRUE      },
-	{ "false",    TOK_FALSE     },
-	{ "break",    TOK_BREAK     },
-	{ "continue", TOK_CONTINUE  },
-	{ "return",   TOK_RET       },
-	{ "import",   TOK_IMPORT    },
-	{ "fn",       TOK_FUNC      },
-	{ "none",     TOK_NONE      },
+} Keyword;
+
+// Perfect hash over the keyword list: every keyword is at least two
+// characters long and no two keywords share a slot. When adding a
+// keyword, make sure its slot is still free.
+#define KW_HASH(c0, c1, len) (((c0) + (c1) + (len) * 12) & 15)
+#define KW(str, c0, c1, tk) \
+	[KW_HASH(c0, c1, sizeof(str) - 1)] = { str, sizeof(str) - 1, tk }
+
+static const Keyword keywords[16] = {
+	KW("for",      'f', 'o', TOK_FOR_SYM  ),
+	KW("while",    'w', 'h', TOK_WHILE_SYM),
+	KW("if",       'i', 'f', TOK_IF_SYM   ),
+	KW("else",     'e', 'l', TOK_ELSE_SYM ),
+	KW("extern",   'e', 'x', TOK_EXTERN   ),
+	KW("true",     't', 'r', TOK_TRUE     ),
+	KW("false",    'f', 'a', TOK_FALSE    ),
+	KW("break",    'b', 'r', TOK_BREAK    ),
+	KW("continue", 'c', 'o', TOK_CONTINUE ),
+	KW("return",   'r', 'e', TOK_RET      ),
+	KW("import",   'i', 'm', TOK_IMPORT   ),
+	KW("fn",       'f', 'n', TOK_FUNC     ),
+	KW("none",     'n', 'o', TOK_NONE     ),
 };
 
+const Keyword *keyword_lookup(const char *word, size_t len) {
+	if (len < 2) return NULL;
+	const Keyword *kw = &keywords[KW_HASH(word[0], word[1], len)];
+	if (kw->len != len || memcmp(kw->id, word, len) != 0) return NULL;
+	return kw;
+}
+
+void lexer_skip_blanks(Lexer *l) {
+	for (;;) {
+		l->cur_char = scan_blanks(l->cur_char);
+
+		switch (*l->cur_char) {
+			case '\r':
+			case '\n': {
+				if (l->cur_char[0] == '\r' && l->cur_char[1] == '\n')
+					l->cur_char++;
+
+				l->cur_char++;
+			} break;
+
+			case '/': {
+				if (l->cur_char[1] != '/') return;
+				l->cur_char = scan_line_end(l->cur_char);
+			} break;
+
+			default: return;
+		}
+	}
+}
+
 Token lexer_next(Lexer *l) {
-	Token ret;
-	l->cur_loc.line_char = l->cur_char;
+	Token ret = {0};
+	lexer_skip_blanks(l);
+	l->cur_loc = (SrcLoc){l->src, l->cur_char - l->code};
 	ret.loc = l->cur_loc;
 
 	switch (*l->cur_char) {
-		case ' ': case '\t':
-			l->cur_char++;
-			return lexer_next(l);
-
 		case '\0':
 			ret = token(l, TOK_EOF, "EOF");
 			break;
@@ -166,11 +377,7 @@ Token lexer_next(Lexer *l) {
 		} break;
 
 		case '/': {
-			if (l->cur_char[1] == '/') {
-				while (*l->cur_char != '\n')
-					l->cur_char++;
-				return lexer_next(l);
-			} else if (l->cur_char[1] == '=') {
+			if (l->cur_char[1] == '=') {
 				ret = token(l, TOK_SLASH_EQ, "/=");
 				l->cur_char++;
 			} else ret = token(l, TOK_SLASH, "/");
@@ -239,18 +446,6 @@ Token lexer_next(Lexer *l) {
 			}
 		} break;
 
-		case '\r':
-		case '\n': {
-			if (l->cur_char[0] == '\r' && l->cur_char[1] == '\n')
-				l->cur_char++;
-
-			l->cur_loc.line_num++;
-			l->cur_loc.line_start = l->cur_char + 1;
-
-			l->cur_char++;
-			return lexer_next(l);
-		} break;
-
 		case ':': {
 			if (l->cur_char[1] == '=') {
 				ret = token(l, TOK_ASSIGN, ":=");
@@ -273,43 +468,48 @@ Token lexer_next(Lexer *l) {
 					l->cur_char++;
 				}
 
-				size_t len = l->cur_char - start + 1;
-				char *num = malloc(sizeof(char) * (len+1));
-				memcpy(num, start, len); num[len] = '\0';
-				if (isFloat) ret = token(l, TOK_FLOAT, num);
-				else         ret = token(l, TOK_INT, num);
+				ret = token(l, isFloat ? TOK_FLOAT : TOK_INT, start);
+				ret.len = l->cur_char - start + 1;
 			}
 
 			else if (*(l->cur_char) == '"') {
-				StringBuilder sb = {0};
-				l->cur_char++;
+				char *start = ++l->cur_char;
+				bool escaped = false;
+
+				for (;;) {
+					char *run = scan_string(l->cur_char);
+					l->cur_char = run;
+
+					if (*run == '"') break;
+					if (*run == '\0') {
+						ret.kind = TOK_ERR;
+						ret.data = "unclosed string";
+						return ret;
+					}
 
-				while (l->cur_char[0] != '\"') {
-					if (l->cur_char[0] == '\\') {
-						switch (l->cur_char[1]) {
-							case '\\': sb_append(&sb, '\\'); break;
-							case '0':  sb_append(&sb, '\0'); break;
-							case 'n':  sb_append(&sb, '\n'); break;
-							case 'r':  sb_append(&sb, '\r'); break;
-							case 't':  sb_append(&sb, '\t'); break;
-							case '\"': sb_append(&sb, '\"'); break;
-							default:
-								ret = token(l, TOK_ERR, "the string contains invalid character");
-								goto exit;
-						}
+					if (*run == '\n') {
 						l->cur_char++;
-					} else if (l->cur_char[0] == '\0') {
-						ret = token(l, TOK_ID, "unclosed string");
-						break;
-					} else {
-						sb_append(&sb, l->cur_char[0]);
+						continue;
 					}
 
-					l->cur_char++;
+					switch (run[1]) {
+						case '\\': case '0': case 'n':
+						case 'r':  case 't': case '\"':
+							break;
+						default:
+							ret.kind = TOK_ERR;
+							ret.data = "the string contains invalid character";
+							goto exit;
+					}
+
+					escaped = true;
+					l->cur_char += 2;
 				}
 
-				sb_append(&sb, '\0');
-				ret = token(l, TOK_STRING, sb.items);
+				ret.kind = TOK_STRING;
+				ret.data = start;
+				ret.len = l->cur_char - start;
+				ret.escaped = escaped;
 			}
 
 			else if (*l->cur_char == '\'') {
@@ -327,6 +527,8 @@ Token lexer_next(Lexer *l) {
 							ret = token(l, TOK_ERR, "invalid character");
 							goto exit;
 					}
+				} else if (*l->cur_char == '\0') {
+					return token(l, TOK_ERR, "unclosed character");
 				} else ret = token(l, TOK_CHAR, l->cur_char);
 
 				l->cur_char++;
@@ -335,16 +537,14 @@ Token lexer_next(Lexer *l) {
 			}
 
 			else if (isalpha(*l->cur_char) || *l->cur_char == '_') {
-				for (size_t i = 0; i < ARR_LEN(keywordPairs); i++) {
-					const char *kp = keywordPairs[i].id;
-					if (is_tok(l, kp)) {
-						ret = token(l, keywordPairs[i].kind, (char*)kp);
-						for (size_t i = 0; i < strlen(kp)-1; i++) l->cur_char++;
-						goto exit;
-					}
-				}
+				char *start = l->cur_char;
+				while (isalnum(l->cur_char[1]) || l->cur_char[1] == '_')
+					l->cur_char++;
 
-				ret = token(l, TOK_ID, get_word(l));
+				size_t len = l->cur_char - start + 1;
+				const Keyword *kw = keyword_lookup(start, len);
+				if (kw) ret = token(l, kw->kind, (char*)kw->id);
+				else    ret = token(l, TOK_ID, intern(l->interns, start, len));
 			}
 
 			else ret = token(l, TOK_ERR, "unknown token");
@@ -356,17 +556,44 @@ exit:
 	return ret;
 }
 
-Token lexer_peek(Lexer *l) {
-	Lexer pl = *l;
-	Token t = lexer_next(l);
-	*l = pl;
-	return t;
+// Decodes the escapes of a string literal validated by lexer_next,
+// returns the decoded length. dst needs at most len bytes.
+size_t lexer_unescape(char *dst, const char *src, size_t len) {
+	size_t n = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (src[i] != '\\') {
+			dst[n++] = src[i];
+			continue;
+		}
+
+		switch (src[++i]) {
+			case '0': dst[n++] = '\0'; break;
+			case 'n': dst[n++] = '\n'; break;
+			case 'r': dst[n++] = '\r'; break;
+			case 't': dst[n++] = '\t'; break;
+			default:  dst[n++] = src[i];
+		}
+	}
+
+	return n;
 }
 
-Token lexer_peek2(Lexer *l) {
-	Lexer pl = *l;
-	lexer_next(l);
-	Token t = lexer_next(l);
-	*l = pl;
-	return t;
+Tokens lexer_tokenize(Lexer *l) {
+	Tokens toks = {0};
+
+	for (;;) {
+		Token t = lexer_next(l);
+		da_append(&toks, t);
+		if (t.kind == TOK_EOF) break;
+
+		// the parser reports the error when it reaches it, so the rest of
+		// the source is not lexed, but the buffer is always EOF-terminated
+		if (t.kind == TOK_ERR) {
+			da_append(&toks, token(l, TOK_EOF, "EOF"));
+			break;
+		}
+	}
+
+	return toks;
 }
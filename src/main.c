@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,12 +12,12 @@ EpslVal Exit(EpslEvalCtx *ctx, EpslLocation cloc, EpslVals args) {
 		return EPSL_VNONE;
 	}
 
-	if (args.items[0].kind != EPSL_VAL_INT) {
+	if (epsl_val_kind(args.items[0]) != EPSL_VAL_INT) {
 		epsl_throw_error(ctx, cloc, "exit() accepts only integer");
 		return EPSL_VNONE;
 	}
 
-	exit(args.items[0].as.vint);
+	exit(epsl_val_int(args.items[0]));
 	return EPSL_VNONE;
 }
 
@@ -28,7 +29,7 @@ EpslVal System(EpslEvalCtx *ctx, EpslLocation cloc, EpslVals args) {
 
 	StringBuilder str = {0};
 	for (size_t i = 0; i < args.count; i++) {
-		if (args.items[i].kind != EPSL_VAL_STR) {
+		if (epsl_val_kind(args.items[i]) != EPSL_VAL_STR) {
 			epsl_throw_error(ctx, cloc, "system() accepts only strings");
 			return EPSL_VNONE;
 		}
@@ -40,10 +41,7 @@ EpslVal System(EpslEvalCtx *ctx, EpslLocation cloc, EpslVals args) {
 	int res = system(str.items);
 	sb_free(&str);
 
-	return (EpslVal){
-		.kind = EPSL_VAL_INT,
-		.as.vint = res,
-	};
+	return epsl_new_int(ctx, res);
 }
 
 void print_error(EpslLocation loc, EpslErrorKind ek, char *msg) {
@@ -83,7 +81,12 @@ void print_usage() {
 		"Options:\n"
 		"  -c     Program passed in as string\n"
 		"  -ast   Print abstract syntax tree\n"
-		"  -tok   Print tokens\n");
+		"  -tok   Print tokens\n"
+		"  -jN    Parse imports on N threads\n"
+		"  -cache Write the compiled program next to the script\n"
+		"  -nofold Do not fold constant expressions\n"
+		"  -tree  Evaluate by walking the syntax tree instead of the vm\n"
+		"  -closure Evaluate by compiling the syntax tree to closures\n");
 }
 
 void reg_platform(EpslCtx *ctx) {
@@ -109,6 +112,10 @@ int main(int argc, char *argv[]) {
 	bool print_toks = false;
 	bool print_ast  = false;
 	bool cmd        = false;
+	size_t threads  = 0;
+	bool cache      = false;
+	bool fold       = true;
+	EpslEngine engine = EPSL_ENGINE_VM;
 	DA(char*) script_args = {0};
 
 	if (argc == 1) {
@@ -128,6 +135,16 @@ int main(int argc, char *argv[]) {
 			print_ast = true;
 		} else if (strcmp(argv[i], "-c") == 0) {
 			cmd = true;
+		} else if (strcmp(argv[i], "-cache") == 0) {
+			cache = true;
+		} else if (strcmp(argv[i], "-nofold") == 0) {
+			fold = false;
+		} else if (strcmp(argv[i], "-tree") == 0) {
+			engine = EPSL_ENGINE_TREE;
+		} else if (strcmp(argv[i], "-closure") == 0) {
+			engine = EPSL_ENGINE_CLOSURE;
+		} else if (strncmp(argv[i], "-j", 2) == 0 && isdigit(argv[i][2])) {
+			threads = strtoul(argv[i] + 2, NULL, 10);
 		} else if (
 			strcmp(argv[i], "-h") == 0 ||
 			strcmp(argv[i], "--help") == 0) {
@@ -171,9 +188,15 @@ int main(int argc, char *argv[]) {
 	epsl_reg_var(ctx, "_OS_ARGS_", os_args);
 	epsl_reg_func(ctx, "exit", Exit);
 	epsl_reg_func(ctx, "system", System);
+	epsl_set_import_threads(ctx, threads);
+	if (cache) epsl_cache_program(ctx);
+	epsl_set_fold(ctx, fold);
+	epsl_set_engine(ctx, engine);
 
 	if (print_toks) epsl_print_tokens(ctx);
 	else if (print_ast) epsl_print_ast(ctx);
 	else epsl_eval(ctx);
+
+	epsl_free(ctx);
 	return 0;
 }
@@ -1,19 +1,68 @@
+#define _DEFAULT_SOURCE
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "../include/parser.h"
 
-void parser_error(Parser *p, Location loc, char *msg) {
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#ifdef _WIN32
+#define canonical_path(file, buf) _fullpath(buf, file, PATH_MAX)
+#define cache_lock(ic)
+#define cache_unlock(ic)
+#else
+#include <pthread.h>
+#define canonical_path(file, buf) realpath(file, buf)
+#define cache_lock(ic)   do { if ((ic)->lock) pthread_mutex_lock((ic)->lock); } while (0)
+#define cache_unlock(ic) do { if ((ic)->lock) pthread_mutex_unlock((ic)->lock); } while (0)
+
+// Moves every block of src to the end of dst.
+static void arena_append(Arena *dst, Arena *src) {
+	if (!src->first) return;
+	if (dst->last) dst->last->next = src->first;
+	else dst->first = src->first;
+
+	dst->last = src->last;
+	dst->last_ptr = NULL;
+	dst->last_sz = 0;
+	*src = (Arena){0};
+}
+#endif
+
+// Parsers of parallel import jobs have no errf, their errors are
+// reported when the serial pass parses the file again.
+void parser_error(Parser *p, SrcLoc loc, char *msg) {
 	p->err_ctx.got_err = true;
-	p->err_ctx.errf(loc, ERROR_COMPTIME, msg);
+	if (p->err_ctx.errf)
+		p->err_ctx.errf(source_loc(&p->cache->srcs, loc), ERROR_COMPTIME, msg);
 }
 
-AST *ast_alloc(AST ast) {
-	AST *n = malloc(sizeof(AST));
+AST *ast_alloc(Parser *p, AST ast) {
+	AST *n = arena_alloc(p->arena, sizeof(AST));
 	*n = ast;
 	return n;
 }
 
+// The node is evaluated before da_append reserves space, since parsing
+// it may itself grow the scratch stack.
+static void scratch_push(Parser *p, AST *n) {
+	da_append(&p->scratch, n);
+}
+
+// Child lists are collected on the parser's scratch stack and copied into
+// the program arena once their length is known.
+ASTs ast_list_commit(Parser *p, size_t mark) {
+	ASTs list = {.count = p->scratch.count - mark};
+	if (list.count)
+		list.items = arena_memdup(p->arena, p->scratch.items + mark, list.count * sizeof(AST*));
+	p->scratch.count = mark;
+	return list;
+}
+
 #define expect(p, tk) expect_f(p, tk, #tk)
 void expect_f(Parser *p, TokenKind tk, char *tok_str) {
 	if (peek(p).kind == TOK_ERR) {
@@ -28,6 +77,22 @@ void expect_f(Parser *p, TokenKind tk, char *tok_str) {
 	}
 }
 
+// String literals without escapes are used in place; the others are
+// decoded once into the program's constant pool.
+StrSlice parse_str(Parser *p, Token t) {
+	if (!t.escaped)
+		return (StrSlice){ t.data, t.len };
+
+	char *dst = arena_alloc(p->arena, t.len);
+	return (StrSlice){ dst, lexer_unescape(dst, t.data, t.len) };
+}
+
+char *parse_cstr(Parser *p, Token t) {
+	char *dst = arena_alloc(p->arena, t.len + 1);
+	dst[lexer_unescape(dst, t.data, t.len)] = '\0';
+	return dst;
+}
+
 double parse_float(char *data) {
 	return atof(data);
 }
@@ -72,18 +137,6 @@ uint ast_op_precedence(AST_Op op, bool l) {
 	}
 }
 
-AST_Op ast_get_op(Parser *p, AST *a) {
-	switch (a->kind) {
-		case AST_UN_EXPR:
-			return a->as.un_expr.op;
-		case AST_BIN_EXPR:
-			return a->as.bin_expr.op;
-		default:
-			parser_error(p, a->loc, "invalid expression");
-			return 0;
-	}
-}
-
 typedef enum {
 	PARSE_EXPR_STMT,
 	PARSE_EXPR_PARS,
@@ -95,17 +148,18 @@ typedef enum {
 AST *parse_expr(Parser *p, ParseExprKind pek);
 
 AST *parse_list(Parser *p) {
-	AST *list = ast_alloc((AST){
+	AST *list = ast_alloc(p, (AST){
 		.kind = AST_LIST,
 		.loc = peek(p).loc,
 		.as.list = NULL,
 	});
 
 	if (peek2(p).kind == TOK_CSQBRA) {
-		next(p);
+		next(p); next(p);
 		return list;
 	}
 
+	size_t mark = p->scratch.count;
 	next(p);
 	for (;;) {
 		switch (peek(p).kind) {
@@ -122,7 +176,7 @@ AST *parse_list(Parser *p) {
 			default: {
 				AST *expr = parse_expr(p, PARSE_EXPR_ARGS);
 				if (p->err_ctx.got_err) return NULL;
-				da_append(&list->as.list, expr);
+				scratch_push(p, expr);
 				if (peek(p).kind != TOK_CSQBRA && peek(p).kind != TOK_COM) {
 					parser_error(p, peek(p).loc, "invalid expression");
 					return NULL;
@@ -134,21 +188,24 @@ AST *parse_list(Parser *p) {
 
 exit:
 	expect(p, TOK_CSQBRA);
+	next(p);
+	list->as.list = ast_list_commit(p, mark);
 	return list;
 }
 
 AST *parse_dict(Parser *p) {
-	AST *dict = ast_alloc((AST){
+	AST *dict = ast_alloc(p, (AST){
 		.kind = AST_DICT,
 		.loc = peek(p).loc,
 		.as.dict = {0},
 	});
 
 	if (peek2(p).kind == TOK_CBRA) {
-		next(p);
+		next(p); next(p);
 		return dict;
 	}
 
+	size_t mark = p->scratch.count;
 	next(p);
 	for (;;) {
 		switch (peek(p).kind) {
@@ -171,7 +228,7 @@ AST *parse_dict(Parser *p) {
 					return NULL;
 				}
 
-				da_append(&dict->as.dict, expr);
+				scratch_push(p, expr);
 				if (peek(p).kind != TOK_CBRA && peek(p).kind != TOK_COM) {
 					parser_error(p, peek(p).loc, "invalid expression");
 					return NULL;
@@ -182,11 +239,13 @@ AST *parse_dict(Parser *p) {
 
 exit:
 	expect(p, TOK_CBRA);
+	next(p);
+	dict->as.dict = ast_list_commit(p, mark);
 	return dict;
 }
 
 AST *parse_func_call(Parser *p) {
-	AST *func_call = ast_alloc((AST){
+	AST *func_call = ast_alloc(p, (AST){
 		.kind = AST_FUNC_CALL,
 		.loc = peek(p).loc,
 	});
@@ -194,6 +253,7 @@ AST *parse_func_call(Parser *p) {
 	func_call->as.func_call.id = next(p).data;
 	expect(p, TOK_OPAR); next(p);
 
+	size_t mark = p->scratch.count;
 	for (;;) {
 		switch (peek(p).kind) {
 			case TOK_CPAR: goto exit;
@@ -209,7 +269,7 @@ AST *parse_func_call(Parser *p) {
 			default: {
 				AST *expr = parse_expr(p, PARSE_EXPR_ARGS);
 				if (p->err_ctx.got_err) return NULL;
-				da_append(&func_call->as.func_call.args, expr);
+				scratch_push(p, expr);
 
 				if (peek(p).kind != TOK_CPAR && peek(p).kind != TOK_COM) {
 					parser_error(p, peek(p).loc, "invalid expression");
@@ -220,13 +280,16 @@ AST *parse_func_call(Parser *p) {
 	}
 
 exit:
+	next(p);
+	func_call->as.func_call.args = ast_list_commit(p, mark);
 	return func_call;
 }
 
 AST *parse_body(Parser *p, bool isProg);
+AST *parse_import(Parser *p, char *file, SrcLoc loc);
 
 AST *parse_if_stmt(Parser *p) {
-	AST *if_st = ast_alloc((AST){
+	AST *if_st = ast_alloc(p, (AST){
 		.kind = AST_ST_IF,
 		.loc = next(p).loc,
 	});
@@ -246,7 +309,7 @@ AST *parse_if_stmt(Parser *p) {
 			return if_st;
 		}
 
-		AST *elst = ast_alloc((AST){
+		AST *elst = ast_alloc(p, (AST){
 			.kind = AST_ST_ELSE,
 			.loc = next(p).loc
 		});
@@ -260,7 +323,7 @@ AST *parse_if_stmt(Parser *p) {
 }
 
 AST *parse_var_mut(Parser *p, ParseExprKind pek) {
-	AST *var_mut = ast_alloc((AST){
+	AST *var_mut = ast_alloc(p, (AST){
 		.kind = AST_VAR_MUT,
 		.loc = peek(p).loc,
 		.as.var_mut = parse_expr(p, pek),
@@ -270,7 +333,7 @@ AST *parse_var_mut(Parser *p, ParseExprKind pek) {
 }
 
 AST *parse_var_def_assign(Parser *p) {
-	AST *var_def = ast_alloc((AST){
+	AST *var_def = ast_alloc(p, (AST){
 		.kind = AST_VAR_DEF,
 		.loc = peek(p).loc,
 		.as.var_def.id = next(p).data,
@@ -285,7 +348,7 @@ AST *parse_var_def_assign(Parser *p) {
 }
 
 AST *parse_for_stmt(Parser *p) {
-	AST *for_st = ast_alloc((AST){
+	AST *for_st = ast_alloc(p, (AST){
 		.loc = next(p).loc,
 	});
 
@@ -314,13 +377,14 @@ AST *parse_for_stmt(Parser *p) {
 		if (p->err_ctx.got_err) return NULL;
 	}
 
-
-	for_st->as.st_for.body = parse_body(p, false);
+	AST *body = parse_body(p, false);
+	if (for_st->kind == AST_ST_FOR) for_st->as.st_for.body = body;
+	else for_st->as.st_foreach.body = body;
 	return for_st;
 }
 
 AST *parse_while_stmt(Parser *p) {
-	AST *wst = ast_alloc((AST){
+	AST *wst = ast_alloc(p, (AST){
 		.kind = AST_ST_WHILE,
 		.loc = next(p).loc,
 	});
@@ -336,7 +400,7 @@ AST *parse_func_def(Parser *p) {
 	next(p); expect(p, TOK_ID);
 	if (p->err_ctx.got_err) return NULL;
 
-	AST *func_def = ast_alloc((AST){
+	AST *func_def = ast_alloc(p, (AST){
 		.kind = AST_FUNC_DEF,
 		.loc = peek(p).loc,
 	});
@@ -346,6 +410,7 @@ AST *parse_func_def(Parser *p) {
 	if (p->err_ctx.got_err) return NULL;
 	next(p);
 
+	size_t mark = p->scratch.count;
 	bool found_any = false;
 	while (peek(p).kind != TOK_CPAR) {
 		switch (peek(p).kind) {
@@ -363,14 +428,15 @@ AST *parse_func_def(Parser *p) {
 				}
 
 				found_any = true;
-				da_append(&func_def->as.func_def.args, ast_alloc((AST){
+				scratch_push(p, ast_alloc(p, (AST){
 					.kind = AST_VAR_ANY,
 					.loc = peek(p).loc,
+					.as.var = intern_cstr(p->lexer.interns, "_VA_ARGS_"),
 				}));
 			} break;
 
 			case TOK_ID: {
-				da_append(&func_def->as.func_def.args, ast_alloc((AST){
+				scratch_push(p, ast_alloc(p, (AST){
 					.kind = AST_VAR,
 					.loc = peek(p).loc,
 					.as.var = peek(p).data,
@@ -386,297 +452,540 @@ AST *parse_func_def(Parser *p) {
 	}
 
 	next(p);
-
+	func_def->as.func_def.args = ast_list_commit(p, mark);
 	func_def->as.func_def.body = parse_body(p, false);
 	return func_def;
 }
 
-void ast_expr_set_val(AST *expr, AST *n, bool left) {
-	switch (expr->kind) {
-		case AST_BIN_EXPR: {
-			if (left) expr->as.bin_expr.lhs = n;
-			else      expr->as.bin_expr.rhs = n;
-		} break;
-
-		case AST_UN_EXPR: {
-			expr->as.un_expr.v = n;
-		} break;
+bool parse_expr_end(Parser *p, ParseExprKind pek) {
+	TokenKind tk = peek(p).kind;
+	switch (pek) {
+		case PARSE_EXPR_STMT:
+			return tk == TOK_SEMI;
+		case PARSE_EXPR_PARS:
+			return tk == TOK_CPAR;
+		case PARSE_EXPR_ARGS:
+			return tk == TOK_COM || tk == TOK_CSQBRA ||
+				tk == TOK_CBRA || tk == TOK_CPAR;
+		case PARSE_EXPR_BODY:
+			return tk == TOK_ARROW_EQ || tk == TOK_ARROW || tk == TOK_OBRA;
+		case PARSE_EXPR_SQBRAS:
+			return tk == TOK_CSQBRA;
+		default:
+			return false;
+	}
+}
 
-		default: assert(0);
+bool parse_bin_op(TokenKind tk, AST_Op *op) {
+	switch (tk) {
+		case TOK_NOT_EQ:   *op = AST_OP_NOT_EQ;   break;
+		case TOK_LESS:     *op = AST_OP_LESS;     break;
+		case TOK_LESS_EQ:  *op = AST_OP_LESS_EQ;  break;
+		case TOK_GREAT:    *op = AST_OP_GREAT;    break;
+		case TOK_GREAT_EQ: *op = AST_OP_GREAT_EQ; break;
+		case TOK_COL:      *op = AST_OP_PAIR;     break;
+		case TOK_EQ_EQ:    *op = AST_OP_IS_EQ;    break;
+		case TOK_AND:      *op = AST_OP_AND;      break;
+		case TOK_OR:       *op = AST_OP_OR;       break;
+		case TOK_EQ:       *op = AST_OP_EQ;       break;
+		case TOK_PLUS:     *op = AST_OP_ADD;      break;
+		case TOK_MINUS:    *op = AST_OP_SUB;      break;
+		case TOK_STAR:     *op = AST_OP_MUL;      break;
+		case TOK_SLASH:    *op = AST_OP_DIV;      break;
+		case TOK_PS:       *op = AST_OP_MOD;      break;
+		case TOK_PLUS_EQ:  *op = AST_OP_ADD_EQ;   break;
+		case TOK_MINUS_EQ: *op = AST_OP_SUB_EQ;   break;
+		case TOK_STAR_EQ:  *op = AST_OP_MUL_EQ;   break;
+		case TOK_SLASH_EQ: *op = AST_OP_DIV_EQ;   break;
+		case TOK_OSQBRA:   *op = AST_OP_ARR;      break;
+		default: return false;
 	}
+
+	return true;
 }
 
-AST *parse_expand(Parser *p, ASTs *nodes) {
-	if (p->err_ctx.got_err) return NULL;
-	size_t cnt_before = nodes->count;
-
-	for (size_t i = 0; i < nodes->count; i++) {
-		if (nodes->count == 1)
-			return da_last(nodes);
-
-		AST *node = da_get(nodes, i);
-		bool is_op = false;
-		if (node->kind == AST_BIN_EXPR) {
-			if (!node->as.bin_expr.lhs || !node->as.bin_expr.rhs)
-				is_op = true;
-		} else if (node->kind == AST_UN_EXPR) {
-			if (!node->as.un_expr.v)
-				is_op = true;
-		}
+AST *parse_expr_prec(Parser *p, ParseExprKind pek, uint min_prec);
 
-		if (!is_op) {
-			uint lpr = 0, rpr = 0;
+AST *parse_primary(Parser *p, ParseExprKind pek) {
+	if (parse_expr_end(p, pek)) {
+		parser_error(p, peek(p).loc, "invalid expression");
+		return NULL;
+	}
 
-			if (i > 0)
-				lpr = ast_op_precedence(ast_get_op(p, da_get(nodes, i - 1)), false);
+	Token t = peek(p);
+	switch (t.kind) {
+		case TOK_EXC:
+		case TOK_MINUS: {
+			next(p);
+			AST_Op op = t.kind == TOK_EXC ? AST_OP_NOT : AST_OP_NEG;
+			AST *v = parse_expr_prec(p, pek, ast_op_precedence(op, false));
 			if (p->err_ctx.got_err) return NULL;
 
-			if (i < nodes->count - 1)
-				rpr = ast_op_precedence(ast_get_op(p, da_get(nodes, i + 1)), true);
-			if (p->err_ctx.got_err) return NULL;
+			return ast_alloc(p, (AST){
+				.kind = AST_UN_EXPR,
+				.loc = t.loc,
+				.as.un_expr.op = op,
+				.as.un_expr.v = v,
+			});
+		}
+
+		case TOK_OSQBRA:
+			return parse_list(p);
+
+		case TOK_OBRA:
+			return parse_dict(p);
 
-			if (lpr == 0 && rpr == 0) {
-				parser_error(p, node->loc, "invalid combination of operator and operands");
+		case TOK_OPAR: {
+			next(p);
+			AST *expr = parse_expr(p, PARSE_EXPR_PARS);
+			if (p->err_ctx.got_err) return NULL;
+			if (!expr) {
+				parser_error(p, t.loc, "invalid expression");
 				return NULL;
 			}
 
-			if (lpr > rpr) ast_expr_set_val(da_get(nodes, i - 1), node, false);
-			else           ast_expr_set_val(da_get(nodes, i + 1), node, true);
+			expect(p, TOK_CPAR);
+			next(p);
+			return expr;
+		}
+
+		case TOK_ID: {
+			if (peek2(p).kind == TOK_OPAR)
+				return parse_func_call(p);
+
+			next(p);
+			return ast_alloc(p, (AST){
+				.kind = AST_VAR,
+				.loc = t.loc,
+				.as.var = t.data,
+			});
+		}
+
+		case TOK_STRING: {
+			next(p);
+			return ast_alloc(p, (AST){
+				.kind = AST_LIT,
+				.loc = t.loc,
+				.as.lit.kind = LITERAL_STR,
+				.as.lit.as.vstr = parse_str(p, t),
+			});
+		}
+
+		case TOK_NONE: {
+			next(p);
+			return ast_alloc(p, (AST){
+				.kind = AST_VAL_NONE,
+				.loc = t.loc,
+			});
+		}
 
-			da_remove_ordered(nodes, i);
-			i--;
+		case TOK_FALSE:
+		case TOK_TRUE: {
+			next(p);
+			return ast_alloc(p, (AST){
+				.kind = AST_LIT,
+				.loc = t.loc,
+				.as.lit.kind = LITERAL_BOOL,
+				.as.lit.as.vbool = t.kind == TOK_TRUE,
+			});
 		}
+
+		case TOK_INT: {
+			next(p);
+			return ast_alloc(p, (AST){
+				.kind = AST_LIT,
+				.loc = t.loc,
+				.as.lit.kind = LITERAL_INT,
+				.as.lit.as.vint = parse_int(t.data),
+			});
+		}
+
+		case TOK_FLOAT: {
+			next(p);
+			return ast_alloc(p, (AST){
+				.kind = AST_LIT,
+				.loc = t.loc,
+				.as.lit.kind = LITERAL_FLOAT,
+				.as.lit.as.vfloat = parse_float(t.data),
+			});
+		}
+
+		case TOK_ERR:
+			parser_error(p, t.loc, t.data);
+			return NULL;
+
+		default:
+			parser_error(p, t.loc, "invalid expression");
+			return NULL;
 	}
+}
 
-	if (cnt_before == nodes->count) {
-		parser_error(p, da_last(nodes)->loc, "invalid expression");
-		return NULL;
+// Precedence climbing over ast_op_precedence: an operand binds to the
+// operator on its right when that operator's left precedence is at least
+// the right precedence of the operator on its left.
+AST *parse_expr_prec(Parser *p, ParseExprKind pek, uint min_prec) {
+	AST *lhs = parse_primary(p, pek);
+	if (p->err_ctx.got_err) return NULL;
+
+	for (;;) {
+		AST_Op op;
+		if (parse_expr_end(p, pek) || !parse_bin_op(peek(p).kind, &op))
+			break;
+		if (ast_op_precedence(op, true) < min_prec)
+			break;
+
+		SrcLoc loc = next(p).loc;
+		AST *rhs;
+
+		if (op == AST_OP_ARR) {
+			rhs = parse_expr(p, PARSE_EXPR_SQBRAS);
+			if (p->err_ctx.got_err) return NULL;
+			if (!rhs) {
+				parser_error(p, loc, "invalid expression");
+				return NULL;
+			}
+
+			expect(p, TOK_CSQBRA);
+			next(p);
+		} else {
+			rhs = parse_expr_prec(p, pek, ast_op_precedence(op, false));
+		}
+
+		if (p->err_ctx.got_err) return NULL;
+		lhs = ast_alloc(p, (AST){
+			.kind = AST_BIN_EXPR,
+			.loc = loc,
+			.as.bin_expr.op = op,
+			.as.bin_expr.lhs = lhs,
+			.as.bin_expr.rhs = rhs,
+		});
 	}
 
-	return parse_expand(p, nodes);
+	return lhs;
 }
 
 AST *parse_expr(Parser *p, ParseExprKind pek) {
-	ASTs nodes = {0};
+	if (p->err_ctx.got_err) return NULL;
+	if (parse_expr_end(p, pek))
+		return NULL;
 
-	for (;;) {
-		if (p->err_ctx.got_err) return NULL;
-		if (pek == PARSE_EXPR_STMT) {
-			if (peek(p).kind == TOK_SEMI) break;
-		} else if (pek == PARSE_EXPR_PARS) {
-			if (peek(p).kind == TOK_CPAR) break;
-		} else if (pek == PARSE_EXPR_ARGS) {
-			if (peek(p).kind == TOK_COM ||
-				peek(p).kind == TOK_CSQBRA ||
-				peek(p).kind == TOK_CBRA ||
-				peek(p).kind == TOK_CPAR) break;
-		} else if (pek == PARSE_EXPR_BODY) {
-			if (peek(p).kind == TOK_ARROW_EQ ||
-				peek(p).kind == TOK_ARROW ||
-				peek(p).kind == TOK_OBRA) break;
-		} else if (pek == PARSE_EXPR_SQBRAS) {
-			if (peek(p).kind == TOK_CSQBRA) break;
+	AST *expr = parse_expr_prec(p, pek, 0);
+	if (p->err_ctx.got_err) return NULL;
+
+	if (!parse_expr_end(p, pek)) {
+		if (peek(p).kind == TOK_ERR)
+			parser_error(p, peek(p).loc, peek(p).data);
+		else
+			parser_error(p, peek(p).loc, "invalid expression");
+		return NULL;
+	}
+
+	return expr;
+}
+
+AST *parse_func_ret(Parser *p) {
+	AST *func = ast_alloc(p, (AST){
+		.kind = AST_RET,
+		.loc = next(p).loc,
+	});
+
+	func->as.ret.expr = parse_expr(p, PARSE_EXPR_STMT);
+	return func;
+}
+
+// Each file is parsed once per cache, later imports splice the same
+// statements again. While imports are parsed in parallel a module that
+// another job is still parsing is parsed privately instead of waiting,
+// so a cycle across jobs fails like any other circular import.
+AST *parse_import(Parser *p, char *file, SrcLoc loc) {
+	char path[PATH_MAX];
+	Source src;
+
+	if (!canonical_path(file, path) || !source_load(&src, file)) {
+		parser_error(p, loc, "no such file");
+		return NULL;
+	}
+
+	ImportCache *ic = p->cache;
+	u64 hash = source_hash(&src);
+	Module *mod = NULL;
+	bool busy = false;
+
+	cache_lock(ic);
+	da_foreach (Module*, it, &ic->mods) {
+		Module *m = *it;
+		if (m->hash != hash || strcmp(m->path, path) != 0) continue;
+
+		AST *body = m->body;
+		bool circular = !body && m->owner == p->job;
+		if (body || circular) {
+			cache_unlock(ic);
+			source_free(&src);
+			if (circular) parser_error(p, loc, "circular import");
+			return body;
 		}
 
-		switch (peek(p).kind) {
-			case TOK_OSQBRA: {
-				if (nodes.count > 0) {
-					AST *l = da_last(&nodes);
-					AST *ll = da_get(&nodes, nodes.count - 2);
-
-					bool is_var = l->kind == AST_VAR;
-					bool is_arr_op = nodes.count < 2 ? false :
-						ll->kind == AST_BIN_EXPR && ll->as.bin_expr.op == AST_OP_ARR;
-
-					if (is_arr_op || is_var) {
-						da_append(&nodes, ast_alloc((AST){
-							.kind = AST_BIN_EXPR,
-							.loc = next(p).loc,
-							.as.bin_expr.op = AST_OP_ARR,
-						}));
-
-						da_append(&nodes, parse_expr(p, PARSE_EXPR_SQBRAS));
-						if (p->err_ctx.got_err) return NULL;
-						break;
-					}
-				}
+		busy = true;
+		break;
+	}
 
-				da_append(&nodes, parse_list(p));
-			} break;
+	if (!busy) {
+		mod = arena_alloc(p->arena, sizeof(Module));
+		*mod = (Module){
+			.path = arena_strdup(p->arena, path),
+			.hash = hash,
+			.owner = p->job,
+		};
 
-			case TOK_STRING: {
-				da_append(&nodes, ast_alloc((AST){
-					.kind = AST_LIT,
-					.loc = peek(p).loc,
-					.as.lit.kind = LITERAL_STR,
-					.as.lit.as.vstr = peek(p).data,
-				}));
-			} break;
+		da_append(&ic->mods, mod);
+	}
 
-			case TOK_NONE: {
-				da_append(&nodes, ast_alloc((AST){
-					.kind = AST_VAL_NONE,
-					.loc = peek(p).loc,
-				}));
-			} break;
+	Parser ip = {
+		.lexer = lexer_from_source(&ic->srcs, src),
+		.cache = ic,
+		.arena = p->arena,
+		.job = p->job,
+		.err_ctx = p->err_ctx,
+	};
+	cache_unlock(ic);
+
+	ip.lexer.interns = p->lexer.interns;
+	ip.toks = lexer_tokenize(&ip.lexer);
+
+	AST *ib = parse_body(&ip, true);
+	da_free(&ip.toks);
+	da_free(&ip.scratch);
+
+	cache_lock(ic);
+	if (ip.err_ctx.got_err) {
+		p->err_ctx.got_err = true;
+		for (size_t i = 0; mod && i < ic->mods.count; i++) {
+			if (da_get(&ic->mods, i) != mod) continue;
+			da_remove_unordered(&ic->mods, i);
+			break;
+		}
 
-			case TOK_FALSE:
-			case TOK_TRUE: {
-				da_append(&nodes, ast_alloc((AST){
-					.kind = AST_LIT,
-					.loc = peek(p).loc,
-					.as.lit.kind = LITERAL_BOOL,
-					.as.lit.as.vbool = peek(p).kind == TOK_TRUE,
-				}));
-			} break;
+		ib = NULL;
+	} else if (mod) mod->body = ib;
+	cache_unlock(ic);
 
-			case TOK_OBRA: {
-				da_append(&nodes, parse_dict(p));
-			} break;
+	return ib;
+}
 
-			case TOK_OPAR: {
-				next(p);
-				da_append(&nodes, parse_expr(p, PARSE_EXPR_PARS));
-			} break;
+#ifndef _WIN32
+// Each job lexes into its own table, its ids are moved to the parser's
+// when the job is done, see parse_reintern.
+typedef struct {
+	char *file;
+	SrcLoc loc;
+	Arena arena;
+	Interns interns;
+} ImportJob;
+
+typedef struct {
+	Parser *p;
+	DA(ImportJob) jobs;
+	size_t next;
+} ImportPool;
+
+void *parse_import_worker(void *arg) {
+	ImportPool *pool = arg;
+	ImportCache *ic = pool->p->cache;
 
-			case TOK_ID: {
-				if (peek2(p).kind == TOK_OPAR) {
-					da_append(&nodes, parse_func_call(p));
-				} else {
-					da_append(&nodes, ast_alloc((AST){
-						.kind = AST_VAR,
-						.loc = peek(p).loc,
-						.as.var = peek(p).data,
-					}));
-				}
-			} break;
+	for (;;) {
+		cache_lock(ic);
+		size_t i = pool->next++;
+		cache_unlock(ic);
+		if (i >= pool->jobs.count) return NULL;
+
+		ImportJob *job = &pool->jobs.items[i];
+		Parser jp = {
+			.cache = ic,
+			.arena = &job->arena,
+			.job = job,
+		};
+
+		jp.lexer.interns = &job->interns;
+		parse_import(&jp, job->file, job->loc);
+	}
+}
 
-			case TOK_INT: {
-				da_append(&nodes, ast_alloc((AST){
-					.kind = AST_LIT,
-					.loc = peek(p).loc,
-					.as.lit.kind = LITERAL_INT,
-					.as.lit.as.vint = parse_int(peek(p).data),
-				}));
-			} break;
+void parse_reintern(Interns *in, AST *n);
 
-			case TOK_FLOAT: {
-				da_append(&nodes, ast_alloc((AST){
-					.kind = AST_LIT,
-					.loc = peek(p).loc,
-					.as.lit.kind = LITERAL_FLOAT,
-					.as.lit.as.vfloat = parse_float(peek(p).data),
-				}));
-			} break;
+void parse_reintern_list(Interns *in, ASTs *list) {
+	da_foreach (AST*, it, list)
+		parse_reintern(in, *it);
+}
 
-			case TOK_EXC: {
-				da_append(&nodes, ast_alloc((AST){
-					.kind = AST_UN_EXPR,
-					.loc = peek(p).loc,
-					.as.un_expr.op = AST_OP_NOT,
-				}));
-			} break;
+// Points the ids of a tree a job parsed into the parser's table. Bodies
+// spliced into several modules are visited again, which is harmless since
+// interning an id already in the table returns it.
+void parse_reintern(Interns *in, AST *n) {
+	if (!n) return;
 
-			case TOK_MINUS: {
-				bool is_unary_op = false;
-				if (nodes.count == 0) {
-					is_unary_op = true;
-				} else {
-					if (da_last(&nodes)->kind == AST_UN_EXPR) {
-						is_unary_op = false;
-					} else {
-						bool is_bin_op = da_last(&nodes)->kind == AST_BIN_EXPR;
-						if (is_bin_op && da_last(&nodes)->as.bin_expr.lhs &&
-							da_last(&nodes)->as.bin_expr.rhs) is_bin_op = false;
-						if (is_bin_op) is_unary_op = true;
-					}
-				}
+	switch (n->kind) {
+		case AST_PROG:
+			parse_reintern(in, n->as.prog.body);
+			break;
 
-				if (!is_unary_op) {
-					da_append(&nodes, ast_alloc((AST){
-						.kind = AST_BIN_EXPR,
-						.loc = peek(p).loc,
-						.as.bin_expr.op = AST_OP_SUB,
-					}));
-				} else {
-					da_append(&nodes, ast_alloc((AST){
-						.kind = AST_UN_EXPR,
-						.loc = peek(p).loc,
-						.as.un_expr.op = AST_OP_NEG,
-					}));
-				}
-			} break;
+		case AST_VAR:
+		case AST_VAR_ANY:
+			n->as.var = intern_cstr(in, n->as.var);
+			break;
 
-			case TOK_EQ:      case TOK_OR:
-			case TOK_COL:     case TOK_PS:
-			case TOK_EQ_EQ:   case TOK_AND:
-			case TOK_PLUS:    case TOK_STAR:
-			case TOK_LESS:    case TOK_LESS_EQ:
-			case TOK_GREAT:   case TOK_GREAT_EQ:
-			case TOK_PLUS_EQ: case TOK_MINUS_EQ:
-			case TOK_STAR_EQ: case TOK_SLASH_EQ:
-			case TOK_NOT_EQ:  case TOK_SLASH: {
-				TokenKind tk = peek(p).kind;
-				da_append(&nodes, ast_alloc((AST){
-					.kind = AST_BIN_EXPR,
-					.loc = peek(p).loc,
-					.as.bin_expr.op =
-					tk == TOK_NOT_EQ   ? AST_OP_NOT_EQ   :
-					tk == TOK_LESS     ? AST_OP_LESS     :
-					tk == TOK_LESS_EQ  ? AST_OP_LESS_EQ  :
-					tk == TOK_GREAT    ? AST_OP_GREAT    :
-					tk == TOK_GREAT_EQ ? AST_OP_GREAT_EQ :
-					tk == TOK_COL      ? AST_OP_PAIR     :
-					tk == TOK_EQ_EQ    ? AST_OP_IS_EQ    :
-					tk == TOK_AND      ? AST_OP_AND      :
-					tk == TOK_OR       ? AST_OP_OR       :
-					tk == TOK_EQ       ? AST_OP_EQ       :
-					tk == TOK_PLUS     ? AST_OP_ADD      :
-					tk == TOK_STAR     ? AST_OP_MUL      :
-					tk == TOK_SLASH    ? AST_OP_DIV      :
-					tk == TOK_PS       ? AST_OP_MOD      :
-					tk == TOK_PLUS_EQ  ? AST_OP_ADD_EQ   :
-					tk == TOK_MINUS_EQ ? AST_OP_SUB_EQ   :
-					tk == TOK_STAR_EQ  ? AST_OP_MUL_EQ   :
-					tk == TOK_SLASH_EQ ? AST_OP_DIV_EQ   : 0,
-				}));
-			} break;
+		case AST_VAR_DEF:
+			n->as.var_def.id = intern_cstr(in, n->as.var_def.id);
+			parse_reintern(in, n->as.var_def.expr);
+			break;
 
-			default: {
-				if (peek(p).kind == TOK_ERR) {
-					parser_error(p, peek(p).loc, peek(p).data);
-					return NULL;
-				}
+		case AST_VAR_MUT:
+			parse_reintern(in, n->as.var_mut);
+			break;
 
-				parser_error(p, peek(p).loc, "invalid expression");
-				return NULL;
-			}
-		}
+		case AST_BODY:
+			parse_reintern_list(in, &n->as.body);
+			break;
 
-		next(p);
-	}
+		case AST_LIST:
+			parse_reintern_list(in, &n->as.list);
+			break;
 
-	if (nodes.count == 0)
-		return NULL;
+		case AST_DICT:
+			parse_reintern_list(in, &n->as.dict);
+			break;
+
+		case AST_FUNC_DEF:
+			n->as.func_def.id = intern_cstr(in, n->as.func_def.id);
+			parse_reintern_list(in, &n->as.func_def.args);
+			parse_reintern(in, n->as.func_def.body);
+			break;
+
+		case AST_FUNC_CALL:
+			n->as.func_call.id = intern_cstr(in, n->as.func_call.id);
+			parse_reintern_list(in, &n->as.func_call.args);
+			break;
+
+		case AST_ST_WHILE:
+			parse_reintern(in, n->as.st_while.cond);
+			parse_reintern(in, n->as.st_while.body);
+			break;
+
+		case AST_ST_FOR:
+			parse_reintern(in, n->as.st_for.var);
+			parse_reintern(in, n->as.st_for.cond);
+			parse_reintern(in, n->as.st_for.mut);
+			parse_reintern(in, n->as.st_for.body);
+			break;
+
+		case AST_ST_FOREACH:
+			n->as.st_foreach.var_id = intern_cstr(in, n->as.st_foreach.var_id);
+			parse_reintern(in, n->as.st_foreach.coll);
+			parse_reintern(in, n->as.st_foreach.body);
+			break;
+
+		case AST_ST_IF:
+			parse_reintern(in, n->as.st_if_chain.cond);
+			parse_reintern(in, n->as.st_if_chain.body);
+			parse_reintern(in, n->as.st_if_chain.chain);
+			break;
 
-	return parse_expand(p, &nodes);
+		case AST_ST_ELSE:
+			parse_reintern(in, n->as.st_else.body);
+			break;
+
+		case AST_BIN_EXPR:
+			parse_reintern(in, n->as.bin_expr.lhs);
+			parse_reintern(in, n->as.bin_expr.rhs);
+			break;
+
+		case AST_UN_EXPR:
+			parse_reintern(in, n->as.un_expr.v);
+			break;
+
+		case AST_RET:
+			parse_reintern(in, n->as.ret.expr);
+			break;
+
+		default:;
+	}
 }
 
-AST *parse_func_ret(Parser *p) {
-	AST *func = ast_alloc((AST){
-		.kind = AST_RET,
-		.loc = next(p).loc,
-	});
+// Finds every import in the token stream up front and parses the files
+// on a pool of threads, filling the cache before the serial pass splices
+// them in source order. Failed jobs leave nothing in the cache, so the
+// serial pass parses those files again and reports their errors through
+// errf in order.
+void parse_imports_parallel(Parser *p) {
+	ImportCache *ic = p->cache;
+	ImportPool pool = { .p = p };
+	DA(char*) paths = {0};
+
+	for (size_t i = 0; i + 1 < p->toks.count; i++) {
+		Token t = p->toks.items[i + 1];
+		if (p->toks.items[i].kind != TOK_IMPORT || t.kind != TOK_STRING)
+			continue;
+
+		char path[PATH_MAX];
+		char *file = parse_cstr(p, t);
+		if (!canonical_path(file, path)) continue;
+
+		bool seen = false;
+		da_foreach (char*, it, &paths)
+			if (strcmp(*it, path) == 0) seen = true;
+		da_foreach (Module*, it, &ic->mods)
+			if (strcmp((*it)->path, path) == 0) seen = true;
+		if (seen) continue;
+
+		da_append(&paths, arena_strdup(p->arena, path));
+		da_append(&pool.jobs, ((ImportJob){ .file = file, .loc = t.loc }));
+	}
 
-	func->as.ret.expr = parse_expr(p, PARSE_EXPR_STMT);
-	return func;
+	da_free(&paths);
+	if (pool.jobs.count < 2) {
+		da_free(&pool.jobs);
+		return;
+	}
+
+	pthread_mutex_t cache_mtx;
+	pthread_mutex_init(&cache_mtx, NULL);
+	ic->lock = &cache_mtx;
+
+	size_t n = p->threads < pool.jobs.count ? p->threads : pool.jobs.count;
+	pthread_t *threads = malloc(n * sizeof(pthread_t));
+	size_t started = 0;
+	for (; started < n; started++)
+		if (pthread_create(&threads[started], NULL, parse_import_worker, &pool) != 0)
+			break;
+
+	if (!started) parse_import_worker(&pool);
+	for (size_t i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	ic->lock = NULL;
+	pthread_mutex_destroy(&cache_mtx);
+
+	da_foreach (ImportJob, job, &pool.jobs) {
+		da_foreach (Module*, it, &ic->mods)
+			if ((*it)->owner == job && (*it)->body)
+				parse_reintern(p->lexer.interns, (*it)->body);
+
+		interns_free(&job->interns);
+		arena_append(p->arena, &job->arena);
+	}
+	da_free(&pool.jobs);
 }
+#else
+void parse_imports_parallel(Parser *p) {
+	(void)p;
+}
+#endif
 
 AST *parse_body(Parser *p, bool isProg) {
 	bool is_arrow    = false;
 	bool is_arrow_eq = false;
 
-	AST *body = ast_alloc((AST){
+	AST *body = ast_alloc(p, (AST){
 		.kind = AST_BODY,
 		.loc = peek(p).loc,
 	});
@@ -697,6 +1006,7 @@ AST *parse_body(Parser *p, bool isProg) {
 		next(p);
 	}
 
+	size_t mark = p->scratch.count;
 	while ((!isProg && peek(p).kind != TOK_CBRA) ||
 		(isProg && peek(p).kind != TOK_EOF)) {
 		if (p->err_ctx.got_err) return NULL;
@@ -704,70 +1014,52 @@ AST *parse_body(Parser *p, bool isProg) {
 			case TOK_IMPORT: {
 				next(p);
 				expect(p, TOK_STRING);
-				Parser ip = {
-					.lexer = lexer_from_file(peek(p).data),
-					.err_ctx = p->err_ctx,
-				};
-
-				if (!ip.lexer.cur_char) {
-					parser_error(p, peek(p).loc, "no such file");
-					p->err_ctx.got_err = true;
-					return NULL;
-				}
-
-				AST *ib = parse_body(&ip, true);
-				if (ip.err_ctx.got_err) {
-					p->err_ctx.got_err = true;
-					return NULL;
-				}
+				if (p->err_ctx.got_err) return NULL;
 
-				da_foreach (AST*, it, &ib->as.body) {
-					da_append(&body->as.body, *it);
-					if (ip.err_ctx.got_err) {
-						p->err_ctx.got_err = true;
-						return NULL;
-					}
-				}
+				AST *ib = parse_import(p, parse_cstr(p, peek(p)), peek(p).loc);
+				if (p->err_ctx.got_err) return NULL;
 
+				da_foreach (AST*, it, &ib->as.body)
+					scratch_push(p, *it);
 				next(p);
 			} break;
 
 			case TOK_ID: {
 				if (peek2(p).kind == TOK_ASSIGN)
-					da_append(&body->as.body, parse_var_def_assign(p));
+					scratch_push(p, parse_var_def_assign(p));
 				else
-					da_append(&body->as.body, parse_var_mut(p, PARSE_EXPR_STMT));
+					scratch_push(p, parse_var_mut(p, PARSE_EXPR_STMT));
 			} break;
 
 			case TOK_FUNC: {
-				da_append(&body->as.body, parse_func_def(p));
+				scratch_push(p, parse_func_def(p));
 			} break;
 
 			case TOK_RET: {
-				da_append(&body->as.body, parse_func_ret(p));
+				scratch_push(p, parse_func_ret(p));
 			} break;
 
 			case TOK_IF_SYM: {
-				da_append(&body->as.body, parse_if_stmt(p));
+				scratch_push(p, parse_if_stmt(p));
 			} break;
 
 			case TOK_WHILE_SYM: {
-				da_append(&body->as.body, parse_while_stmt(p));
+				scratch_push(p, parse_while_stmt(p));
 			} break;
 
 			case TOK_FOR_SYM: {
-				da_append(&body->as.body, parse_for_stmt(p));
+				scratch_push(p, parse_for_stmt(p));
 			} break;
 
 			case TOK_BREAK: {
-				da_append(&body->as.body, ast_alloc((AST){
+				scratch_push(p, ast_alloc(p, (AST){
 					.kind = AST_BREAK,
 					.loc = next(p).loc
 				}));
 			} break;
 
 			case TOK_CONTINUE: {
-				da_append(&body->as.body, ast_alloc((AST){
+				scratch_push(p, ast_alloc(p, (AST){
 					.kind = AST_CONT,
 					.loc = next(p).loc
 				}));
@@ -779,36 +1071,51 @@ AST *parse_body(Parser *p, bool isProg) {
 					return NULL;
 				}
 
-				da_append(&body->as.body, parse_var_mut(p, PARSE_EXPR_STMT));
+				scratch_push(p, parse_var_mut(p, PARSE_EXPR_STMT));
 				if(p->err_ctx.got_err) return NULL;
 			}
 		}
 
 		if (is_arrow) break;
 		if (is_arrow_eq) {
-			AST *var_mut = da_last(&body->as.body);
+			AST *var_mut = da_last(&p->scratch);
 			if (var_mut->kind != AST_VAR_MUT) {
 				parser_error(p, var_mut->loc, "expression expected");
 				return NULL;
 			}
 
-			body->as.body.count = 0;
-			da_append(&body->as.body, ast_alloc((AST){
+			da_last(&p->scratch) = ast_alloc(p, (AST){
 				.kind = AST_RET,
 				.loc = body->loc,
 				.as.ret = var_mut->as.var_mut,
-			}));
+			});
 			break;
 		}
 
 		next(p);
 	}
 
+	body->as.body = ast_list_commit(p, mark);
 	return body;
 }
 
 AST *parse(Parser *p) {
-	AST *prog = ast_alloc((AST){.kind = AST_PROG});
+	if (!p->toks.items)
+		p->toks = lexer_tokenize(&p->lexer);
+
+	if (p->threads > 1)
+		parse_imports_parallel(p);
+
+	p->cur = 0;
+	AST *prog = ast_alloc(p, (AST){.kind = AST_PROG});
 	prog->as.prog.body = parse_body(p, true);
+	da_free(&p->scratch);
 	return prog;
 }
+
+void import_cache_free(ImportCache *ic) {
+	da_free(&ic->mods);
+	sources_free(&ic->srcs);
+	arena_free(&ic->arena);
+	interns_free(&ic->interns);
+}
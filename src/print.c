@@ -4,17 +4,21 @@
 #include "../include/parser.h"
 
 void lexer_print(Lexer l) {
-	while (lexer_peek(&l).kind) {
-		Token t = lexer_next(&l);
-		printf("%02i %s\n", t.kind, t.data);
+	Tokens toks = lexer_tokenize(&l);
+	da_foreach (Token, t, &toks) {
+		if (t->kind == TOK_EOF) break;
+		bool slice = t->kind == TOK_STRING || t->kind == TOK_INT || t->kind == TOK_FLOAT;
+		if (slice) printf("%02i %.*s\n", t->kind, (int)t->len, t->data);
+		else       printf("%02i %s\n", t->kind, t->data);
 	}
+	da_free(&toks);
 }
 
 void print_spaces(int spaces) {
 	for (int i = 0; i < spaces; i++) printf(" ");
 }
 
-void ast_print(AST *n, int spaces) {
+void ast_print(Sources *srcs, AST *n, int spaces) {
 	const int gap = 2;
 	print_spaces(spaces);
 
@@ -23,20 +27,21 @@ void ast_print(AST *n, int spaces) {
 		return;
 	}
 
-	size_t ln = n->loc.line_num + 1;
-	size_t lc = n->loc.line_char - n->loc.line_start + 1;
+	Location loc = source_loc(srcs, n->loc);
+	size_t ln = loc.line_num + 1;
+	size_t lc = loc.line_char - loc.line_start + 1;
 	printf("[%zu:%zu] ", ln, lc);
 
 	switch (n->kind) {
 		case AST_PROG: {
 			printf("prog:\n");
-			ast_print(n->as.prog.body, spaces + gap);
+			ast_print(srcs, n->as.prog.body, spaces + gap);
 		} break;
 
 		case AST_BODY: {
 			printf("body:\n");
 			da_foreach (AST*, it, &n->as.body)
-			ast_print(*it, spaces + gap);
+			ast_print(srcs, *it, spaces + gap);
 		} break;
 
 		case AST_LIT: {
@@ -54,7 +59,7 @@ void ast_print(AST *n, int spaces) {
 					break;
 
 				case LITERAL_STR:
-					printf("str(%s)\n", n->as.lit.as.vstr);
+					printf("str(%.*s)\n", (int)n->as.lit.as.vstr.count, n->as.lit.as.vstr.items);
 					break;
 			}
 		} break;
@@ -65,12 +70,12 @@ void ast_print(AST *n, int spaces) {
 
 		case AST_VAR_DEF: {
 			printf("var_def(%s):\n", n->as.var_def.id);
-			ast_print(n->as.var_def.expr, spaces + gap);
+			ast_print(srcs, n->as.var_def.expr, spaces + gap);
 		} break;
 
 		case AST_VAR_MUT: {
 			printf("var_mut:\n");
-			ast_print(n->as.var_mut, spaces + gap);
+			ast_print(srcs, n->as.var_mut, spaces + gap);
 		} break;
 
 		case AST_FUNC_DEF: {
@@ -81,7 +86,7 @@ void ast_print(AST *n, int spaces) {
 					printf(", ");
 			}
 			printf("):\n");
-			ast_print(n->as.func_def.body, spaces + gap);
+			ast_print(srcs, n->as.func_def.body, spaces + gap);
 		} break;
 
 		case AST_BIN_EXPR: {
@@ -97,8 +102,8 @@ void ast_print(AST *n, int spaces) {
 				bop == AST_OP_SUB    ? "-"  :
 				bop == AST_OP_MUL    ? "*"  :
 				bop == AST_OP_DIV    ? "/"  : "E");
-			ast_print(n->as.bin_expr.lhs, spaces + gap);
-			ast_print(n->as.bin_expr.rhs, spaces + gap);
+			ast_print(srcs, n->as.bin_expr.lhs, spaces + gap);
+			ast_print(srcs, n->as.bin_expr.rhs, spaces + gap);
 		} break;
 
 		case AST_UN_EXPR: {
@@ -106,63 +111,63 @@ void ast_print(AST *n, int spaces) {
 			printf("un_expr(%s):\n",
 				op == AST_OP_NOT    ? "!"  :
 				op == AST_OP_NEG    ? "-"  : "E");
-			ast_print(n->as.un_expr.v, spaces + gap);
+			ast_print(srcs, n->as.un_expr.v, spaces + gap);
 		} break;
 
 		case AST_RET: {
 			printf("return:\n");
-			ast_print(n->as.ret.expr, spaces + gap);
+			ast_print(srcs, n->as.ret.expr, spaces + gap);
 		} break;
 
 		case AST_FUNC_CALL: {
 			printf("func_call(%s):\n", n->as.func_call.id);
 			da_foreach (AST*, it, &n->as.func_call.args)
-			ast_print(*it, spaces + gap);
+			ast_print(srcs, *it, spaces + gap);
 		} break;
 
 		case AST_ST_IF: {
 			printf("st_if:\n");
-			ast_print(n->as.st_if_chain.cond, spaces + gap);
-			ast_print(n->as.st_if_chain.body, spaces + gap);
+			ast_print(srcs, n->as.st_if_chain.cond, spaces + gap);
+			ast_print(srcs, n->as.st_if_chain.body, spaces + gap);
 			if (n->as.st_if_chain.chain)
-				ast_print(n->as.st_if_chain.chain, spaces + gap);
+				ast_print(srcs, n->as.st_if_chain.chain, spaces + gap);
 		} break;
 
 		case AST_ST_ELSE: {
 			printf("st_else:\n");
-			ast_print(n->as.st_else.body, spaces + gap);
+			ast_print(srcs, n->as.st_else.body, spaces + gap);
 		} break;
 
 		case AST_ST_WHILE:{
 			printf("st_while:\n");
-			ast_print(n->as.st_while.cond, spaces + gap);
-			ast_print(n->as.st_while.body, spaces + gap);
+			ast_print(srcs, n->as.st_while.cond, spaces + gap);
+			ast_print(srcs, n->as.st_while.body, spaces + gap);
 		} break;
 
 		case AST_LIST: {
 			printf("list:\n");
 			da_foreach (AST*, it, &n->as.list)
-				ast_print(*it, spaces + gap);
+				ast_print(srcs, *it, spaces + gap);
 		} break;
 
 		case AST_DICT: {
 			printf("dict:\n");
 			da_foreach (AST*, it, &n->as.list)
-				ast_print(*it, spaces + gap);
+				ast_print(srcs, *it, spaces + gap);
 		} break;
 
 		case AST_ST_FOR: {
 			printf("for:\n");
-			ast_print(n->as.st_for.var, gap);
-			ast_print(n->as.st_for.cond, gap);
-			ast_print(n->as.st_for.mut, gap);
-			ast_print(n->as.st_for.body, gap);
+			ast_print(srcs, n->as.st_for.var, gap);
+			ast_print(srcs, n->as.st_for.cond, gap);
+			ast_print(srcs, n->as.st_for.mut, gap);
+			ast_print(srcs, n->as.st_for.body, gap);
 		} break;
 
 		case AST_ST_FOREACH: {
 			printf("foreach(%s):\n", n->as.st_foreach.var_id);
-			ast_print(n->as.st_foreach.coll, gap);
-			ast_print(n->as.st_foreach.body, gap);
+			ast_print(srcs, n->as.st_foreach.coll, gap);
+			ast_print(srcs, n->as.st_foreach.body, gap);
 		} break;
 
 		case AST_BREAK: {
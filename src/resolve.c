@@ -0,0 +1,355 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "../include/resolve.h"
+
+// A call returned from a function and the names of the function's frame
+// where it is made, which are tail_ids[start..end) of the resolver.
+typedef struct {
+	AST *call;
+	size_t start, end;
+} ResolveTail;
+
+// Mirrors the eval stack of the function being resolved: every var def,
+// fn def, parameter and loop variable pushes exactly one symbol, bodies
+// and loops drop theirs when they end.
+typedef struct {
+	DA(char*) ids;
+	size_t frame;
+	bool shared;
+	// Inside a module, whose function bodies are bound as well but may
+	// be run by other programs, so their calls get no site.
+	bool imported;
+	bool in_func;
+	// Every name a variable takes, shared code included, and the calls
+	// left to be looked up by name.
+	DA(char*) var_ids;
+	DA(AST*) calls;
+	// Every name vars and calls look up by name, shared code included,
+	// and the calls functions of the program return.
+	DA(char*) free_ids;
+	DA(ResolveTail) tails;
+	DA(char*) tail_ids;
+} Resolver;
+
+void resolve_node(Resolver *r, AST *n);
+
+void resolve_ref(Resolver *r, AST *n, char *id) {
+	if (r->shared) return;
+
+	n->slot = 0;
+	for (size_t i = r->ids.count; i > r->frame; i--) {
+		if (r->ids.items[i - 1] == id) {
+			n->slot = i - r->frame;
+			return;
+		}
+	}
+}
+
+void resolve_list(Resolver *r, ASTs *list) {
+	da_foreach (AST*, it, list)
+		resolve_node(r, *it);
+}
+
+// Function bodies get their own frame, starting with the parameters that
+// a call binds: the ones before the variadic one, then _VA_ARGS_.
+void resolve_func(Resolver *r, AST *n) {
+	size_t frame = r->frame, count = r->ids.count;
+	bool shared = r->shared, in_func = r->in_func;
+	r->frame = count;
+	r->shared = false;
+	r->in_func = true;
+
+	da_foreach (AST*, arg, &n->as.func_def.args) {
+		da_append(&r->ids, (*arg)->as.var);
+		da_append(&r->var_ids, (*arg)->as.var);
+		if ((*arg)->kind == AST_VAR_ANY) break;
+	}
+
+	resolve_node(r, n->as.func_def.body);
+	r->ids.count = count;
+	r->frame = frame;
+	r->shared = shared;
+	r->in_func = in_func;
+}
+
+// Imports splice the statements of a module, which may be shared with
+// other importers, into the body. Their symbols still take slots here,
+// but they are not bound themselves. Functions defined at the top level
+// go to the globals and take no slot.
+void resolve_body(Resolver *r, AST *n, bool top) {
+	size_t count = r->ids.count;
+	bool shared = r->shared, imported = r->imported;
+	da_foreach (AST*, st, &n->as.body) {
+		if (*st == NULL) continue;
+		r->shared = shared || (*st)->loc.src != n->loc.src;
+		r->imported = imported || (*st)->loc.src != n->loc.src;
+		if (top && (*st)->kind == AST_FUNC_DEF) resolve_func(r, *st);
+		else resolve_node(r, *st);
+	}
+
+	r->shared = shared;
+	r->imported = imported;
+	r->ids.count = count;
+}
+
+bool resolve_assigns_list(ASTs *list, char *id);
+
+// Whether n assigns id anywhere, nested function bodies included.
+bool resolve_assigns(AST *n, char *id) {
+	if (!n) return false;
+
+	switch (n->kind) {
+		case AST_PROG:         return resolve_assigns(n->as.prog.body, id);
+		case AST_BODY:         return resolve_assigns_list(&n->as.body, id);
+		case AST_VAR_DEF:      return resolve_assigns(n->as.var_def.expr, id);
+		case AST_VAR_MUT:      return resolve_assigns(n->as.var_mut, id);
+		case AST_LIST:         return resolve_assigns_list(&n->as.list, id);
+		case AST_DICT:         return resolve_assigns_list(&n->as.dict, id);
+		case AST_FUNC_DEF:     return resolve_assigns(n->as.func_def.body, id);
+		case AST_FUNC_CALL:    return resolve_assigns_list(&n->as.func_call.args, id);
+		case AST_UN_EXPR:      return resolve_assigns(n->as.un_expr.v, id);
+		case AST_RET:          return resolve_assigns(n->as.ret.expr, id);
+		case AST_ST_ELSE:      return resolve_assigns(n->as.st_else.body, id);
+
+		case AST_ST_WHILE:
+			return resolve_assigns(n->as.st_while.cond, id) ||
+				resolve_assigns(n->as.st_while.body, id);
+
+		case AST_ST_IF:
+			return resolve_assigns(n->as.st_if_chain.cond, id) ||
+				resolve_assigns(n->as.st_if_chain.body, id) ||
+				resolve_assigns(n->as.st_if_chain.chain, id);
+
+		case AST_ST_FOR:
+			return resolve_assigns(n->as.st_for.var, id) ||
+				resolve_assigns(n->as.st_for.cond, id) ||
+				resolve_assigns(n->as.st_for.mut, id) ||
+				resolve_assigns(n->as.st_for.body, id);
+
+		case AST_ST_FOREACH:
+			return n->as.st_foreach.var_id == id ||
+				resolve_assigns(n->as.st_foreach.coll, id) ||
+				resolve_assigns(n->as.st_foreach.body, id);
+
+		case AST_BIN_EXPR: {
+			AST *lhs = n->as.bin_expr.lhs;
+			switch (n->as.bin_expr.op) {
+				case AST_OP_EQ:
+				case AST_OP_ADD_EQ:
+				case AST_OP_SUB_EQ:
+				case AST_OP_MUL_EQ:
+				case AST_OP_DIV_EQ:
+					if (lhs->kind == AST_VAR && lhs->as.var == id) return true;
+					break;
+				default:;
+			}
+
+			return resolve_assigns(lhs, id) || resolve_assigns(n->as.bin_expr.rhs, id);
+		}
+
+		default: return false;
+	}
+}
+
+bool resolve_assigns_list(ASTs *list, char *id) {
+	da_foreach (AST*, it, list)
+		if (resolve_assigns(*it, id)) return true;
+	return false;
+}
+
+// for i := a; i < b; i += c, or i -= c, any comparison and i = a on a
+// variable of the frame, whose body does not assign i.
+bool resolve_counted(AST *n) {
+	AST *var = n->as.st_for.var, *cond = n->as.st_for.cond, *mut = n->as.st_for.mut;
+	char *id;
+
+	if (var->kind == AST_VAR_DEF) {
+		id = var->as.var_def.id;
+	} else {
+		AST *set = var->as.var_mut;
+		if (set->kind != AST_BIN_EXPR || set->as.bin_expr.op != AST_OP_EQ) return false;
+		if (set->as.bin_expr.lhs->kind != AST_VAR || !set->as.bin_expr.lhs->slot) return false;
+		id = set->as.bin_expr.lhs->as.var;
+	}
+
+	if (cond->kind != AST_BIN_EXPR) return false;
+	switch (cond->as.bin_expr.op) {
+		case AST_OP_LESS:
+		case AST_OP_LESS_EQ:
+		case AST_OP_GREAT:
+		case AST_OP_GREAT_EQ:
+			break;
+		default: return false;
+	}
+
+	AST *i = cond->as.bin_expr.lhs;
+	if (i->kind != AST_VAR || i->as.var != id) return false;
+
+	AST *step = mut->as.var_mut;
+	if (step->kind != AST_BIN_EXPR) return false;
+	if (step->as.bin_expr.op != AST_OP_ADD_EQ && step->as.bin_expr.op != AST_OP_SUB_EQ) return false;
+	i = step->as.bin_expr.lhs;
+	if (i->kind != AST_VAR || i->as.var != id) return false;
+
+	return !resolve_assigns(n->as.st_for.body, id);
+}
+
+void resolve_node(Resolver *r, AST *n) {
+	if (!n) return;
+
+	switch (n->kind) {
+		case AST_PROG:
+			resolve_body(r, n->as.prog.body, true);
+			break;
+
+		case AST_BODY:
+			resolve_body(r, n, false);
+			break;
+
+		case AST_VAR_DEF:
+			resolve_node(r, n->as.var_def.expr);
+			da_append(&r->ids, n->as.var_def.id);
+			da_append(&r->var_ids, n->as.var_def.id);
+			break;
+
+		case AST_FUNC_DEF:
+			da_append(&r->ids, n->as.func_def.id);
+			resolve_func(r, n);
+			break;
+
+		case AST_VAR:
+			resolve_ref(r, n, n->as.var);
+			if (!n->slot) da_append(&r->free_ids, n->as.var);
+			break;
+
+		case AST_FUNC_CALL:
+			resolve_list(r, &n->as.func_call.args);
+			resolve_ref(r, n, n->as.func_call.id);
+			if (!n->slot) da_append(&r->free_ids, n->as.func_call.id);
+			if (!r->imported) {
+				n->as.func_call.site = 0;
+				n->as.func_call.tail = false;
+				if (!n->slot) da_append(&r->calls, n);
+			}
+			break;
+
+		case AST_ST_FOR: {
+			size_t count = r->ids.count;
+			resolve_node(r, n->as.st_for.var);
+			resolve_node(r, n->as.st_for.cond);
+			resolve_node(r, n->as.st_for.body);
+			resolve_node(r, n->as.st_for.mut);
+			if (!r->shared) n->as.st_for.counted = resolve_counted(n);
+			r->ids.count = count;
+		} break;
+
+		case AST_ST_FOREACH: {
+			size_t count = r->ids.count;
+			resolve_node(r, n->as.st_foreach.coll);
+			da_append(&r->ids, n->as.st_foreach.var_id);
+			da_append(&r->var_ids, n->as.st_foreach.var_id);
+			resolve_node(r, n->as.st_foreach.body);
+			r->ids.count = count;
+		} break;
+
+		case AST_ST_WHILE:
+			resolve_node(r, n->as.st_while.cond);
+			resolve_node(r, n->as.st_while.body);
+			break;
+
+		case AST_ST_IF:
+			resolve_node(r, n->as.st_if_chain.cond);
+			resolve_node(r, n->as.st_if_chain.body);
+			resolve_node(r, n->as.st_if_chain.chain);
+			break;
+
+		case AST_ST_ELSE:
+			resolve_node(r, n->as.st_else.body);
+			break;
+
+		case AST_BIN_EXPR:
+			resolve_node(r, n->as.bin_expr.lhs);
+			resolve_node(r, n->as.bin_expr.rhs);
+			break;
+
+		case AST_UN_EXPR:
+			resolve_node(r, n->as.un_expr.v);
+			break;
+
+		case AST_LIST:
+			resolve_list(r, &n->as.list);
+			break;
+
+		case AST_DICT:
+			resolve_list(r, &n->as.dict);
+			break;
+
+		case AST_RET:
+			resolve_node(r, n->as.ret.expr);
+			if (!r->imported && r->in_func && n->as.ret.expr &&
+				n->as.ret.expr->kind == AST_FUNC_CALL) {
+				size_t start = r->tail_ids.count;
+				for (size_t i = r->frame; i < r->ids.count; i++)
+					da_append(&r->tail_ids, r->ids.items[i]);
+				da_append(&r->tails, ((ResolveTail){n->as.ret.expr, start, r->tail_ids.count}));
+			}
+			break;
+
+		case AST_VAR_MUT:
+			resolve_node(r, n->as.var_mut);
+			break;
+
+		default:;
+	}
+}
+
+int resolve_cmp_ids(const void *a, const void *b) {
+	uintptr_t x = (uintptr_t)*(char**)a, y = (uintptr_t)*(char**)b;
+	return (x > y) - (x < y);
+}
+
+// A variable named like the callee would make the call fail, which a
+// cached callee would hide, so those calls keep the lookup.
+void resolve_sites(Resolver *r, AST *prog) {
+	if (r->var_ids.count)
+		qsort(r->var_ids.items, r->var_ids.count, sizeof(char*), resolve_cmp_ids);
+
+	prog->as.prog.sites = 0;
+	da_foreach (AST*, call, &r->calls) {
+		char *id = (*call)->as.func_call.id;
+		bool shadowed = r->var_ids.count &&
+			bsearch(&id, r->var_ids.items, r->var_ids.count, sizeof(char*), resolve_cmp_ids);
+		if (!shadowed) (*call)->as.func_call.site = ++prog->as.prog.sites;
+	}
+}
+
+// Scoping is dynamic, a callee sees the locals of its callers. Running
+// a returned call in place of the frame of the function returning it
+// only keeps that when none of the frame's names are looked up by name.
+void resolve_tails(Resolver *r) {
+	if (r->free_ids.count)
+		qsort(r->free_ids.items, r->free_ids.count, sizeof(char*), resolve_cmp_ids);
+
+	da_foreach (ResolveTail, t, &r->tails) {
+		bool seen = false;
+		for (size_t i = t->start; i < t->end && !seen; i++) {
+			seen = r->free_ids.count &&
+				bsearch(&r->tail_ids.items[i], r->free_ids.items, r->free_ids.count, sizeof(char*), resolve_cmp_ids);
+		}
+
+		t->call->as.func_call.tail = !seen;
+	}
+}
+
+void resolve(AST *prog) {
+	Resolver r = {0};
+	resolve_node(&r, prog);
+	resolve_sites(&r, prog);
+	resolve_tails(&r);
+	da_free(&r.ids);
+	da_free(&r.var_ids);
+	da_free(&r.calls);
+	da_free(&r.free_ids);
+	da_free(&r.tails);
+	da_free(&r.tail_ids);
+}
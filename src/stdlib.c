@@ -13,11 +13,11 @@ do { \
 } while(0)
 
 void val_sprint_f(Val v, char *buf, int depth) {
-	switch (v.kind) {
-		case VAL_NONE:  sprintf(buf, "none");                 break;
-		case VAL_INT:   sprintf(buf, "%lli", v.as.vint);      break;
-		case VAL_FLOAT: sprintf(buf, "%lf", v.as.vfloat);     break;
-		case VAL_BOOL:  sprintf(buf, "%s", bstr(v.as.vbool)); break;
+	switch (VKIND(v)) {
+		case VAL_NONE:  sprintf(buf, "none");                break;
+		case VAL_INT:   sprintf(buf, "%lli", VINT(v));       break;
+		case VAL_FLOAT: sprintf(buf, "%lf", VFLOAT(v));      break;
+		case VAL_BOOL:  sprintf(buf, "%s", bstr(VBOOL(v)));  break;
 
 		case VAL_STR:
 			if (depth == 0)
@@ -30,10 +30,10 @@ void val_sprint_f(Val v, char *buf, int depth) {
 			StringBuilder sb = {0};
 			sb_appendf(&sb, "[");
 
-			da_foreach (Val, it, VLIST(v)) {
-				char buf[1024]; val_sprint_f(*it, buf, depth + 1);
+			for (size_t i = 0; i < VLIST(v)->count; i++) {
+				char buf[1024]; val_sprint_f(val_list_at(v, i), buf, depth + 1);
 				sb_appendf(&sb, "%s", buf);
-				if (it - VLIST(v)->items != VLIST(v)->count - 1)
+				if (i != VLIST(v)->count - 1)
 					sb_appendf(&sb, ", ", buf);
 			}
 
@@ -74,22 +74,16 @@ Val Int(EvalCtx *ctx, Location call_loc, Vals args) {
 		err(ctx, call_loc, "int() accepts only 1 argument");
 
 	Val arg = args.items[0];
-	switch (arg.kind) {
+	switch (VKIND(arg)) {
 		case VAL_INT:
 			return arg;
 
 		case VAL_FLOAT:
-			return (Val){
-				.kind = VAL_INT,
-				.as.vint = (long long) arg.as.vfloat
-			};
+			return val_int(ctx, (long long) VFLOAT(arg));
 
 		case VAL_STR: {
 			char *end;
-			return (Val){
-				.kind = VAL_INT,
-				.as.vint = strtoll(VSTR(arg)->items, &end, 10),
-			};
+			return val_int(ctx, strtoll(VSTR(arg)->items, &end, 10));
 		}
 
 		default: err(ctx, call_loc, "cannot convert to int");
@@ -105,17 +99,14 @@ Val Float(EvalCtx *ctx, Location call_loc, Vals args) {
 	double res;
 	char *end;
 
-	switch (arg.kind) {
-		case VAL_FLOAT: res = arg.as.vfloat;                  break;
-		case VAL_INT:   res = arg.as.vint;                    break;
+	switch (VKIND(arg)) {
+		case VAL_FLOAT: res = VFLOAT(arg);                    break;
+		case VAL_INT:   res = VINT(arg);                      break;
 		case VAL_STR:   res = strtod(VSTR(arg)->items, &end); break;
 		default:        err(ctx, call_loc, "cannot convert to float");
 	}
 
-	return (Val){
-		.kind = VAL_FLOAT,
-		.as.vfloat = res, 
-	};
+	return val_float(res);
 }
 
 Val Len(EvalCtx *ctx, Location call_loc, Vals args) {
@@ -125,17 +116,14 @@ Val Len(EvalCtx *ctx, Location call_loc, Vals args) {
 	Val arg = args.items[0];
 	long long len = 0;
 
-	switch (arg.kind) {
+	switch (VKIND(arg)) {
 		case VAL_LIST: len = VLIST(arg)->count; break;
 		case VAL_DICT: len = VDICT(arg)->count; break;
 		case VAL_STR:  len = VSTR(arg)->count;  break;
 		default: err(ctx, call_loc, "len() accepts only lists, strings and dictionaries");
 	}
 
-	return (Val){
-		.kind = VAL_INT,
-		.as.vint = len,
-	};
+	return val_int(ctx, len);
 }
 
 Val Str(EvalCtx *ctx, Location call_loc, Vals args) {
@@ -153,7 +141,7 @@ Val Str(EvalCtx *ctx, Location call_loc, Vals args) {
 Val Error(EvalCtx *ctx, Location call_loc, Vals args) {
 	if (args.count != 1)
 		err(ctx, call_loc, "error() accepts only 1 argument");
-	if (args.items[0].kind != VAL_STR)
+	if (VKIND(args.items[0]) != VAL_STR)
 		err(ctx, call_loc, "error() accepts only string");
 
 	err(ctx, call_loc, VSTR(args.items[0])->items);
@@ -177,7 +165,7 @@ Val Println(EvalCtx *ctx, Location call_loc, Vals args) {
 }
 
 Val Input(EvalCtx *ctx, Location call_loc, Vals args) {
-	if (args.items[0].kind != VAL_STR)
+	if (VKIND(args.items[0]) != VAL_STR)
 		err(ctx, call_loc, "input() accepts only string");
 
 	char res[1024];
@@ -194,14 +182,14 @@ Val Append(EvalCtx *ctx, Location call_loc, Vals args) {
 	if (args.count < 2)
 		err(ctx, call_loc, "append() accepts more than 1 arguments");
 
-	if (args.items[0].kind == VAL_LIST) {
-		Vals *list = VLIST(args.items[0]);
+	if (VKIND(args.items[0]) == VAL_LIST) {
+		Vals *list = val_list(args.items[0]);
 		for (size_t i = 1; i < args.count; i++)
 			da_append(list, args.items[i]);
-	} else if (args.items[0].kind == VAL_STR) {
+	} else if (VKIND(args.items[0]) == VAL_STR) {
 		StringBuilder *str = VSTR(args.items[0]);
 		for (size_t i = 1; i < args.count; i++) {
-			if (args.items[i].kind != VAL_STR)
+			if (VKIND(args.items[i]) != VAL_STR)
 				err(ctx, call_loc, "append() accepts only strings for string appending");
 			sb_appendf(str, "%s", VSTR(args.items[i])->items);
 		}
@@ -215,14 +203,14 @@ Val Remove(EvalCtx *ctx, Location call_loc, Vals args) {
 		goto error;
 
 	Val list = args.items[0];
-	if (list.kind != VAL_LIST)
+	if (VKIND(list) != VAL_LIST)
 		goto error;
 
 	Val ind = args.items[1];
-	if (ind.kind != VAL_INT)
+	if (VKIND(ind) != VAL_INT)
 		goto error;
 
-	da_remove_ordered(VLIST(list), ind.as.vint);
+	da_remove_ordered(val_list(list), VINT(ind));
 	return VNONE;
 
 error:
@@ -241,31 +229,40 @@ Val Range(EvalCtx *ctx, Location call_loc, Vals args) {
 	}
 
 	da_foreach (Val, val, &args) {
-		if (val->kind != VAL_INT) {
+		if (VKIND(*val) != VAL_INT) {
 			err(ctx, call_loc, "range() accepts only integers");
 			return VNONE;
 		}
 	}
 
 	if (args.count == 1) {
-		to = args.items[0].as.vint;
+		to = VINT(args.items[0]);
 	} else if (args.count == 2) {
-		from = args.items[0].as.vint;
-		to = args.items[1].as.vint;
+		from = VINT(args.items[0]);
+		to = VINT(args.items[1]);
 	} else if (args.count == 3) {
-		from = args.items[0].as.vint;
-		to = args.items[1].as.vint;
-		step = args.items[2].as.vint;
+		from = VINT(args.items[0]);
+		to = VINT(args.items[1]);
+		step = VINT(args.items[2]);
 	}
 
+	size_t count = 0;
+	if (step > 0 && from < to)
+		count = ((unsigned long long)to - from - 1) / step + 1;
+	else if (step < 0 && from > to)
+		count = ((unsigned long long)from - to - 1) / (0ull - step) + 1;
+	else if (step == 0 && from > to)
+		err(ctx, call_loc, "range() never ends with a step of 0");
+
+	// The list is only made when something needs its items, unless they
+	// are ints too wide to be made without a context.
+	long long last = INT_WRAP(from, +, INT_WRAP(count - 1, *, step));
+	if (count == 0 || (VAL_INT_FITS(from) && VAL_INT_FITS(last)))
+		return eval_new_range(ctx, from, step, count);
+
 	Val list = eval_new_heap_val(ctx, VAL_LIST);
-	if (step > 0) {
-		for (long long i = from; i < to; i += step)
-			da_append(VLIST(list), ((Val){ .kind = VAL_INT, .as.vint = i }));
-	} else {
-		for (long long i = from; i > to; i += step)
-			da_append(VLIST(list), ((Val){ .kind = VAL_INT, .as.vint = i }));
-	}
+	for (size_t i = 0; i < count; i++)
+		da_append(VLIST(list), val_int(ctx, INT_WRAP(from, +, INT_WRAP(i, *, step))));
 
 	return list;
 }
@@ -274,18 +271,18 @@ Val Insert(EvalCtx *ctx, Location call_loc, Vals args) {
 	if (args.count != 3)
 		goto error;
 
-	if (args.items[0].kind != VAL_LIST)
+	if (VKIND(args.items[0]) != VAL_LIST)
 		goto error;
 
-	Vals *list = VLIST(args.items[0]);
+	Vals *list = val_list(args.items[0]);
 	Val ind = args.items[1];
-	if (ind.kind != VAL_INT)
+	if (VKIND(ind) != VAL_INT)
 		goto error;
 
 	Val val = args.items[2];
 
-	if (val.kind != VAL_INT) goto error;
-	da_insert(list, ind.as.vint, val);
+	if (VKIND(val) != VAL_INT) goto error;
+	da_insert(list, VINT(ind), val);
 	return VNONE;
 
 error:
@@ -296,10 +293,23 @@ Val Kind(EvalCtx *ctx, Location call_loc, Vals args) {
 	if (args.count != 1)
 		err(ctx, call_loc, "kind() accepts only 1 argument");
 
-	return (Val){
-		.kind = VAL_INT,
-		.as.vint = args.items[0].kind,
-	};
+	return val_int(ctx, VKIND(args.items[0]));
+}
+
+// Whether key is one of the ints of a lazy range, which are not made for
+// it. The distance to start is taken modulo 2^64, which no int of the
+// range is that far from.
+bool range_has(ValRange *r, Val key) {
+	if (VKIND(key) != VAL_INT || r->list.count == 0) return false;
+
+	unsigned long long d = (unsigned long long)VINT(key) - r->start;
+	unsigned long long step = r->step;
+	if (r->step < 0) {
+		d = 0ull - d;
+		step = 0ull - step;
+	}
+
+	return d % step == 0 && d / step < r->list.count;
 }
 
 Val Has(EvalCtx *ctx, Location call_loc, Vals args) {
@@ -308,11 +318,13 @@ Val Has(EvalCtx *ctx, Location call_loc, Vals args) {
 
 	bool res = false;
 
-	if (args.items[0].kind == VAL_DICT) {
+	if (VKIND(args.items[0]) == VAL_DICT) {
 		ValDict *dict = VDICT(args.items[0]);
 		Val key = args.items[1];
 		res = ValDict_get(dict, key) != NULL;
-	} else if (args.items[0].kind == VAL_LIST) {
+	} else if (VKIND(args.items[0]) == VAL_LIST && VOBJ(args.items[0])->lazy) {
+		res = range_has(VOBJ(args.items[0])->data, args.items[1]);
+	} else if (VKIND(args.items[0]) == VAL_LIST) {
 		Vals *list = VLIST(args.items[0]);
 		Val key = args.items[1];
 		da_foreach (Val, v, list) {
@@ -323,10 +335,7 @@ Val Has(EvalCtx *ctx, Location call_loc, Vals args) {
 		}
 	} else goto error;
 
-	return (Val){
-		.kind = VAL_BOOL,
-		.as.vbool = res,
-	};
+	return val_bool(res);
 
 error:
 	err(ctx, call_loc, "has() accepts: dictionary or list, item");
@@ -334,13 +343,13 @@ error:
 }
 
 void reg_kinds(EvalCtx *ctx) {
-	eval_reg_var(ctx, "_VAL_NONE_",  (Val){.kind = VAL_INT, .as.vint = VAL_NONE});
-	eval_reg_var(ctx, "_VAL_INT_",   (Val){.kind = VAL_INT, .as.vint = VAL_INT});
-	eval_reg_var(ctx, "_VAL_BOOL_",  (Val){.kind = VAL_INT, .as.vint = VAL_BOOL});
-	eval_reg_var(ctx, "_VAL_FLOAT_", (Val){.kind = VAL_INT, .as.vint = VAL_FLOAT});
-	eval_reg_var(ctx, "_VAL_LIST_",  (Val){.kind = VAL_INT, .as.vint = VAL_LIST});
-	eval_reg_var(ctx, "_VAL_DICT_",  (Val){.kind = VAL_INT, .as.vint = VAL_DICT});
-	eval_reg_var(ctx, "_VAL_STR_",   (Val){.kind = VAL_INT, .as.vint = VAL_STR});
+	eval_reg_var(ctx, "_VAL_NONE_",  val_int(ctx, VAL_NONE));
+	eval_reg_var(ctx, "_VAL_INT_",   val_int(ctx, VAL_INT));
+	eval_reg_var(ctx, "_VAL_BOOL_",  val_int(ctx, VAL_BOOL));
+	eval_reg_var(ctx, "_VAL_FLOAT_", val_int(ctx, VAL_FLOAT));
+	eval_reg_var(ctx, "_VAL_LIST_",  val_int(ctx, VAL_LIST));
+	eval_reg_var(ctx, "_VAL_DICT_",  val_int(ctx, VAL_DICT));
+	eval_reg_var(ctx, "_VAL_STR_",   val_int(ctx, VAL_STR));
 }
 
 void reg_stdlib(EvalCtx *ctx) {
@@ -0,0 +1,570 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/vm.h"
+
+// Threaded dispatch ends every handler with its own indirect jump to the
+// next one instead of going back to a shared switch. -DNO_COMPUTED_GOTO
+// builds the portable switch on compilers that have it too.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define HAS_COMPUTED_GOTO
+#endif
+
+#ifdef VM_STATS
+// Built with -DVM_STATS the vm counts which opcode follows which and
+// prints the most frequent pairs at exit, the superinstructions are
+// picked from them. The counts are shared by all threads.
+u64 vm_pairs[OP_COUNT][OP_COUNT];
+
+const char *vm_op_names[OP_COUNT] = {
+	#define X(op) [op] = #op,
+	VM_OPS(X)
+	#undef X
+};
+
+void vm_print_stats(void) {
+	fprintf(stderr, "most frequent opcode pairs:\n");
+	for (size_t n = 0; n < 24; n++) {
+		size_t a = 0, b = 0;
+		for (size_t i = 0; i < OP_COUNT; i++)
+			for (size_t j = 0; j < OP_COUNT; j++)
+				if (vm_pairs[i][j] > vm_pairs[a][b]) a = i, b = j;
+
+		if (!vm_pairs[a][b]) break;
+		fprintf(stderr, "%14llu %s %s\n",
+			(unsigned long long)vm_pairs[a][b], vm_op_names[a], vm_op_names[b]);
+		vm_pairs[a][b] = 0;
+	}
+}
+
+#define VM_COUNT(op) (vm_pairs[prev][op]++, prev = (op))
+#else
+#define VM_COUNT(op)
+#endif
+
+#ifdef HAS_COMPUTED_GOTO
+#define VM_CASE(op) L_##op
+#define VM_NEXT() do { in = *pc++; VM_COUNT(in.op); goto *vm_labels[in.op]; } while (0)
+#else
+#define VM_CASE(op) case op
+#define VM_NEXT() continue
+#endif
+
+// What a call saves to resume its caller.
+typedef struct {
+	Chunk *ch;
+	Instr *pc;
+	size_t rbase;
+	size_t frame;
+	size_t base;
+	u16 dst;
+} VmFrame;
+
+#define IS_NUM(v) (VKIND(v) == VAL_INT || VKIND(v) == VAL_FLOAT)
+#define NUM(v) (VKIND(v) == VAL_INT ? (double)VINT(v) : VFLOAT(v))
+
+// Numbers are compared here without going through eval_binop_vals, the
+// same way it compares them. -1 when the operands or op are anything else.
+static inline int vm_cmp(AST_Op op, Val lv, Val rv) {
+	if (VKIND(lv) == VAL_INT && VKIND(rv) == VAL_INT) {
+		long long l = VINT(lv), r = VINT(rv);
+		switch (op) {
+			case AST_OP_IS_EQ:    return l == r;
+			case AST_OP_NOT_EQ:   return l != r;
+			case AST_OP_GREAT:    return l >  r;
+			case AST_OP_GREAT_EQ: return l >= r;
+			case AST_OP_LESS:     return l <  r;
+			case AST_OP_LESS_EQ:  return l <= r;
+			default:              return -1;
+		}
+	}
+
+	if (!IS_NUM(lv) || !IS_NUM(rv)) return -1;
+	double l = NUM(lv), r = NUM(rv);
+	switch (op) {
+		case AST_OP_IS_EQ:    return l == r;
+		case AST_OP_NOT_EQ:   return l != r;
+		case AST_OP_GREAT:    return l >  r;
+		case AST_OP_GREAT_EQ: return l >= r;
+		case AST_OP_LESS:     return l <  r;
+		case AST_OP_LESS_EQ:  return l <= r;
+		default:              return -1;
+	}
+}
+
+// Arithmetic on two numbers, false leaves it to eval_binop_vals. Int
+// modulo by zero is left to it as well.
+static inline bool vm_arith(EvalCtx *ctx, AST_Op op, Val lv, Val rv, Val *out) {
+	if (VKIND(lv) == VAL_INT && VKIND(rv) == VAL_INT) {
+		long long l = VINT(lv), r = VINT(rv);
+		switch (op) {
+			case AST_OP_ADD: *out = val_int(ctx, INT_WRAP(l, +, r)); return true;
+			case AST_OP_SUB: *out = val_int(ctx, INT_WRAP(l, -, r)); return true;
+			case AST_OP_MUL: *out = val_int(ctx, INT_WRAP(l, *, r)); return true;
+			case AST_OP_DIV: *out = val_float((double)l / (double)r); return true;
+			case AST_OP_MOD:
+				if (!r) return false;
+				*out = val_int(ctx, r == -1 ? 0 : l % r);
+				return true;
+			default: break;
+		}
+	} else if (IS_NUM(lv) && IS_NUM(rv)) {
+		double l = NUM(lv), r = NUM(rv);
+		switch (op) {
+			case AST_OP_ADD: *out = val_float(l + r); return true;
+			case AST_OP_SUB: *out = val_float(l - r); return true;
+			case AST_OP_MUL: *out = val_float(l * r); return true;
+			case AST_OP_DIV: *out = val_float(l / r); return true;
+			default: break;
+		}
+	}
+
+	int cmp = vm_cmp(op, lv, rv);
+	if (cmp < 0) return false;
+	*out = val_bool(cmp);
+	return true;
+}
+
+// Registers of a frame are cleared when it is entered, the gc marks all
+// of ctx->regs and must not see values a returned frame left behind.
+Val *vm_enter(EvalCtx *ctx, size_t rbase, size_t nregs) {
+	da_reserve(&ctx->regs, rbase + nregs);
+	ctx->regs.count = rbase + nregs;
+	memset(ctx->regs.items + rbase, 0, nregs * sizeof(Val));
+	return ctx->regs.items + rbase;
+}
+
+Val vm_run(EvalCtx *ctx, VmProg *vp) {
+	DA(VmFrame) frames = {0};
+	size_t regs_count = ctx->regs.count;
+	size_t temps = ctx->temps.count;
+	size_t frame = ctx->stack.count;
+	Val res = VNONE;
+
+	Chunk *ch = vp->chunks.items[0];
+	Instr *pc = ch->code.items;
+	Instr in, *bin;
+	Val lv, rv;
+	size_t rbase = regs_count;
+	Val *R = vm_enter(ctx, rbase, ch->nregs);
+	ctx->frame = frame;
+
+#ifdef VM_STATS
+	static bool registered;
+	if (!registered) atexit(vm_print_stats);
+	registered = true;
+	u8 prev = OP_RETNONE;
+#endif
+
+	#define NODE (ch->nodes.items[pc - 1 - ch->code.items])
+	#define NODE_AT(p) (ch->nodes.items[(p) - ch->code.items])
+	#define FAIL_IF_ERR() if (ctx->err_ctx.got_err) goto fail
+	#define LOCAL(v, p) do { \
+		EvalSymbol *es = &ctx->stack.items[ctx->frame + (p)->b]; \
+		if (es->kind != EVAL_SYMB_VAR) { \
+			eval_error(ctx, NODE_AT(p)->loc, "no such variable"); \
+			goto fail; \
+		} \
+		v = es->as.var.val; \
+	} while (0)
+
+#ifdef HAS_COMPUTED_GOTO
+	static void *vm_labels[OP_COUNT] = {
+		#define X(op) [op] = &&L_##op,
+		VM_OPS(X)
+		#undef X
+	};
+
+	VM_NEXT();
+#else
+	for (;;) {
+	in = *pc++;
+	VM_COUNT(in.op);
+	switch (in.op) {
+#endif
+
+	VM_CASE(OP_LOADK):
+		R[in.a] = ch->consts.items[in.b];
+		VM_NEXT();
+
+	VM_CASE(OP_LOADNONE):
+		R[in.a] = VNONE;
+		VM_NEXT();
+
+	VM_CASE(OP_MOVE):
+		R[in.a] = R[in.b];
+		VM_NEXT();
+
+	VM_CASE(OP_EVAL): {
+		Val v = eval(ctx, NODE);
+		FAIL_IF_ERR();
+		R[in.a] = v;
+		ctx->temps.count = temps;
+	} VM_NEXT();
+
+	VM_CASE(OP_GETLOCAL):
+		LOCAL(R[in.a], pc - 1);
+		VM_NEXT();
+
+	VM_CASE(OP_GETNAME): {
+		EvalSymbol *es = eval_lookup(ctx, ch->names.items[in.b]);
+		if (!es) {
+			eval_error(ctx, NODE->loc, "no such symbol");
+			goto fail;
+		} else if (es->kind != EVAL_SYMB_VAR) {
+			eval_error(ctx, NODE->loc, "no such variable");
+			goto fail;
+		}
+
+		R[in.a] = es->as.var.val;
+	} VM_NEXT();
+
+	VM_CASE(OP_SETLOCAL):
+	VM_CASE(OP_SETNAME): {
+		EvalSymbol *es = in.op == OP_SETLOCAL
+			? &ctx->stack.items[ctx->frame + in.b]
+			: eval_lookup(ctx, ch->names.items[in.b]);
+		if (!es) {
+			eval_error(ctx, NODE->loc, "no such symbol");
+			goto fail;
+		} else if (es->kind != EVAL_SYMB_VAR) {
+			eval_error(ctx, NODE->loc, "no such variable");
+			goto fail;
+		}
+
+		eval_val_mut(ctx, NODE->loc, in.x, &es->as.var.val, R[in.a]);
+		FAIL_IF_ERR();
+	} VM_NEXT();
+
+	VM_CASE(OP_SETINDEX):
+		eval_index_mut(ctx, NODE, R[in.a], R[in.b], R[in.c]);
+		FAIL_IF_ERR();
+		VM_NEXT();
+
+	VM_CASE(OP_DEFVAR):
+		da_append(&ctx->stack, ((EvalSymbol){
+			.kind = EVAL_SYMB_VAR,
+			.id = ch->names.items[in.b],
+			.as.var.val = R[in.a],
+		}));
+		VM_NEXT();
+
+	VM_CASE(OP_DEFFUNC):
+		eval_def_func(ctx, ch->names.items[in.b], NODE, vp->chunks.items[in.a]);
+		VM_NEXT();
+
+	VM_CASE(OP_DEFGLOBAL):
+		eval_def_global(ctx, ch->names.items[in.b], NODE, vp->chunks.items[in.a]);
+		VM_NEXT();
+
+	VM_CASE(OP_POPTO):
+		ctx->stack.count = ctx->frame + in.a;
+		VM_NEXT();
+
+	VM_CASE(OP_BINOP): {
+		Val v = eval_binop_vals(ctx, NODE, R[in.b], R[in.c]);
+		FAIL_IF_ERR();
+		R[in.a] = v;
+		ctx->temps.count = temps;
+	} VM_NEXT();
+
+	VM_CASE(OP_UNOP): {
+		Val v = eval_unop_val(ctx, NODE, R[in.b]);
+		FAIL_IF_ERR();
+		R[in.a] = v;
+	} VM_NEXT();
+
+	VM_CASE(OP_NEWLIST):
+		R[in.a] = eval_new_heap_val(ctx, VAL_LIST);
+		ctx->temps.count = temps;
+		VM_NEXT();
+
+	VM_CASE(OP_APPEND):
+		da_append(VLIST(R[in.a]), R[in.b]);
+		VM_NEXT();
+
+	VM_CASE(OP_NEWDICT):
+		R[in.a] = eval_new_heap_val(ctx, VAL_DICT);
+		ctx->temps.count = temps;
+		VM_NEXT();
+
+	VM_CASE(OP_DICTSET):
+		ValDict_add(VDICT(R[in.a]), R[in.b], R[in.c]);
+		VM_NEXT();
+
+	VM_CASE(OP_JMP):
+		pc = ch->code.items + INSTR_TARGET(in);
+		VM_NEXT();
+
+	VM_CASE(OP_JMPF):
+		if (VKIND(R[in.a]) != VAL_BOOL) {
+			eval_error(ctx, NODE->loc, "boolean expected");
+			goto fail;
+		}
+
+		if (!VBOOL(R[in.a])) pc = ch->code.items + INSTR_TARGET(in);
+		VM_NEXT();
+
+	VM_CASE(OP_ITER): {
+		Val coll = R[in.b];
+		if (VKIND(coll) != VAL_LIST) {
+			eval_error(ctx, NODE->as.st_foreach.coll->loc, "list expected");
+			goto fail;
+		}
+
+		long long i = VINT(R[in.a]);
+		if ((size_t)i < VLIST(coll)->count) {
+			R[in.c] = val_list_at(coll, i);
+			R[in.a] = val_int(ctx, i + 1);
+			pc++;
+		}
+	} VM_NEXT();
+
+	VM_CASE(OP_CALL):
+	VM_CASE(OP_CALLN): {
+		AST *call = NODE;
+		EvalSymbol *fs = in.op == OP_CALL
+			? &ctx->stack.items[ctx->frame + in.c]
+			: eval_callee(ctx, call);
+		if (!fs) {
+			eval_error(ctx, call->loc, "no such symbol");
+			goto fail;
+		}
+
+		if (fs->kind == EVAL_SYMB_REG_FUNC) {
+			Vals args = {
+				.items = R + in.a,
+				.count = in.b,
+				.capacity = in.b,
+			};
+
+			Val v = fs->as.reg_func(ctx, eval_call_loc(ctx, call), args);
+			FAIL_IF_ERR();
+			R = ctx->regs.items + rbase;
+			R[in.a] = v;
+			ctx->temps.count = temps;
+			VM_NEXT();
+		} else if (fs->kind != EVAL_SYMB_FUNC) {
+			eval_error(ctx, call->loc, "no such function");
+			goto fail;
+		}
+
+		// fs points into the stack, which the arguments may move.
+		AST *def = fs->as.func.node;
+		Chunk *code = fs->as.func.code;
+		long fixed = eval_call_arity(ctx, call, def, in.b);
+		if (fixed < 0) goto fail;
+
+		// A tail call, whose OP_RET follows, replaces the frame of the
+		// function making it and returns to that function's caller.
+		bool tail = in.x && code && frames.count;
+		size_t base = tail ? ctx->frame : ctx->stack.count;
+		ctx->stack.count = base;
+		for (size_t i = 0; i < in.b; i++) {
+			da_append(&ctx->stack, ((EvalSymbol){
+				.kind = EVAL_SYMB_VAR,
+				.as.var.val = R[in.a + i],
+			}));
+		}
+
+		eval_bind_params(ctx, def, base, fixed);
+		ctx->temps.count = temps;
+
+		if (tail) {
+			ch = code;
+			pc = ch->code.items;
+			R = vm_enter(ctx, rbase, ch->nregs);
+			VM_NEXT();
+		}
+
+		// Functions defined by the tree walker, from an EVAL, have no
+		// code and are walked as well.
+		if (!code) {
+			size_t caller = ctx->frame;
+			ctx->frame = base;
+			ctx->state = EVAL_CTX_NONE;
+			Val v = eval(ctx, def->as.func_def.body);
+			FAIL_IF_ERR();
+			while (ctx->tail.def) {
+				def = eval_tail_enter(ctx, base);
+				v = eval(ctx, def->as.func_def.body);
+				FAIL_IF_ERR();
+			}
+			ctx->state = EVAL_CTX_NONE;
+			ctx->stack.count = base;
+			ctx->frame = caller;
+			R = ctx->regs.items + rbase;
+			R[in.a] = v;
+			ctx->temps.count = temps;
+			VM_NEXT();
+		}
+
+		da_append(&frames, ((VmFrame){
+			.ch = ch,
+			.pc = pc,
+			.rbase = rbase,
+			.frame = ctx->frame,
+			.base = base,
+			.dst = in.a,
+		}));
+
+		rbase += ch->nregs;
+		ch = code;
+		pc = ch->code.items;
+		ctx->frame = base;
+		R = vm_enter(ctx, rbase, ch->nregs);
+	} VM_NEXT();
+
+	VM_CASE(OP_RET):
+	VM_CASE(OP_RETNONE): {
+		res = in.op == OP_RET ? R[in.a] : VNONE;
+		if (!frames.count) goto done;
+
+		VmFrame f = frames.items[--frames.count];
+		ctx->stack.count = f.base;
+		ctx->frame = f.frame;
+		ch = f.ch;
+		pc = f.pc;
+		rbase = f.rbase;
+		ctx->regs.count = rbase + ch->nregs;
+		R = ctx->regs.items + rbase;
+		R[f.dst] = res;
+	} VM_NEXT();
+
+	VM_CASE(OP_ERR):
+		eval_error(ctx, NODE->loc, ch->names.items[in.b]);
+		goto fail;
+
+	// in is the first instruction of the fused sequence and pc points to
+	// the second one, bin is the binop the sequence ends with.
+	VM_CASE(OP_BINOP_RL):
+		bin = pc;
+		lv = R[bin->b];
+		LOCAL(rv, pc - 1);
+		goto binop;
+
+	VM_CASE(OP_BINOP_RK):
+		bin = pc;
+		lv = R[bin->b];
+		rv = ch->consts.items[in.b];
+		goto binop;
+
+	VM_CASE(OP_BINOP_LL):
+		bin = pc + 1;
+		LOCAL(lv, pc - 1);
+		LOCAL(rv, pc);
+		goto binop;
+
+	VM_CASE(OP_BINOP_LK):
+		bin = pc + 1;
+		LOCAL(lv, pc - 1);
+		rv = ch->consts.items[pc->b];
+		goto binop;
+
+	VM_CASE(OP_JMPF_RR):
+		bin = pc - 1;
+		lv = R[in.b];
+		rv = R[in.c];
+		goto branch;
+
+	VM_CASE(OP_JMPF_RL):
+		bin = pc;
+		lv = R[bin->b];
+		LOCAL(rv, pc - 1);
+		goto branch;
+
+	VM_CASE(OP_JMPF_RK):
+		bin = pc;
+		lv = R[bin->b];
+		rv = ch->consts.items[in.b];
+		goto branch;
+
+	VM_CASE(OP_JMPF_LL):
+		bin = pc + 1;
+		LOCAL(lv, pc - 1);
+		LOCAL(rv, pc);
+		goto branch;
+
+	VM_CASE(OP_JMPF_LK):
+		bin = pc + 1;
+		LOCAL(lv, pc - 1);
+		rv = ch->consts.items[pc->b];
+		goto branch;
+
+	binop: {
+		Val v;
+		if (!vm_arith(ctx, bin->x, lv, rv, &v)) {
+			v = eval_binop_vals(ctx, NODE_AT(bin), lv, rv);
+			FAIL_IF_ERR();
+		}
+
+		R[bin->a] = v;
+		ctx->temps.count = temps;
+		pc = bin + 1;
+	} VM_NEXT();
+
+	branch: {
+		int cmp = vm_cmp(bin->x, lv, rv);
+		if (cmp < 0) {
+			Val v = eval_binop_vals(ctx, NODE_AT(bin), lv, rv);
+			FAIL_IF_ERR();
+			ctx->temps.count = temps;
+			if (VKIND(v) != VAL_BOOL) {
+				eval_error(ctx, NODE_AT(bin + 1)->loc, "boolean expected");
+				goto fail;
+			}
+			cmp = VBOOL(v);
+		}
+
+		pc = cmp ? bin + 2 : ch->code.items + INSTR_TARGET(bin[1]);
+	} VM_NEXT();
+
+	VM_CASE(OP_SETLOCAL_K):
+		rv = ch->consts.items[in.b];
+		goto set_local;
+
+	VM_CASE(OP_SETLOCAL_L):
+		LOCAL(rv, pc - 1);
+		goto set_local;
+
+	set_local: {
+		Instr *set = pc;
+		EvalSymbol *es = &ctx->stack.items[ctx->frame + set->b];
+		if (es->kind != EVAL_SYMB_VAR) {
+			eval_error(ctx, NODE_AT(set)->loc, "no such variable");
+			goto fail;
+		}
+
+		Val *mut = &es->as.var.val;
+		if (set->x == AST_OP_ADD_EQ && VKIND(*mut) == VAL_INT && VKIND(rv) == VAL_INT) {
+			*mut = val_int(ctx, INT_WRAP(VINT(*mut), +, VINT(rv)));
+		} else {
+			eval_val_mut(ctx, NODE_AT(set)->loc, set->x, mut, rv);
+			FAIL_IF_ERR();
+		}
+
+		pc = set + 1;
+	} VM_NEXT();
+
+#ifndef HAS_COMPUTED_GOTO
+	default: goto fail;
+	}
+	}
+#endif
+
+	#undef NODE
+	#undef NODE_AT
+	#undef FAIL_IF_ERR
+	#undef LOCAL
+
+fail:
+	res = VNONE;
+done:
+	ctx->stack.count = frame;
+	ctx->regs.count = regs_count;
+	ctx->temps.count = temps;
+	if (VIS_GC(res))
+		da_append(&ctx->temps, res);
+	da_free(&frames);
+	return res;
+}
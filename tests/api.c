@@ -0,0 +1,54 @@
+// Embedding API test.
+//
+//   cc -fsanitize=address -o test_api tests/api.c $(ls src/*.c | grep -v main.c) -lm -lpthread
+//   ./test_api
+//
+// Runs programs compiled one per deploy on a single reused context and
+// frees each before the next one runs, the context must not keep
+// anything a program owns.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../include/api.h"
+
+static int failed;
+
+static void print_error(EpslLocation loc, EpslErrorKind ek, char *msg) {
+	(void)ek;
+	fprintf(stderr, "%s:%zu: %s\n", loc.file, loc.line_num + 1, msg);
+}
+
+static void expect_int(const char *name, EpslResult res, long long want) {
+	if (res.got_err || epsl_val_kind(res.val) != EPSL_VAL_INT || epsl_val_int(res.val) != want) {
+		fprintf(stderr, "FAIL %s\n", name);
+		failed = 1;
+	}
+}
+
+static void run_two_programs(EpslEngine engine) {
+	EpslCtx *ctx = epsl_new_ctx(print_error);
+	epsl_set_engine(ctx, engine);
+
+	EpslProgram *first = epsl_compile_str(print_error, "return n * 2;");
+	epsl_reg_var(ctx, "n", epsl_new_int(epsl_eval_ctx(ctx), 21));
+	expect_int("first run", epsl_run(first, ctx), 42);
+	epsl_program_free(first);
+
+	epsl_reg_var(ctx, "n", epsl_new_int(epsl_eval_ctx(ctx), 5));
+	EpslProgram *second = epsl_compile_str(print_error, "return len(str(n)) + n;");
+	expect_int("second run", epsl_run(second, ctx), 6);
+	expect_int("second run again", epsl_run(second, ctx), 6);
+	epsl_program_free(second);
+
+	epsl_reg_var(ctx, "n", epsl_new_int(epsl_eval_ctx(ctx), 1));
+	epsl_free(ctx);
+}
+
+int main(void) {
+	run_two_programs(EPSL_ENGINE_VM);
+	run_two_programs(EPSL_ENGINE_TREE);
+	run_two_programs(EPSL_ENGINE_CLOSURE);
+
+	if (!failed) printf("OK\n");
+	return failed;
+}